@@ -0,0 +1,170 @@
+#include "batch.h"
+#include "emulator.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+
+static const char mooneyePass[] = { 3, 5, 8, 13, 21, 34 };
+static const char mooneyeFail[] = { 0x42, 0x42, 0x42, 0x42, 0x42, 0x42 };
+
+static bool EndsWith(const std::string& str, const char* suffix, size_t len)
+{
+	return str.size() >= len && str.compare(str.size() - len, len, suffix, len) == 0;
+}
+
+/*
+	BATCH_TIMEOUT while the output doesn't say anything yet.
+*/
+static BatchStatus MatchSerialSignature(const std::string& serial)
+{
+	if (EndsWith(serial, mooneyePass, sizeof(mooneyePass)))
+		return BATCH_PASSED;
+	if (EndsWith(serial, mooneyeFail, sizeof(mooneyeFail)))
+		return BATCH_FAILED;
+	if (serial.find("Passed") != std::string::npos)
+		return BATCH_PASSED;
+	if (serial.find("Failed") != std::string::npos)
+		return BATCH_FAILED;
+	return BATCH_TIMEOUT;
+}
+
+/*
+	Start from the ROM's post-boot savestate, or make one.
+*/
+static void SkipBootRom(Emulator& emu, const std::string& romPath, const BatchOptions& options)
+{
+	std::filesystem::path statePath = std::filesystem::path(options.stateDir) /
+		std::filesystem::path(romPath).filename().replace_extension(".state");
+	std::error_code ec;
+
+	if (std::filesystem::exists(statePath, ec) && emu.LoadStateFile(statePath.string().c_str()) == STT_SUCCESS)
+		return;
+	if (emu.RunBootRom(options.cycleBudget) != RUN_STOPPED)
+		return;
+	std::filesystem::create_directories(options.stateDir, ec);
+	emu.SaveStateFile(statePath.string().c_str());
+}
+
+static void RunBatchRom(BatchResult& result, const BatchOptions& options)
+{
+	auto start = std::chrono::steady_clock::now();
+	// Each Emulator is a few hundred KiB, keep it off the worker's stack.
+	auto emu = std::make_unique<Emulator>();
+	size_t serialSeen = 0;
+
+	emu->SetExecMode(options.execMode);
+	if (emu->Load(result.romPath.c_str()) == STT_FAILED) {
+		result.status = BATCH_LOAD_FAILED;
+		return;
+	}
+	if (!options.stateDir.empty())
+		SkipBootRom(*emu, result.romPath, options);
+	result.status = BATCH_TIMEOUT;
+	while (result.status == BATCH_TIMEOUT && emu->GetCycleCount() < options.cycleBudget) {
+		const std::string& serial = emu->GetSerialOutput();
+		RunStatus status = emu->RunUntil([&serial, serialSeen] { return serial.size() != serialSeen; },
+			options.cycleBudget - emu->GetCycleCount());
+
+		if (status == RUN_UNKNOWN_OPCODE)
+			result.status = BATCH_CRASHED;
+		else if (status == RUN_BUDGET_SPENT)
+			break;
+		else {
+			serialSeen = serial.size();
+			result.status = MatchSerialSignature(serial);
+		}
+	}
+	result.mCycles = emu->GetCycleCount();
+	result.serial = emu->GetSerialOutput();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+	Expand the paths given on the command line: directories are searched
+	recursively for .gb files, anything else is taken as a ROM as is. The
+	list comes back sorted so reports are stable between runs.
+*/
+std::vector<std::string> CollectBatchRoms(const std::vector<std::string>& paths)
+{
+	std::vector<std::string> roms;
+	std::error_code ec;
+
+	for (const std::string& path : paths) {
+		if (!std::filesystem::is_directory(path, ec)) {
+			roms.push_back(path);
+			continue;
+		}
+		for (auto it = std::filesystem::recursive_directory_iterator(path, ec);
+			it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+			if (ec)
+				break;
+			if (it->is_regular_file(ec) && it->path().extension() == ".gb")
+				roms.push_back(it->path().string());
+		}
+	}
+	std::sort(roms.begin(), roms.end());
+	return roms;
+}
+
+/*
+	Results come back in the order of roms.
+*/
+std::vector<BatchResult> RunBatch(const std::vector<std::string>& roms, const BatchOptions& options)
+{
+	std::vector<BatchResult> results(roms.size());
+	ThreadPool pool(options.threads);
+
+	for (size_t i = 0; i < roms.size(); i++) {
+		results[i].romPath = roms[i];
+		pool.Submit([&results, &options, i] { RunBatchRom(results[i], options); });
+	}
+	pool.Run();
+	return results;
+}
+
+static const char* BatchStatusName(BatchStatus status)
+{
+	switch (status) {
+	case BATCH_PASSED:
+		return "PASS";
+	case BATCH_FAILED:
+		return "FAIL";
+	case BATCH_TIMEOUT:
+		return "TIMEOUT";
+	case BATCH_CRASHED:
+		return "CRASH";
+	default:
+		return "NOLOAD";
+	}
+}
+
+/*
+	Print one line per ROM and a summary. Returns STT_SUCCESS only if every
+	ROM passed.
+*/
+int PrintBatchResults(const std::vector<BatchResult>& results)
+{
+	int counts[BATCH_LOAD_FAILED + 1] = {};
+	u64 totalCycles = 0;
+	double totalSeconds = 0;
+
+	for (const BatchResult& result : results) {
+		double speed = (result.seconds > 0) ? result.mCycles / (double)CPU_MCYCLES_PER_SECOND / result.seconds : 0;
+
+		fmt::print("{:<8}{:>8.2f}s {:>12} cycles {:>8.1f}x  {}\n", BatchStatusName(result.status), result.seconds,
+			result.mCycles, speed, result.romPath);
+		counts[result.status]++;
+		totalCycles += result.mCycles;
+		totalSeconds += result.seconds;
+	}
+	fmt::print("{} ROMs: {} passed, {} failed, {} timed out, {} crashed, {} not loaded ({} M-cycles, {:.2f} CPU seconds)\n",
+		results.size(), counts[BATCH_PASSED], counts[BATCH_FAILED], counts[BATCH_TIMEOUT], counts[BATCH_CRASHED],
+		counts[BATCH_LOAD_FAILED], totalCycles, totalSeconds);
+	std::fflush(stdout);
+	return ((size_t)counts[BATCH_PASSED] == results.size()) ? STT_SUCCESS : STT_FAILED;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+#include "emulator.h"
+#include <string>
+#include <vector>
+
+// About 60 emulated seconds, plenty for a Blargg or Mooneye test ROM.
+#define BATCH_DEFAULT_CYCLES		(60ULL * CPU_MCYCLES_PER_SECOND)
+
+typedef enum {
+	BATCH_PASSED,
+	BATCH_FAILED,
+	BATCH_TIMEOUT,
+	BATCH_CRASHED,
+	BATCH_LOAD_FAILED,
+} BatchStatus;
+
+typedef struct BatchOptions {
+	u64 cycleBudget = BATCH_DEFAULT_CYCLES;		// M-cycles per ROM
+	int threads = 0;							// 0 = one per hardware thread
+	ExecMode execMode = EXEC_INTERPRETER;
+	std::string stateDir;						// post-boot savestates, empty = always run the boot ROM
+} BatchOptions;
+
+typedef struct BatchResult {
+	std::string romPath;
+	BatchStatus status = BATCH_TIMEOUT;
+	u64 mCycles = 0;
+	double seconds = 0;
+	std::string serial;
+} BatchResult;
+
+/*
+	Headless test ROM runner. Every ROM gets its own Emulator on a worker of
+	a work-stealing pool and runs until its serial output matches a pass or
+	fail signature, it hits an unknown opcode, or its cycle budget runs out.
+	With a state directory, a ROM starts from <stateDir>/<rom name>.state; a
+	ROM without one runs the boot ROM and leaves its post-boot state there
+	for the next run.
+	Recognised signatures:
+	- Blargg: "Passed" / "Failed" in the text it prints over serial.
+	- Mooneye: the Fibonacci bytes 3 5 8 13 21 34 on success, six 0x42 on
+	  failure.
+*/
+std::vector<std::string> CollectBatchRoms(const std::vector<std::string>&);
+std::vector<BatchResult> RunBatch(const std::vector<std::string>&, const BatchOptions&);
+int PrintBatchResults(const std::vector<BatchResult>&);
@@ -0,0 +1,190 @@
+#include "bench.h"
+#include "tiledecode.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+
+#ifdef __linux__
+static int OpenCounter(u32 type, u64 config)
+{
+	perf_event_attr attr = {};
+
+	attr.type = type;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static u64 CacheReadMisses(u64 cache)
+{
+	return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+bool PerfCounters::IsAvailable(PerfCounter counter) const
+{
+	return fds[counter] >= 0;
+}
+
+/*
+	Zero the counters and start counting.
+*/
+void PerfCounters::Start()
+{
+#ifdef __linux__
+	for (int fd : fds) {
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+void PerfCounters::Stop()
+{
+#ifdef __linux__
+	for (int fd : fds) {
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+#endif
+}
+
+/*
+	What was counted between Start and Stop, 0 if the counter isn't available.
+*/
+u64 PerfCounters::Read(PerfCounter counter) const
+{
+	u64 val = 0;
+
+#ifdef __linux__
+	if (fds[counter] >= 0 && read(fds[counter], &val, sizeof(val)) != sizeof(val))
+		val = 0;
+#endif
+	return val;
+}
+
+PerfCounters::PerfCounters()
+{
+	fds.fill(-1);
+#ifdef __linux__
+	fds[PERF_INSTRUCTIONS] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[PERF_L1D_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE, CacheReadMisses(PERF_COUNT_HW_CACHE_L1D));
+	fds[PERF_L1I_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE, CacheReadMisses(PERF_COUNT_HW_CACHE_L1I));
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	for (int fd : fds) {
+		if (fd >= 0)
+			close(fd);
+	}
+#endif
+}
+
+/*
+	A counter's share of each unit, or "-" when it isn't available.
+*/
+static std::string PerUnit(const PerfCounters& counters, PerfCounter counter, u64 units)
+{
+	if (!counters.IsAvailable(counter) || units == 0)
+		return "-";
+	return fmt::format("{:.3f}", counters.Read(counter) / (double)units);
+}
+
+int RunBenchmark(const std::vector<std::string>& roms, const BenchOptions& options)
+{
+	PerfCounters counters;
+	bool perInstruction = options.execMode != EXEC_JIT;
+	size_t measured = 0;
+
+	if (!counters.IsAvailable(PERF_INSTRUCTIONS))
+		fmt::print(stderr, "No hardware performance counters, only timing.\n");
+	fmt::print("Per emulated {}:\n", perInstruction ? "instruction" : "M-cycle");
+	fmt::print("{:>12} {:>10} {:>10} {:>10} {:>8}  {}\n", perInstruction ? "instructions" : "M-cycles",
+		"retired", "L1D miss", "L1I miss", "ns", "ROM");
+	for (const std::string& path : roms) {
+		// Each Emulator is a few hundred KiB, keep it off the stack.
+		auto emu = std::make_unique<Emulator>();
+
+		emu->SetExecMode(options.execMode);
+		if (emu->Load(path.c_str()) == STT_FAILED) {
+			fmt::print(stderr, "Can't load {}, skipped.\n", path);
+			continue;
+		}
+		if (emu->RunCycles(BENCH_WARMUP_CYCLES) == RUN_UNKNOWN_OPCODE) {
+			fmt::print(stderr, "{} stopped at an unknown opcode, skipped.\n", path);
+			continue;
+		}
+
+		u64 cycles = emu->GetCycleCount(), records = emu->GetRecordCount();
+
+		counters.Start();
+		auto start = std::chrono::steady_clock::now();
+		RunStatus status = emu->RunCycles(options.mCycles);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.Stop();
+
+		u64 units = perInstruction ? emu->GetRecordCount() - records : emu->GetCycleCount() - cycles;
+
+		fmt::print("{:>12} {:>10} {:>10} {:>10} {:>8.2f}  {}{}\n", units,
+			PerUnit(counters, PERF_INSTRUCTIONS, units), PerUnit(counters, PERF_L1D_MISSES, units),
+			PerUnit(counters, PERF_L1I_MISSES, units), (units != 0) ? seconds * 1e9 / units : 0, path,
+			(status == RUN_UNKNOWN_OPCODE) ? " (stopped at an unknown opcode)" : "");
+		measured++;
+	}
+	std::fflush(stdout);
+	return (measured != 0) ? STT_SUCCESS : STT_FAILED;
+}
+
+int RunTileBenchmark()
+{
+	const int tiles = PPU_WIDTH / 8 + 1;
+	PerfCounters counters;
+	std::mt19937 random(BENCH_TILE_LINES);
+	std::vector<u8> planes(PPU_HEIGHT * tiles * 2);
+	u8 indices[tiles * 8];
+	u8 shades[tiles * 8];
+
+	for (u8& plane : planes)
+		plane = (u8)random();
+	if (!counters.IsAvailable(PERF_INSTRUCTIONS))
+		fmt::print(stderr, "No hardware performance counters, only timing.\n");
+	fmt::print("Per {}-tile scanline:\n", tiles);
+	fmt::print("{:>8} {:>10} {:>8}\n", "kernel", "retired", "ns");
+	for (int kernel = 0; kernel < TILE_DECODE_KERNEL_COUNT; kernel++) {
+		const char* name = GetTileDecodeKernelName((TileDecodeKernel)kernel);
+		TileDecodeFn decode = GetTileDecoder((TileDecodeKernel)kernel);
+
+		if (decode == nullptr) {
+			fmt::print("{:>8} {:>10} {:>8}  (this CPU can't run it)\n", name, "-", "-");
+			continue;
+		}
+		counters.Start();
+		auto start = std::chrono::steady_clock::now();
+		for (int line = 0; line < BENCH_TILE_LINES; line++)
+			decode(&planes[(line % PPU_HEIGHT) * tiles * 2], tiles, 0xE4, indices, shades);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.Stop();
+
+		fmt::print("{:>8} {:>10} {:>8.2f}\n", name, PerUnit(counters, PERF_INSTRUCTIONS, BENCH_TILE_LINES),
+			seconds * 1e9 / BENCH_TILE_LINES);
+	}
+	std::fflush(stdout);
+	return STT_SUCCESS;
+}
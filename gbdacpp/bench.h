@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "emulator.h"
+#include <array>
+#include <string>
+#include <vector>
+
+// Long enough for the counters to dwarf the cost of reading them.
+#define BENCH_DEFAULT_CYCLES		(10ULL * CPU_MCYCLES_PER_SECOND)
+// Past the boot ROM, with the blocks of the main loop decoded or compiled.
+#define BENCH_WARMUP_CYCLES			(2ULL * CPU_MCYCLES_PER_SECOND)
+// Scanlines per tile decode kernel, about 20 s of frames.
+#define BENCH_TILE_LINES			(PPU_HEIGHT * 60 * 20)
+
+typedef enum {
+	PERF_INSTRUCTIONS,			// host instructions retired
+	PERF_L1D_MISSES,			// L1 data cache read misses
+	PERF_L1I_MISSES,			// L1 instruction cache read misses
+	PERF_COUNTER_COUNT,
+} PerfCounter;
+
+typedef struct BenchOptions {
+	u64 mCycles = BENCH_DEFAULT_CYCLES;		// measured, per ROM
+	ExecMode execMode = EXEC_INTERPRETER;
+	bool tiles = false;						// time the tile decoders instead
+} BenchOptions;
+
+/*
+	User-space hardware counters of the calling thread, through
+	perf_event_open. Only Linux has them; elsewhere, and for a counter the
+	CPU, the kernel or a VM doesn't expose, IsAvailable says so and the
+	benchmark only reports time.
+*/
+class PerfCounters {
+private:
+	std::array<int, PERF_COUNTER_COUNT> fds;
+public:
+	bool IsAvailable(PerfCounter) const;
+	void Start();
+	void Stop();
+	u64 Read(PerfCounter) const;
+	PerfCounters();
+	~PerfCounters();
+};
+
+/*
+	gbdacpp --bench: run every ROM from power-on through a warm-up, then
+	for options.mCycles with the counters on, and print what the host
+	spent per emulated instruction. The JIT mode only records the first
+	instruction of a block, so it is measured per M-cycle instead.
+*/
+int RunBenchmark(const std::vector<std::string>&, const BenchOptions&);
+/*
+	gbdacpp --bench --tiles: decode a frame's worth of random 21-tile
+	scanlines over and over with each kernel the CPU runs, and print what
+	a line costs. The ROMs aren't needed.
+*/
+int RunTileBenchmark();
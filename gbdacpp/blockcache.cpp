@@ -0,0 +1,54 @@
+#include "blockcache.h"
+
+#define BANK_SIZE				(16 * KiB)
+
+BlockCache::BankBlocks& BlockCache::GetBank(u32 bankKey, u16 addr)
+{
+	int region = addr >> 14;
+
+	// Code usually stays in the same bank for a long time, so remember the last
+	// bank used in each 16 KiB region and skip the hash lookup.
+	if (lastBank[region] == nullptr || lastKey[region] != bankKey) {
+		BankBlocks& bank = banks[bankKey];
+		if (bank.empty())
+			bank.resize(BANK_SIZE);
+		lastKey[region] = bankKey;
+		lastBank[region] = &bank;
+	}
+	return *lastBank[region];
+}
+
+BasicBlock* BlockCache::Lookup(u32 bankKey, u16 addr)
+{
+	return GetBank(bankKey, addr)[addr & (BANK_SIZE - 1)].get();
+}
+
+BasicBlock* BlockCache::Insert(u32 bankKey, u16 addr, std::unique_ptr<BasicBlock> block)
+{
+	std::unique_ptr<BasicBlock>& slot = GetBank(bankKey, addr)[addr & (BANK_SIZE - 1)];
+
+	slot = std::move(block);
+	return slot.get();
+}
+
+void BlockCache::InvalidateBank(u32 bankKey)
+{
+	if (banks.erase(bankKey) != 0)
+		lastBank[0] = lastBank[1] = nullptr;
+}
+
+void BlockCache::Clear()
+{
+	banks.clear();
+	lastBank[0] = lastBank[1] = nullptr;
+}
+
+BlockCache::BlockCache() : lastKey{ 0, 0 }, lastBank{ nullptr, nullptr }
+{
+
+}
+
+BlockCache::~BlockCache()
+{
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Cpu;
+
+typedef void (Cpu::*OpcodeHandler)(u8, u8);
+typedef int (*JitCode)(Cpu*);
+
+typedef struct DecodedOp {
+	OpcodeHandler handler;
+	u8 opcode;
+	u8 operandA;
+	u8 operandB;
+	u8 length;
+	u8 mCycles;
+} DecodedOp;
+
+typedef struct BasicBlock {
+	std::vector<DecodedOp> ops;
+	u32 hits = 0;
+	JitCode code = nullptr;
+} BasicBlock;
+
+/*
+	Storage for pre-decoded ROM basic blocks. A block is keyed by the bank (and
+	window) mapped where it starts (see Rom::GetBankKey) plus its start address, so
+	switching banks back and forth keeps every bank's blocks warm. Blocks never
+	cross a 16 KiB bank boundary.
+*/
+class BlockCache {
+private:
+	typedef std::vector<std::unique_ptr<BasicBlock>> BankBlocks;
+
+	std::unordered_map<u32, BankBlocks> banks;
+	u32 lastKey[2];
+	BankBlocks* lastBank[2];
+
+	BankBlocks& GetBank(u32, u16);
+public:
+	BasicBlock* Lookup(u32, u16);
+	BasicBlock* Insert(u32, u16, std::unique_ptr<BasicBlock>);
+	void InvalidateBank(u32);
+	void Clear();
+	BlockCache();
+	~BlockCache();
+};
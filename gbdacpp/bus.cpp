@@ -1,26 +1,498 @@
 #include "bus.h"
+#include <algorithm>
+#include <cstring>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
 
 /*
-	For now we only think about memory as a plain array.
+	Read without side effects on the debugger: no watchpoint fires. For the
+	tracer and whoever else looks at memory from outside the CPU.
 */
-
-void Bus::Write(const u16 addr, const u8 val)
+u8 Bus::Peek(const u16 addr)
 {
-	memory[addr] = val;
+	const u8* page = readBacking[addr >> 8];
+
+	if (page != nullptr)
+		return page[addr & 0xff];
+	if (addr <= 0x7FFF || IN_RANGE(addr, 0xA000, 0xBFFF))
+		return rom->Read(addr);
+	else if (IN_RANGE(addr, 0xFF40, 0xFF4B) && addr != 0xFF46) {
+		SyncPpu();
+		return ppu->ReadRegister(addr);
+	} else if (IN_RANGE(addr, 0xFF04, 0xFF07)) {
+		SyncTimer();
+		return timer->ReadRegister(addr);
+	} else if (addr == 0xFF0F) {
+		Sync();
+	}
+	return memory[addr];
 }
 
-u8 Bus::Read(const u16 addr)
+/*
+	What addr holds, straight from the memory behind it: no watchpoint, and
+	the PPU and the timer aren't caught up first. For scanning code, which
+	has no business in their registers.
+*/
+u8 Bus::PeekCode(const u16 addr) const
 {
-	if (addr >= 0x0000 && addr <= 0x7FFF) {
+	const u8* page = readBacking[addr >> 8];
+
+	if (page != nullptr)
+		return page[addr & 0xff];
+	if (addr <= 0x7FFF || IN_RANGE(addr, 0xA000, 0xBFFF))
 		return rom->Read(addr);
-	} else if (addr == 0xFF44)
-		return 0x90;
 	return memory[addr];
 }
 
-Bus::Bus(Rom* pRom) : rom(pRom)
+u8 Bus::SlowRead(const u16 addr)
+{
+	u8 val = Peek(addr);
+
+	if (watches != nullptr && (watches[addr] & WATCH_READ))
+		Watch(addr, val, WATCH_READ);
+	return val;
+}
+
+void Bus::SlowWrite(const u16 addr, const u8 val)
+{
+	if (trackDirty && !dirtyPages[addr >> 8])
+		MarkDirty(addr >> 8);
+	if (watches != nullptr && (watches[addr] & WATCH_WRITE))
+		Watch(addr, val, WATCH_WRITE);
+
+	u8* page = writeBacking[addr >> 8];
+
+	if (page != nullptr) {
+		page[addr & 0xff] = val;
+		return;
+	}
+	if (addr <= 0x7FFF || IN_RANGE(addr, 0xA000, 0xBFFF)) {
+		rom->Write(addr, val);
+		// A bank register write: follow the MBC to its new banks.
+		if (rom->GetMapGeneration() != mapGeneration)
+			MapRom();
+		return;
+	}
+	if (IN_RANGE(addr, 0xFF40, 0xFF4B) && addr != 0xFF46) {
+		SyncPpu();
+		ppu->WriteRegister(addr, val);
+		// LCDC, STAT and LYC can move the next event, or raise one now.
+		memory[0xFF0F] |= ppu->Tick(0);
+		SchedulePpu();
+		return;
+	}
+	if (IN_RANGE(addr, 0xFF04, 0xFF07)) {
+		SyncTimer();
+		timer->WriteRegister(addr, val);
+		ScheduleTimer();
+		return;
+	}
+	// Interrupts raised so far have to land before IF is overwritten.
+	if (addr == 0xFF0F)
+		Sync();
+	memory[addr] = val;
+	if (addr == 0xFF02 && (val & 0x81) == 0x81) {
+		/*
+			A transfer on the internal clock. Nothing is plugged into the link
+			port, so it completes at once: the byte goes to the capture buffer
+			and the all-ones of an idle line shifts in.
+		*/
+		serialOutput.push_back((char)memory[0xFF01]);
+		memory[0xFF01] = 0xFF;
+		memory[0xFF02] = val & 0x7F;
+		memory[0xFF0F] |= INT_SERIAL;
+	}
+	if (addr == 0xFF46) {
+		// OAM DMA, done all at once. It bypasses the write table, so mark OAM here.
+		u8* oam = ppu->GetOam();
+
+		if (trackDirty && !dirtyPages[0xFE])
+			MarkDirty(0xFE);
+		for (int i = 0; i < 0xA0; i++)
+			oam[i] = Read((val << 8) | i);
+	}
+	if (addr == 0xFF50 && !rom->IsBootROMUnlocked()) {
+		spdlog::info("BootRom unlocked!");
+		rom->UnlockBootROM();
+		MapRom();
+	}
+}
+
+/*
+	Point the 0x0000-0x7FFF and 0xA000-0xBFFF pages at whatever the cartridge
+	currently maps there. Needs to run again after every change of the
+	cartridge mapping; only the windows that actually moved are rewritten.
+*/
+void Bus::MapRom()
+{
+	for (int window = 0; window < 2; window++) {
+		const u8* base = rom->GetRomWindow(window);
+
+		if (base == mappedRom[window])
+			continue;
+		for (int i = 0; i < 0x40; i++)
+			MapReadPage((window << 6) + i, (base != nullptr) ? base + (i << 8) : nullptr);
+		mappedRom[window] = base;
+	}
+	// The boot ROM overlays the first page until it is unlocked.
+	MapReadPage(0x00, rom->GetPage(0x00));
+
+	u8* ram = rom->GetRamWindow();
+
+	if (ram != mappedRam) {
+		for (int i = 0; i < 0x20; i++) {
+			MapReadPage(0xA0 + i, (ram != nullptr) ? ram + (i << 8) : nullptr);
+			MapWritePage(0xA0 + i, (ram != nullptr) ? ram + (i << 8) : nullptr);
+		}
+		mappedRam = ram;
+	}
+	mapGeneration = rom->GetMapGeneration();
+}
+
+void Bus::MapReadPage(int page, const u8* base)
+{
+	readBacking[page] = base;
+	readPages[page] = (readWatchCount[page] == 0) ? base : nullptr;
+}
+
+void Bus::MapWritePage(int page, u8* base)
+{
+	writeBacking[page] = base;
+	writePages[page] = (writeWatchCount[page] == 0 && (!trackDirty || dirtyPages[page])) ? base : nullptr;
+}
+
+/*
+	Watch addr for the accesses in `types` (WatchType bits); no bits removes
+	the watchpoint. Only the first hit of a step is kept.
+*/
+void Bus::SetWatchpoint(const u16 addr, const u8 types)
+{
+	int page = addr >> 8;
+
+	if (watches == nullptr)
+		watches = std::make_unique<u8[]>(0x10000);
+	readWatchCount[page] += ((types & WATCH_READ) != 0) - ((watches[addr] & WATCH_READ) != 0);
+	writeWatchCount[page] += ((types & WATCH_WRITE) != 0) - ((watches[addr] & WATCH_WRITE) != 0);
+	watches[addr] = types & (WATCH_READ | WATCH_WRITE);
+	MapReadPage(page, readBacking[page]);
+	MapWritePage(page, writeBacking[page]);
+}
+
+void Bus::ClearWatchpoints()
+{
+	watches.reset();
+	readWatchCount.fill(0);
+	writeWatchCount.fill(0);
+	for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+		MapReadPage(page, readBacking[page]);
+		MapWritePage(page, writeBacking[page]);
+	}
+	watchHitPending = false;
+}
+
+void Bus::Watch(const u16 addr, const u8 val, const WatchType type)
+{
+	if (watchHitPending)
+		return;
+	watchHit = { addr, val, type };
+	watchHitPending = true;
+}
+
+/*
+	The watchpoint hit since the last call, if any.
+*/
+bool Bus::TakeWatchHit(WatchHit& hit)
+{
+	if (!watchHitPending)
+		return false;
+	hit = watchHit;
+	watchHitPending = false;
+	return true;
+}
+
+void Bus::MarkDirty(int page)
+{
+	dirtyPages[page] = true;
+	MapWritePage(page, writeBacking[page]);
+	// Echo RAM writes land in WRAM, whose page can then go back on the fast path too.
+	if (IN_RANGE(page, 0xE0, 0xFD) && !dirtyPages[page - 0x20]) {
+		dirtyPages[page - 0x20] = true;
+		MapWritePage(page - 0x20, writeBacking[page - 0x20]);
+	}
+}
+
+/*
+	Start (and clear) or stop keeping track of the pages written to.
+*/
+void Bus::TrackDirtyPages(bool on)
+{
+	trackDirty = on;
+	ResetDirtyPages(false);
+}
+
+/*
+	Mark every page clean, or dirty, e.g. after loading a state that may
+	differ anywhere.
+*/
+void Bus::ResetDirtyPages(bool dirty)
+{
+	if (dirty)
+		dirtyPages.set();
+	else
+		dirtyPages.reset();
+	for (int page = 0; page < BUS_PAGE_COUNT; page++)
+		MapWritePage(page, writeBacking[page]);
+}
+
+/*
+	The pages written since the last reset. Page 0xFF only counts writes
+	from the CPU, not the interrupt flags raised in Tick.
+*/
+const PageSet& Bus::GetDirtyPages() const
 {
+	return dirtyPages;
+}
+
+/*
+	How many of the len bytes from addr on, going up (step 1) or down (step
+	-1), are on pages the fast path of Write (or Read) reaches directly,
+	up to the first that isn't or the end of the address space.
+*/
+u32 Bus::DirectSpan(const u16 addr, const int step, const u32 len, const bool write) const
+{
+	u32 span = 0;
+	int page = addr >> 8;
+
+	// Partial first page: the bytes from addr to the page's end in the direction of step.
+	for (u32 run = (step > 0) ? 0x100 - (addr & 0xff) : (addr & 0xff) + 1; span < len; run = 0x100) {
+		if (page < 0 || page >= BUS_PAGE_COUNT)
+			break;
+		if ((write ? (const u8*)writePages[page] : readPages[page]) == nullptr)
+			break;
+		span += run;
+		page += step;
+	}
+	return std::min(span, len);
+}
 
+/*
+	Store val in the len bytes from addr on, which DirectSpan has to have
+	found directly writable.
+*/
+void Bus::Fill(const u16 addr, const u32 len, const u8 val)
+{
+	u32 done = 0;
+
+	while (done < len) {
+		u16 at = addr + done;
+		u32 run = std::min<u32>(0x100 - (at & 0xff), len - done);
+
+		std::memset(writePages[at >> 8] + (at & 0xff), val, run);
+		done += run;
+	}
+}
+
+/*
+	Copy len bytes from src to dst, byte by byte going up like a loop of
+	Reads and Writes would, so an overlapping dst repeats what it copied.
+	Both ranges have to be direct, see DirectSpan.
+*/
+void Bus::Copy(const u16 dst, const u16 src, const u32 len)
+{
+	u32 done = 0;
+
+	while (done < len) {
+		u16 to = dst + done, from = src + done;
+		u32 run = std::min<u32>({ 0x100u - (to & 0xff), 0x100u - (from & 0xff), len - done });
+		u8* out = writePages[to >> 8] + (to & 0xff);
+		const u8* in = readPages[from >> 8] + (from & 0xff);
+
+		if (out > in && out < in + run) {
+			for (u32 i = 0; i < run; i++)
+				out[i] = in[i];
+		} else {
+			std::memmove(out, in, run);
+		}
+		done += run;
+	}
+}
+
+/*
+	Run the PPU up to the scheduler's clock and collect the interrupts it
+	raised in IF.
+*/
+void Bus::SyncPpu()
+{
+	u64 behind = scheduler.Now() - ppuSynced;
+
+	// Only an LCD that has been off for a long while can be this far behind, and it doesn't run.
+	memory[0xFF0F] |= ppu->Tick((int)std::min<u64>(behind, INT32_MAX));
+	ppuSynced = scheduler.Now();
+}
+
+void Bus::SchedulePpu()
+{
+	int wait = ppu->CyclesToNextEvent();
+
+	if (wait < 0)
+		scheduler.Cancel(EVENT_PPU);
+	else
+		scheduler.Schedule(EVENT_PPU, ppuSynced + wait);
+}
+
+void Bus::SyncTimer()
+{
+	memory[0xFF0F] |= timer->Sync(scheduler.Now());
+}
+
+void Bus::ScheduleTimer()
+{
+	u64 next = timer->NextEvent();
+
+	if (next == EVENT_NEVER)
+		scheduler.Cancel(EVENT_TIMER);
+	else
+		scheduler.Schedule(EVENT_TIMER, next);
+}
+
+/*
+	Handle every event that came due during the last step.
+*/
+void Bus::RunEvents()
+{
+	EventType type;
+
+	eventsRanAt = scheduler.Now();
+	while (scheduler.PopDue(type)) {
+		switch (type) {
+		case EVENT_PPU:
+			SyncPpu();
+			SchedulePpu();
+			break;
+		case EVENT_TIMER:
+			SyncTimer();
+			ScheduleTimer();
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+	Bring every component up to the current cycle, e.g. before its state is
+	saved.
+*/
+void Bus::Sync()
+{
+	SyncPpu();
+	SyncTimer();
+}
+
+/*
+	How far a sleeping CPU can skip ahead: up to the next event, at most
+	BUS_MAX_IDLE_MCYCLES so that runs with nothing scheduled still end.
+*/
+int Bus::CyclesToNextEvent() const
+{
+	return (int)std::clamp<u64>(scheduler.NextDeadline() - scheduler.Now(), 1, BUS_MAX_IDLE_MCYCLES);
+}
+
+/*
+	The M-cycles since events were last handled, capped like
+	CyclesToNextEvent.
+*/
+int Bus::CyclesSinceEvents() const
+{
+	return (int)std::min<u64>(scheduler.Now() - eventsRanAt, BUS_MAX_IDLE_MCYCLES);
+}
+
+/*
+	Whether a button is down, which ends STOP. There is no joypad input yet.
+*/
+bool Bus::JoypadPressed() const
+{
+	return false;
+}
+
+/*
+	Every byte the ROM sent over the link port so far. Test ROMs report
+	their results this way.
+*/
+const std::string& Bus::GetSerialOutput() const
+{
+	return serialOutput;
+}
+
+/*
+	The memory the bus owns itself: WRAM, and the I/O registers and HRAM at
+	0xFF00-0xFFFF. Everything else in `memory` is shadowed by the cartridge,
+	the PPU, the timer or echo RAM. The serial capture is output, not machine state.
+	The timer's section follows, since its cycles are the scheduler's.
+	Load after the Rom and Ppu, so the page tables follow the restored banks.
+*/
+void Bus::SaveState(StateWriter& state) const
+{
+	state.BeginSection(STATE_TAG_BUS);
+	state.Put(&memory[0xC000], 0x2000);
+	state.Put(&memory[0xFF00], 0x100);
+	state.EndSection();
+	timer->SaveState(state);
+}
+
+void Bus::LoadState(StateReader& state)
+{
+	state.BeginSection(STATE_TAG_BUS);
+	state.GetPages(&memory[0xC000], 0xC0, 0x20);
+	state.Get(&memory[0xFF00], 0x100);
+	state.EndSection();
+	MapRom();
+	// Saved states are synced, so the schedule follows from the restored components.
+	scheduler.Reset();
+	ppuSynced = eventsRanAt = 0;
+	// States before version 3 were made before the timer ran; it starts from power-on.
+	if (state.GetVersion() >= 3)
+		timer->LoadState(state, scheduler.Now());
+	else
+		timer->Reset(scheduler.Now());
+	SchedulePpu();
+	ScheduleTimer();
+}
+
+Bus::Bus(Rom* pRom, Ppu* pPpu, Timer* pTimer) : readPages{}, writePages{}, readBacking{}, writeBacking{},
+	readWatchCount{}, writeWatchCount{}, watchHit{}, watchHitPending(false), trackDirty(false), dirtyPages(), rom(pRom),
+	ppu(pPpu), timer(pTimer), mappedRom{}, mappedRam(nullptr), mapGeneration(0), scheduler(), ppuSynced(0), eventsRanAt(0), memory{}
+{
+	for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+		MapReadPage(page, &memory[page << 8]);
+		MapWritePage(page, &memory[page << 8]);
+	}
+	// Echo RAM mirrors 0xC000-0xDDFF.
+	for (int page = 0xE0; page <= 0xFD; page++) {
+		MapReadPage(page, &memory[(page - 0x20) << 8]);
+		MapWritePage(page, &memory[(page - 0x20) << 8]);
+	}
+	// VRAM and OAM live in the PPU.
+	for (int page = 0x80; page <= 0x9F; page++) {
+		MapReadPage(page, ppu->GetVram() + ((page - 0x80) << 8));
+		MapWritePage(page, ppu->GetVram() + ((page - 0x80) << 8));
+	}
+	MapReadPage(0xFE, ppu->GetOam());
+	MapWritePage(0xFE, ppu->GetOam());
+	// I/O registers and HRAM.
+	MapReadPage(0xFF, nullptr);
+	MapWritePage(0xFF, nullptr);
+	// The cartridge: nothing is mapped until a ROM is loaded.
+	for (int page = 0x00; page <= 0x7F; page++) {
+		MapReadPage(page, nullptr);
+		MapWritePage(page, nullptr);
+	}
+	for (int page = 0xA0; page <= 0xBF; page++) {
+		MapReadPage(page, nullptr);
+		MapWritePage(page, nullptr);
+	}
+	// Nothing to schedule: the LCD starts off, and turning it on goes through SlowWrite.
 }
 
 Bus::~Bus()
@@ -2,14 +2,161 @@
 
 #include "common.h"
 #include "rom.h"
+#include "ppu.h"
+#include "timer.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include <memory>
+#include <string>
 
+#define BUS_PAGE_COUNT		256
+#define BUS_MAX_IDLE_MCYCLES	PPU_MCYCLES_PER_FRAME
+
+typedef enum {
+	WATCH_READ = (1U << 0),
+	WATCH_WRITE = (1U << 1),
+} WatchType;
+
+typedef struct WatchHit {
+	u16 addr;
+	u8 val;
+	WatchType type;
+} WatchHit;
+
+/*
+	The address space is split into 256-byte pages. Pages backed by plain
+	memory (ROM, cartridge RAM, VRAM, WRAM, OAM) are reached through the read/write page
+	tables with a single indexed load; a null entry sends the access to the
+	slow path, which handles I/O registers, HRAM, ROM writes and anything the
+	mapper does not expose directly.
+
+	Watchpoints ride on the same split: a page holding one is taken out of
+	the tables, so only its accesses pay for the check, in the slow path.
+	The backing tables keep what each page maps regardless.
+
+	So does dirty page tracking: while it is on, clean pages are left out
+	of the write table. The first write to one takes the slow path, which
+	marks the page dirty and puts it back, so tracking costs one slow write
+	per page between resets and nothing when off.
+
+	Time goes through the scheduler. Tick only advances its clock; the PPU
+	and the timer are caught up when their next event comes due, or before
+	the CPU touches their registers or IF.
+*/
 class Bus {
 private:
+	std::array<const u8*, BUS_PAGE_COUNT> readPages;
+	std::array<u8*, BUS_PAGE_COUNT> writePages;
+	std::array<const u8*, BUS_PAGE_COUNT> readBacking;
+	std::array<u8*, BUS_PAGE_COUNT> writeBacking;
+	std::unique_ptr<u8[]> watches;		// WatchType bits per address, from the first watchpoint on
+	std::array<u16, BUS_PAGE_COUNT> readWatchCount;
+	std::array<u16, BUS_PAGE_COUNT> writeWatchCount;
+	WatchHit watchHit;
+	bool watchHitPending;
+	bool trackDirty;
+	PageSet dirtyPages;
 	Rom* rom;
+	Ppu* ppu;
+	Timer* timer;
+	const u8* mappedRom[2];
+	u8* mappedRam;
+	u32 mapGeneration;
+	Scheduler scheduler;
+	u64 ppuSynced;			// the scheduler cycle the PPU has been run up to
+	u64 eventsRanAt;		// the scheduler cycle events were last handled at
 	u8 memory[0x10000];
+	std::string serialOutput;
+
+	void MapReadPage(int, const u8*);
+	void MapWritePage(int, u8*);
+	void Watch(const u16, const u8, const WatchType);
+	void MarkDirty(int);
+	void SyncPpu();
+	void SchedulePpu();
+	void SyncTimer();
+	void ScheduleTimer();
+	void RunEvents();
+	u8 SlowRead(const u16);
+	void SlowWrite(const u16, const u8);
 public:
-	void Write(const u16, const u8);
-	u8 Read(const u16);
-	Bus(Rom *);
+	void MapRom();
+	u8 Peek(const u16);
+	u8 PeekCode(const u16) const;
+	void SetWatchpoint(const u16, const u8);
+	void ClearWatchpoints();
+	bool TakeWatchHit(WatchHit&);
+	void TrackDirtyPages(bool);
+	void ResetDirtyPages(bool);
+	const PageSet& GetDirtyPages() const;
+	u32 DirectSpan(const u16, const int, const u32, const bool) const;
+	void Fill(const u16, const u32, const u8);
+	void Copy(const u16, const u16, const u32);
+	void Sync();
+	int CyclesToNextEvent() const;
+	int CyclesSinceEvents() const;
+	bool JoypadPressed() const;
+	/*
+		Changes whenever a bank switch or the boot ROM unlock remaps the
+		cartridge, as Rom::GetMapGeneration.
+	*/
+	inline u32 GetMapGeneration() const
+	{
+		return mapGeneration;
+	}
+	/*
+		Whether what a read of addr returns can only change at a scheduled
+		event or through a write. Everything but DIV and TIMA, which follow
+		the clock between events.
+	*/
+	static inline bool ChangesAtEventsOnly(const u16 addr)
+	{
+		return !IN_RANGE(addr, 0xFF04, 0xFF05);
+	}
+	/*
+		The interrupts both requested in IF and enabled in IE. IF is up to
+		date between steps: whatever raises an interrupt does so in an
+		event, or right at the register write that causes it.
+	*/
+	inline u8 PendingInterrupts() const
+	{
+		return memory[0xFFFF] & memory[0xFF0F] & 0x1F;
+	}
+	/*
+		Account for the mCycles the CPU just ran. The rest of the machine
+		only runs when one of its events comes due.
+	*/
+	inline void Tick(int mCycles)
+	{
+		if (scheduler.Advance(mCycles))
+			RunEvents();
+	}
+	void SaveState(StateWriter&) const;
+	void LoadState(StateReader&);
+	const std::string& GetSerialOutput() const;
+	inline void Write(const u16 addr, const u8 val)
+	{
+		u8* page = writePages[addr >> 8];
+
+		if (page != nullptr)
+			page[addr & 0xff] = val;
+		else
+			SlowWrite(addr, val);
+	}
+	/*
+		The page addr is in, to read straight from, or nullptr when its
+		reads have to go through Read.
+	*/
+	inline const u8* ReadPage(const u16 addr) const
+	{
+		return readPages[addr >> 8];
+	}
+	inline u8 Read(const u16 addr)
+	{
+		const u8* page = readPages[addr >> 8];
+
+		return (page != nullptr) ? page[addr & 0xff] : SlowRead(addr);
+	}
+	Bus(Rom *, Ppu *, Timer *);
 	~Bus();
 };
@@ -9,6 +9,7 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 typedef int8_t i8;
+typedef int64_t i64;
 
 #define KiB                 1024U
 #define MiB                 1048576U
@@ -23,3 +24,11 @@ typedef int8_t i8;
 
 #define STT_FAILED			0U
 #define STT_SUCCESS			1U
+
+typedef enum {
+	INT_VBLANK = (1U << 0),
+	INT_STAT = (1U << 1),
+	INT_TIMER = (1U << 2),
+	INT_SERIAL = (1U << 3),
+	INT_JOYPAD = (1U << 4),
+} Interrupt;
@@ -1,21 +1,28 @@
 #include "cpu.h"
 #include <array>
+#include <algorithm>
 #define FMT_HEADER_ONLY
 #include <fmt/core.h>
 #include <spdlog/spdlog.h>
 
 #define OPCODE_TBL_SIZE			256
-#define OPCODE_UNKNOWN			-1
+#define MAX_BLOCK_OPS			64
+#define CRASH_LOG_LINES			16
+#define JIT_THRESHOLD			16
 
-std::array<u8, 256> mainOpcodeMCycles = {
+/*
+	Conditional instructions are listed with their untaken cost, the handler
+	adds the extra M-cycles itself when the branch is taken.
+*/
+static constexpr std::array<u8, OPCODE_TBL_SIZE> mainOpcodeMCycles = {
     // 0x0_
     1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1,
     // 0x1_
     1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1,
     // 0x2_
-    3, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1,
     // 0x3_
-    3, 3, 2, 2, 3, 3, 3, 1, 3, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1,
     // 0x4_
     1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
     // 0x5_
@@ -33,31 +40,152 @@ std::array<u8, 256> mainOpcodeMCycles = {
     // 0xB_
     1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
     // 0xC_
-    5, 3, 4, 4, 6, 4, 2, 4, 5, 4, 4, 1, 6, 6, 2, 4,
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 1, 3, 6, 2, 4,
     // 0xD_
-    5, 3, 4, 1, 6, 4, 2, 4, 5, 4, 4, 1, 6, 1, 2, 4,
+    2, 3, 3, 1, 3, 4, 2, 4, 2, 4, 3, 1, 3, 1, 2, 4,
     // 0xE_
     3, 3, 2, 1, 1, 4, 2, 4, 4, 1, 4, 1, 1, 1, 2, 4,
     // 0xF_
     3, 3, 2, 1, 1, 4, 2, 4, 3, 2, 4, 1, 1, 1, 2, 4
 };
 
-void Cpu::SetFlag(CpuFlag flag, bool val)
+static constexpr std::array<u8, OPCODE_TBL_SIZE> mainOpcodeLength = {
+    // 0x0_
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+    // 0x1_
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    // 0x2_
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    // 0x3_
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    // 0x4_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0x5_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0x6_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0x7_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0x8_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0x9_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0xA_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0xB_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // 0xC_
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    // 0xD_
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+    // 0xE_
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    // 0xF_
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1
+};
+
+/*
+	Instructions that may change PC or the interrupt state terminate a basic block.
+*/
+static constexpr bool EndsBlock(u8 opcode)
+{
+	switch (opcode) {
+	case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+	case 0x76: case 0xc0: case 0xc2: case 0xc3: case 0xc4: case 0xc8:
+	case 0xc9: case 0xca: case 0xcc: case 0xcd: case 0xd0: case 0xd2:
+	case 0xd4: case 0xd8: case 0xd9: case 0xda: case 0xdc: case 0xe9:
+	case 0xf3: case 0xfb:
+		return true;
+	default:
+		return (opcode & 0xc7) == 0xc7;		/* RST */
+	}
+}
+
+/*
+	Instructions that store to memory. A store may switch banks or unlock the
+	boot ROM, which RunBlock has to see before the next instruction runs.
+*/
+static constexpr bool WritesMemory(u8 opcode)
+{
+	switch (opcode) {
+	case 0x02: case 0x08: case 0x12: case 0x22: case 0x32: case 0x34:
+	case 0x35: case 0x36: case 0xc5: case 0xd5: case 0xe0: case 0xe2:
+	case 0xe5: case 0xea: case 0xf5:
+		return true;
+	default:
+		return (opcode & 0xf8) == 0x70 && opcode != 0x76;		/* LD (HL),r8 */
+	}
+}
+
+/*
+	Whether an instruction pair can run as one op: the first one has to
+	leave PC and the memory map alone so that the second always follows it,
+	and both have to fit their operands in the op's two bytes.
+*/
+static constexpr bool FusesWith(u8 first, u8 second)
 {
-	regs.F() = (val) ? (regs.F() | flag) : (regs.F() & ~flag);
+	return !EndsBlock(first) && !WritesMemory(first) && first != 0xcb &&
+		mainOpcodeLength[first] + mainOpcodeLength[second] <= 4;
 }
 
-bool Cpu::GetFlag(CpuFlag flag)
+typedef struct FusedPair {
+	u8 first;
+	u8 second;
+} FusedPair;
+
+/*
+	The pairs EXEC_FUSED decodes into one op, most frequent first. Generated
+	with gbdacpp --fusion-profile over a corpus of test ROMs, boot ROM
+	included; the shares are of all the instructions it ran.
+*/
+static constexpr std::array<FusedPair, 16> fusedPairs = { {
+	{ 0xfe, 0x20 },		// 22.36%
+	{ 0xf0, 0xfe },		// 22.36%
+	{ 0x05, 0x20 },		//  3.28%
+	{ 0xf0, 0x77 },		//  1.52%
+	{ 0x0d, 0x20 },		//  0.10%
+	{ 0x17, 0x05 },		//  0.01%
+	{ 0x17, 0xc1 },		//  0.01%
+	{ 0xc1, 0xcb },		//  0.01%
+	{ 0x06, 0x22 },		//  0.01%
+	{ 0x0e, 0xf0 },		//  0.01%
+	{ 0x1d, 0x20 },		//  0.01%
+	{ 0x1e, 0xfe },		//  0.01%
+	{ 0x06, 0x05 },		//  0.00%
+	{ 0x15, 0x20 },		//  0.00%
+	{ 0x0e, 0x24 },		//  0.00%
+	{ 0x1e, 0x0e },		//  0.00%
+} };
+
+static constexpr bool AllFusable()
 {
-	return (regs.F() & flag) != 0;
+	for (const FusedPair& pair : fusedPairs)
+		if (!FusesWith(pair.first, pair.second))
+			return false;
+	return true;
 }
 
-void Cpu::SetZNHC(bool z, bool n, bool h, bool c)
+static_assert(AllFusable(), "fusedPairs has a pair that can't be fused");
+
+/*
+	Load AF, moving Z out of F into zero.
+*/
+void Cpu::SetAF(u16 af)
+{
+	regs.AF() = af;
+	zero = !(regs.F() & FLAG_Z);
+	regs.F() &= ~FLAG_Z;
+}
+
+/*
+	The ALU handlers below set Z through zero and the other three flags with
+	one store to F, keeping C where the instruction leaves it alone and the
+	low nibble, which no instruction writes. H is bit 4 of the carry bits
+	(a ^ b ^ result) of an addition or subtraction, moved up to bit 5.
+*/
+static inline u8 HalfCarry(u32 carryBits)
 {
-	SetFlag(FLAG_Z, z);
-	SetFlag(FLAG_N, n);
-	SetFlag(FLAG_H, h);
-	SetFlag(FLAG_C, c);
+	return (carryBits & 0x10) << 1;
 }
 
 void Cpu::StackPush(u8 val)
@@ -72,14 +200,253 @@ u8 Cpu::StackPop()
 	return bus->Read(regs.SP());
 }
 
+/*
+	The M-cycles an iteration of the loop from head to the JR at branch
+	takes, if it is an idle loop, else 0. An idle loop only reads values
+	that change at scheduled events (see Bus::ChangesAtEventsOnly), tests
+	them and stores nothing, so until the next event every iteration leaves
+	the machine just as the one before did. jrCycles is what the taken JR
+	costs.
+*/
+int Cpu::IdleLoopCycles(u16 head, u16 branch, int jrCycles)
+{
+	u16 size = branch - head;
+	u16 addr = head;
+	int cycles = jrCycles;
+
+	if (size > IDLE_LOOP_MAX_BYTES)
+		return 0;
+	while ((u16)(addr - head) < size) {
+		u8 opcode = bus->PeekCode(addr);
+
+		switch (opcode) {
+		case 0x00:		// NOP
+		case 0xfe:		// CP u8
+			break;
+		case 0xf0:		// LDH A,(u8)
+			if (!Bus::ChangesAtEventsOnly(0xff00 | bus->PeekCode(addr + 1)))
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+		cycles += mainOpcodeMCycles[opcode];
+		addr += mainOpcodeLength[opcode];
+	}
+	return (addr == branch) ? cycles : 0;
+}
+
+/*
+	Whether the loop from head to the JR NZ at branch is a bulk loop, which
+	is then described in bulk. jrCycles is what the taken JR costs.
+*/
+bool Cpu::MatchBulkLoop(u16 head, u16 branch, int jrCycles, BulkLoop& bulk)
+{
+	BulkLoop match = { jrCycles, 0, false, nullptr, nullptr };
+	bool incDE = false;
+	u16 addr = head;
+
+	if ((u16)(branch - head) > BULK_LOOP_MAX_BYTES || bus->PeekCode(branch) != 0x20)
+		return false;
+	while (addr != branch) {
+		u8 opcode = bus->PeekCode(addr);
+
+		// The JR has to test what the counter just set.
+		if (match.test != nullptr || (u16)(addr - head) > BULK_LOOP_MAX_BYTES)
+			return false;
+		switch (opcode) {
+		case 0x1a:		// LD A,(DE)
+			if (match.copy || match.step != 0)
+				return false;
+			match.copy = true;
+			break;
+		case 0x13:		// INC DE
+			if (!match.copy || incDE)
+				return false;
+			incDE = true;
+			break;
+		case 0x22:		// LD (HL+),A
+		case 0x32:		// LD (HL-),A
+			if (match.step != 0)
+				return false;
+			match.step = (opcode == 0x22) ? 1 : -1;
+			break;
+		case 0x05: match.counter = &CpuRegs::B; break;		// DEC r8
+		case 0x0d: match.counter = &CpuRegs::C; break;
+		case 0x15: match.counter = &CpuRegs::D; break;
+		case 0x1d: match.counter = &CpuRegs::E; break;
+		case 0xcb:
+			if (bus->PeekCode(addr + 1) != 0x7c)		// BIT 7,H
+				return false;
+			match.mCycles += cbOpcodeTable[0x7c].mCycles;
+			match.test = cbOpcodeTable[0x7c].handler;
+			break;
+		default:
+			return false;
+		}
+		if (match.counter != nullptr && match.test == nullptr)
+			match.test = mainOpcodeTable[opcode].handler;
+		match.mCycles += mainOpcodeMCycles[opcode];
+		addr += mainOpcodeLength[opcode];
+	}
+	if (match.test == nullptr || match.step == 0 || match.copy != incDE)
+		return false;
+	// Copies go one way only, and count with a register DE doesn't hold.
+	if (match.copy && (match.step < 0 || match.counter == &CpuRegs::D || match.counter == &CpuRegs::E))
+		return false;
+	bulk = match;
+	return true;
+}
+
+/*
+	What kind of loop the JR at branch closes back to head. The JR's cost
+	is a constant, since mCycles may also hold an instruction fused ahead
+	of it.
+*/
+Cpu::LoopMatch Cpu::MatchLoop(u16 head, u16 branch)
+{
+	LoopMatch match = { LOOP_NONE, IdleLoopCycles(head, branch, JR_TAKEN_MCYCLES), {} };
+
+	if (match.idleCycles != 0)
+		match.kind = LOOP_IDLE;
+	else if (MatchBulkLoop(head, branch, JR_TAKEN_MCYCLES, match.bulk))
+		match.kind = LOOP_BULK;
+	return match;
+}
+
+/*
+	Tell TakeLoop what the JR at branch just closed. A loop in the ROM
+	stays what it is until the memory map changes, so it is only matched
+	the first time and then looked up; code anywhere else can be
+	rewritten under us and is matched every time.
+*/
+void Cpu::EnterLoop(u16 head, u16 branch)
+{
+	const LoopMatch* match;
+	LoopMatch scanned;
+
+	if (loopMapGeneration != bus->GetMapGeneration()) {
+		loopMapGeneration = bus->GetMapGeneration();
+		loopCache.clear();
+	}
+	if (branch <= 0x7FFF && head <= branch) {
+		auto it = loopCache.find(branch);
+
+		if (it == loopCache.end())
+			it = loopCache.emplace(branch, MatchLoop(head, branch)).first;
+		match = &it->second;
+	} else {
+		scanned = MatchLoop(head, branch);
+		match = &scanned;
+	}
+	idleLoopCycles = match->idleCycles;
+	if (match->kind == LOOP_BULK)
+		bulkLoop = match->bulk;
+	if (match->kind != LOOP_NONE)
+		loop = match->kind;
+}
+
+/*
+	The kind of loop the last step branched back into, LOOP_NONE if it
+	didn't, and for an idle loop the M-cycles an iteration takes. Reading
+	it clears it.
+*/
+LoopKind Cpu::TakeLoop(int& idleCycles)
+{
+	LoopKind kind = loop;
+
+	idleCycles = idleLoopCycles;
+	loop = LOOP_NONE;
+	return kind;
+}
+
+/*
+	Run, as one fill or copy, the iterations of the bulk loop the last step
+	branched back into that fit in maxCycles and take the JR again; the
+	one that falls through is left to the CPU. Only memory the fast paths
+	of Read and Write reach directly is touched, so the stores are the
+	same ones the iterations would make. Returns the M-cycles the
+	iterations take, and leaves registers and flags as they would.
+*/
+int Cpu::RunBulkLoop(int maxCycles)
+{
+	u16 hl = regs.HL();
+	u32 count;
+
+	if (maxCycles < bulkLoop.mCycles)
+		return 0;
+	if (bulkLoop.counter != nullptr)
+		count = (u8)((regs.*bulkLoop.counter)() - 1);
+	else if (hl < 0x8000)
+		count = 0;
+	else
+		count = (bulkLoop.step > 0) ? 0xffff - hl : hl - 0x8000;
+	count = std::min<u32>(count, maxCycles / bulkLoop.mCycles);
+	count = bus->DirectSpan(hl, bulkLoop.step, count, true);
+	if (bulkLoop.copy)
+		count = bus->DirectSpan(regs.DE(), 1, count, false);
+	if (count == 0)
+		return 0;
+
+	if (bulkLoop.copy) {
+		bus->Copy(hl, regs.DE(), count);
+		regs.A() = bus->Read(hl + count - 1);
+		regs.DE() += count;
+	} else {
+		bus->Fill((bulkLoop.step > 0) ? hl : hl - (count - 1), count, regs.A());
+	}
+	regs.HL() = hl + bulkLoop.step * count;
+	// The last test runs for real, for the flags it leaves.
+	if (bulkLoop.counter != nullptr)
+		(regs.*bulkLoop.counter)() -= count - 1;
+	(this->*bulkLoop.test)(0, 0);
+	return count * bulkLoop.mCycles;
+}
+
+/*
+	Every handler below takes the two bytes following the opcode, whether the
+	instruction uses them or not, so that all of them fit in the same dispatch
+	table. Register operands are template arguments and get baked into the
+	handler instantiated for each opcode.
+*/
+
+void Cpu::UNKNOWN(u8, u8)
+{
+	spdlog::error("Opcode invalid - ${:02X}, after:", bus->Read(regs.PC() - 1));
+	recorder.LogTail(CRASH_LOG_LINES);
+	mCycles = OPCODE_UNKNOWN;
+}
+
+void Cpu::UNKNOWN_CB(u8 operandA, u8)
+{
+	spdlog::error("Opcode invalid - $CB ${:02X}, after:", operandA);
+	recorder.LogTail(CRASH_LOG_LINES);
+	mCycles = OPCODE_UNKNOWN;
+}
+
+/*
+	Instruction: PREFIX CB
+	Usage:		 Execute the instruction from the CB table indexed by the next byte.
+	Cost:		 1 CPU cycle, plus the cost of the CB instruction
+*/
+void Cpu::PREFIX_CB(u8 operandA, u8 operandB)
+{
+	const Opcode& op = cbOpcodeTable[operandA];
+
+	regs.PC() += 1;
+	mCycles += op.mCycles;
+	(this->*op.handler)(operandA, operandB);
+}
+
 /* 
 	Instruction: LD r16,u16
 	Usage:		 Load U16 value into u16 registers(couple also). E.g. BC, DE, SP, PC
 	Cost:		 3 CPU cycles
 */
-void Cpu::LD(u16& dst, u16 val)
+template <Cpu::R16 r16>
+void Cpu::LD_R16_U16(u8 operandA, u8 operandB)
 {
-	dst = val;
+	(regs.*r16)() = U16(operandA, operandB);
 	regs.PC() += 2;
 }
 
@@ -88,10 +455,12 @@ void Cpu::LD(u16& dst, u16 val)
 	Usage:		 XOR r8 value with A register, then store the result in A
 	Cost:		 1 CPU cycle
 */
-void Cpu::XOR_A_R8(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::XOR_A_R8(u8, u8)
 {
-	regs.A() ^= r8;
-	SetZNHC(regs.A() == 0, 0, 0, 0);
+	regs.A() ^= (regs.*r8)();
+	zero = regs.A();
+	regs.F() &= 0x0f;
 }
 
 /*
@@ -99,7 +468,7 @@ void Cpu::XOR_A_R8(u8& r8)
 	Usage:		 Load the value of A into memory pointed by HL, then decrement HL. 
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD_HLD_A()
+void Cpu::LD_HLD_A(u8, u8)
 {
 	if (regs.HL() == 0xff04)
 		spdlog::info("Write to 0xff04, data: {:02X}", regs.A());
@@ -113,11 +482,11 @@ void Cpu::LD_HLD_A()
 				 also unset the Negative flag and set the Half Carry flag.
 	Cost:		 2 CPU cycles
 */
-void Cpu::BIT_X_R8(int x, const u8 r8)
+template <int x, Cpu::R8 r8>
+void Cpu::BIT_X_R8(u8, u8)
 {
-	SetFlag(FLAG_Z, !NTHBIT(r8, x));
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, 1);
+	zero = NTHBIT((regs.*r8)(), x);
+	regs.F() = (regs.F() & (FLAG_C | 0x0f)) | FLAG_H;
 }
 
 /*
@@ -125,12 +494,14 @@ void Cpu::BIT_X_R8(int x, const u8 r8)
 	Usage:		 Relative jump if condition NZ is met. 
 	Cost:		 3 taken/2 untaken CPU cycles
 */
-void Cpu::JR_NZ_I8(u8 offset)
+void Cpu::JR_NZ_I8(u8 offset, u8)
 {
 	regs.PC() += 1;
-	if (!GetFlag(FLAG_Z))
+	if (!GetFlag(FLAG_Z)) {
 		regs.PC() += (i8)offset;
-	mCycles += (!GetFlag(FLAG_Z)) ? 1 : 0;
+		mCycles += 1;
+		BranchedTo((i8)offset);
+	}
 }
 
 /*
@@ -138,12 +509,15 @@ void Cpu::JR_NZ_I8(u8 offset)
 	Usage:		 Increment the value in register r8 by 1.
 	Cost:		 1 CPU cycle
 */
-void Cpu::INC(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::INC_R8(u8, u8)
 {
-	SetFlag(FLAG_H, ((r8 & 0x0f) + 1) > 0x0f);
-	r8 += 1;
-	SetFlag(FLAG_Z, r8 == 0);
-	SetFlag(FLAG_N, 0);
+	u8& reg = (regs.*r8)();
+	u8 old = reg;
+
+	reg += 1;
+	zero = reg;
+	regs.F() = (regs.F() & (FLAG_C | 0x0f)) | HalfCarry(old ^ reg);
 }
 
 /*
@@ -151,9 +525,10 @@ void Cpu::INC(u8& r8)
 	Usage:		 Increment the value in register r16 by 1.
 	Cost:		 2 CPU cycle
 */
-void Cpu::INC(u16& r16)
+template <Cpu::R16 r16>
+void Cpu::INC_R16(u8, u8)
 {
-	r16 += 1;
+	(regs.*r16)() += 1;
 }
 
 /*
@@ -161,18 +536,30 @@ void Cpu::INC(u16& r16)
 	Usage:		 Copy the value of u8 into r8 register.
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD(u8& r8, u8 u8)
+template <Cpu::R8 r8>
+void Cpu::LD_R8_U8(u8 operandA, u8)
 {
-	r8 = u8;
+	(regs.*r8)() = operandA;
 	regs.PC() += 1;
 }
 
+/*
+	Instruction: LD r8,r8
+	Usage:		 Copy the value of the source register into the destination register.
+	Cost:		 1 CPU cycle
+*/
+template <Cpu::R8 dst, Cpu::R8 src>
+void Cpu::LD_R8_R8(u8, u8)
+{
+	(regs.*dst)() = (regs.*src)();
+}
+
 /*
 	Instruction: LD [C],A
 	Usage:		 Copy the value in register A into the byte at address $FF00 + C.
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD_IC_A()
+void Cpu::LD_IC_A(u8, u8)
 {
 	bus->Write(0xFF00 + regs.C(), regs.A());
 }
@@ -182,9 +569,10 @@ void Cpu::LD_IC_A()
 	Usage:		 Copy the value in register r8 into the byte pointed to by HL.
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD_IHL_R8(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::LD_IHL_R8(u8, u8)
 {
-	bus->Write(regs.HL(), r8);
+	bus->Write(regs.HL(), (regs.*r8)());
 }
 
 /*
@@ -192,14 +580,10 @@ void Cpu::LD_IHL_R8(u8& r8)
 	Usage:		 Copy the value in register A into the byte pointed to by address $ff00 + u8.
 	Cost:		 3 CPU cycles
 */
-void Cpu::LD_IU8_A(u8 u8, Rom& rom)
+void Cpu::LD_IU8_A(u8 operandA, u8)
 {
-	bus->Write(0xFF00 + u8, regs.A());
+	bus->Write(0xFF00 + operandA, regs.A());
 	regs.PC() += 1;
-	if (u8 == 0x50) {
-		spdlog::info("BootRom unlocked!");
-		rom.UnlockBootROM();
-	}
 }
 
 /*
@@ -207,9 +591,10 @@ void Cpu::LD_IU8_A(u8 u8, Rom& rom)
 	Usage:		 Copy the byte pointed to by r16 register into regsiter A.
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD_A_IR16(u16 r16)
+template <Cpu::R16 r16>
+void Cpu::LD_A_IR16(u8, u8)
 {
-	regs.A() = bus->Read(r16);
+	regs.A() = bus->Read((regs.*r16)());
 }
 
 /*
@@ -218,12 +603,12 @@ void Cpu::LD_A_IR16(u16 r16)
 				 the PC to u16.
 	Cost:		 6 CPU cycles
 */
-void Cpu::CALL_U16(u16 newPC)
+void Cpu::CALL_U16(u8 operandA, u8 operandB)
 {
 	regs.PC() += 2;
 	StackPush(MSB(regs.PC()));
 	StackPush(LSB(regs.PC()));
-	regs.PC() = newPC;
+	regs.PC() = U16(operandA, operandB);
 }
 
 /*
@@ -231,10 +616,11 @@ void Cpu::CALL_U16(u16 newPC)
 	Usage:		 Push the value of register R16 to the stack.
 	Cost:		 4 CPU cycles
 */
-void Cpu::PUSH_R16(u16& r16)
+template <Cpu::R16 r16>
+void Cpu::PUSH_R16(u8, u8)
 {
-	StackPush(MSB(r16));
-	StackPush(LSB(r16));
+	StackPush(MSB((regs.*r16)()));
+	StackPush(LSB((regs.*r16)()));
 }
 
 /*
@@ -242,15 +628,15 @@ void Cpu::PUSH_R16(u16& r16)
 	Usage:		 Rotate bits in register r8 left, through the carry flag.
 	Cost:		 2 CPU cycles
 */
-void Cpu::RL_R8(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::RL_R8(u8, u8)
 {
-	u16 tmp = (r8 << 1) | GetFlag(FLAG_C);
+	u8& reg = (regs.*r8)();
+	u16 tmp = (reg << 1) | GetFlag(FLAG_C);
 
-	r8 = LSB(tmp);
-	SetFlag(FLAG_Z, !r8);
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, 0);
-	SetFlag(FLAG_C, NTHBIT(tmp, 8));
+	reg = LSB(tmp);
+	zero = reg;
+	regs.F() = (regs.F() & 0x0f) | (NTHBIT(tmp, 8) ? FLAG_C : 0);
 }
 
 /*
@@ -258,15 +644,13 @@ void Cpu::RL_R8(u8& r8)
 	Usage:		 Rotate register A left, through the carry flag.
 	Cost:		 1 CPU cycle
 */
-void Cpu::RLA()
+void Cpu::RLA(u8, u8)
 {
 	u16 tmp = (regs.A() << 1) | GetFlag(FLAG_C);
 
 	regs.A() = LSB(tmp);
-	SetFlag(FLAG_Z, 0);
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, 0);
-	SetFlag(FLAG_C, NTHBIT(tmp, 8));
+	zero = 1;
+	regs.F() = (regs.F() & 0x0f) | (NTHBIT(tmp, 8) ? FLAG_C : 0);
 }
 
 /*	
@@ -274,13 +658,14 @@ void Cpu::RLA()
 	Usage:		 Pop register r16 from the stack.
 	Cost:		 3 CPU cycles
 */
-void Cpu::POP_R16(u16& r16)
+template <Cpu::R16 r16>
+void Cpu::POP_R16(u8, u8)
 {
 	u8 lsb, msb;
 
 	lsb = StackPop();
 	msb = StackPop();
-	r16 = U16(lsb, msb);
+	(regs.*r16)() = U16(lsb, msb);
 }
 
 /*	
@@ -288,14 +673,15 @@ void Cpu::POP_R16(u16& r16)
 	Usage:		 Decrement the value in register r8.
 	Cost:		 1 CPU cycles
 */
-void Cpu::DEC(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::DEC_R8(u8, u8)
 {
-	u8 carryBits = (r8 - 1) ^ r8 ^ 0xff;
+	u8& reg = (regs.*r8)();
+	u8 old = reg;
 
-	r8 -= 1;
-	SetFlag(FLAG_Z, !r8);
-	SetFlag(FLAG_N, 1);
-	SetFlag(FLAG_H, !NTHBIT(carryBits, 4));
+	reg -= 1;
+	zero = reg;
+	regs.F() = (regs.F() & (FLAG_C | 0x0f)) | FLAG_N | HalfCarry(old ^ reg);
 }
 
 /*
@@ -303,7 +689,7 @@ void Cpu::DEC(u8& r8)
 	Usage:		 Copy the value of register A into the byte pointed to by HL and increment HL.
 	Cost:		 2 CPU cycles
 */
-void Cpu::LD_HLI_A()
+void Cpu::LD_HLI_A(u8, u8)
 {
 	bus->Write(regs.HL(), regs.A());
 	regs.HL() += 1;
@@ -314,9 +700,9 @@ void Cpu::LD_HLI_A()
 	Usage:		 Return from subroutine. Basically just pop the address and set it to PC.
 	Cost:		 4 CPU cycles
 */
-void Cpu::RET()
+void Cpu::RET(u8 operandA, u8 operandB)
 {
-	POP_R16(regs.PC());
+	POP_R16<&CpuRegs::PC>(operandA, operandB);
 }
 
 /*
@@ -324,14 +710,12 @@ void Cpu::RET()
 	Usage:			Compare the value of register A with u8.
 	Cost:			2 CPU cycles
 */
-void Cpu::CP_U8(const u8 val)
+void Cpu::CP_U8(u8 val, u8)
 {
-	u8 res = regs.A() - val, carryBits = res ^ regs.A() ^ ~val;
+	u8 res = regs.A() - val;
 
-	SetFlag(FLAG_Z, !res);
-	SetFlag(FLAG_N, 1);
-	SetFlag(FLAG_H, !NTHBIT(carryBits, 4));
-	SetFlag(FLAG_C, val > regs.A());
+	zero = res;
+	regs.F() = (regs.F() & 0x0f) | FLAG_N | HalfCarry(res ^ regs.A() ^ val) | (val > regs.A() ? FLAG_C : 0);
 	regs.PC() += 1;
 }
 
@@ -340,33 +724,37 @@ void Cpu::CP_U8(const u8 val)
 	Usage:			Compare the value of register A into the byte at address u16.
 	Cost:			4 CPU cycles
 */
-void Cpu::LD_IU16_A(const u16 addr)
+void Cpu::LD_IU16_A(u8 operandA, u8 operandB)
 {
-	bus->Write(addr, regs.A());
+	bus->Write(U16(operandA, operandB), regs.A());
 	regs.PC() += 2;
 }
 
 /*
 	Instruction:	JR Z,i8
 	Usage:			Relative jump if Z flag is true.
-	Cost:			2 CPU cycles
+	Cost:			3 taken/2 untaken CPU cycles
 */
-void Cpu::JR_Z_I8(u8 offset)
+void Cpu::JR_Z_I8(u8 offset, u8)
 {
 	regs.PC() += 1;
-	if (GetFlag(FLAG_Z))
+	if (GetFlag(FLAG_Z)) {
 		regs.PC() += (i8)offset;
+		mCycles += 1;
+		BranchedTo((i8)offset);
+	}
 }
 
 /*
 	Instruction:	JR i8
 	Usage:			Relative jump.
-	Cost:			2 CPU cycles
+	Cost:			3 CPU cycles
 */
-void Cpu::JR_I8(u8 offset)
+void Cpu::JR_I8(u8 offset, u8)
 {
 	regs.PC() += 1;
 	regs.PC() += static_cast<i8>(offset);
+	BranchedTo(static_cast<i8>(offset));
 }
 
 /*
@@ -374,7 +762,7 @@ void Cpu::JR_I8(u8 offset)
 	Usage:			Copy the byte at address $ff00 + u8 into register A.
 	Cost:			3 CPU cycles
 */
-void Cpu::LD_A_IU16(const u8 val)
+void Cpu::LD_A_IU16(u8 val, u8)
 {
 	regs.PC() += 1;
 	regs.A() = bus->Read(0xff00 + val);
@@ -385,14 +773,13 @@ void Cpu::LD_A_IU16(const u8 val)
 	Usage:			Subtract the value in r8 from A.
 	Cost:			1 CPU cycle
 */
-void Cpu::SUB_A_R8(u8& r8)
+template <Cpu::R8 r8>
+void Cpu::SUB_A_R8(u8, u8)
 {
-	u8 res = regs.A() - r8, carryBits = res ^ regs.A() ^ ~r8;
+	u8 val = (regs.*r8)(), res = regs.A() - val;
 
-	SetFlag(FLAG_Z, !res);
-	SetFlag(FLAG_N, 1);
-	SetFlag(FLAG_H, !NTHBIT(carryBits, 4));
-	SetFlag(FLAG_C, r8 > regs.A());
+	zero = res;
+	regs.F() = (regs.F() & 0x0f) | FLAG_N | HalfCarry(res ^ regs.A() ^ val) | (val > regs.A() ? FLAG_C : 0);
 	regs.A() = res;
 }
 
@@ -401,14 +788,12 @@ void Cpu::SUB_A_R8(u8& r8)
 	Usage:			Compare the value in A with the byte pointed to by HL.
 	Cost:			2 CPU cycles
 */
-void Cpu::CP_A_IHL()
+void Cpu::CP_A_IHL(u8, u8)
 {
-	u8 val = bus->Read(regs.HL()), res = regs.A() - val, carryBits = res ^ regs.A() ^ ~val;
+	u8 val = bus->Read(regs.HL()), res = regs.A() - val;
 
-	SetFlag(FLAG_Z, !res);
-	SetFlag(FLAG_N, 1);
-	SetFlag(FLAG_H, !NTHBIT(carryBits, 4));
-	SetFlag(FLAG_C, val > regs.A());
+	zero = res;
+	regs.F() = (regs.F() & 0x0f) | FLAG_N | HalfCarry(res ^ regs.A() ^ val) | (val > regs.A() ? FLAG_C : 0);
 }
 
 /*
@@ -416,16 +801,14 @@ void Cpu::CP_A_IHL()
 	Usage:			Add the byte pointed to by HL to A.
 	Cost:			2 CPU cycles
 */
-void Cpu::ADD_A_IHL()
+void Cpu::ADD_A_IHL(u8, u8)
 {
 	u8 val = bus->Read(regs.HL()), res = regs.A() + val;
 	u16 carryBits = res ^ regs.A() ^ val;
 
 	regs.A() = regs.A() + val;
-	SetFlag(FLAG_Z, !res);
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, NTHBIT(carryBits, 4));
-	SetFlag(FLAG_C, NTHBIT(carryBits, 8));
+	zero = res;
+	regs.F() = (regs.F() & 0x0f) | HalfCarry(carryBits) | (NTHBIT(carryBits, 8) ? FLAG_C : 0);
 }
 
 
@@ -434,7 +817,7 @@ void Cpu::ADD_A_IHL()
 	Usage:			No operation.
 	Cost:			1 CPU cycle
 */
-void Cpu::NOP()
+void Cpu::NOP(u8, u8)
 {
 
 }
@@ -444,9 +827,9 @@ void Cpu::NOP()
 	Usage:			Set the PC register to u16
 	Cost:			4 CPU cycles
 */
-void Cpu::JP_U16(u16 addr)
+void Cpu::JP_U16(u8 operandA, u8 operandB)
 {
-	regs.PC() = addr;
+	regs.PC() = U16(operandA, operandB);
 }
 
 /*
@@ -455,9 +838,10 @@ void Cpu::JP_U16(u16 addr)
 					to by R16.
 	Cost:			2 CPU cycles
 */
-void Cpu::LD_IR16_A(u16& r16)
+template <Cpu::R16 r16>
+void Cpu::LD_IR16_A(u8, u8)
 {
-	bus->Write(r16, regs.A());
+	bus->Write((regs.*r16)(), regs.A());
 }
 
 /*
@@ -465,12 +849,10 @@ void Cpu::LD_IR16_A(u16& r16)
 	Usage:			Rotate regiser A left.
 	Cost:			1 CPU cycle
 */
-void Cpu::RLCA()
+void Cpu::RLCA(u8, u8)
 {
-	SetFlag(FLAG_Z, 0);
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, 0);
-	SetFlag(FLAG_C, NTHBIT(regs.A(), 7));
+	zero = 1;
+	regs.F() = (regs.F() & 0x0f) | (NTHBIT(regs.A(), 7) ? FLAG_C : 0);
 	regs.A() = (regs.A() << 7) | NTHBIT(regs.A(), 7);
 }
 
@@ -479,10 +861,13 @@ void Cpu::RLCA()
 	Usage:			Copy SP & $FF at address u16 and SP >> 8 at address u16 + 1.
 	Cost:			5 CPU cycles
 */
-void Cpu::LD_IU16_SP(u16 addr)
+void Cpu::LD_IU16_SP(u8 operandA, u8 operandB)
 {
+	u16 addr = U16(operandA, operandB);
+
 	bus->Write(addr, regs.SP() & 0xFF);
 	bus->Write(addr + 1, regs.SP() >> 8);
+	regs.PC() += 2;
 }
 
 /*
@@ -490,237 +875,486 @@ void Cpu::LD_IU16_SP(u16 addr)
 	Usage:			Add the value in r16 to HL.
 	Cost:			2 CPU cycles
 */
-void Cpu::ADD_HL_R16(u16& r16)
+template <Cpu::R16 r16>
+void Cpu::ADD_HL_R16(u8, u8)
 {
-	u32 res = regs.HL() + r16;
-	u32 carryBits = res ^ regs.HL() ^ r16;
+	u16 val = (regs.*r16)();
+	u32 res = regs.HL() + val;
+	u32 carryBits = res ^ regs.HL() ^ val;
 
 	regs.HL() = res;
-	SetFlag(FLAG_N, 0);
-	SetFlag(FLAG_H, NTHBIT(carryBits, 12));
-	SetFlag(FLAG_C, NTHBIT(carryBits, 16));
+	regs.F() = (regs.F() & 0x0f) | HalfCarry(carryBits >> 8) | (NTHBIT(carryBits, 16) ? FLAG_C : 0);
+}
+
+/*
+	Instruction:	HALT
+	Usage:			Stop executing until an interrupt is pending. There is no
+					interrupt dispatch yet, so the CPU always wakes up the way it
+					does with IME clear: it carries on after the HALT. If one
+					is already pending it doesn't halt at all, and the byte
+					after the HALT is read twice (the HALT bug).
+	Cost:			1 CPU cycle
+*/
+void Cpu::HALT(u8, u8)
+{
+	if (bus->PendingInterrupts() != 0)
+		haltBug = true;
+	else
+		sleep = CPU_HALTED;
 }
 
-CpuState Cpu::GetCpuState() const
+/*
+	Instruction:	STOP
+	Usage:			Stop the CPU until a button is pressed, and reset DIV.
+	Cost:			1 CPU cycle
+*/
+void Cpu::STOP(u8, u8)
 {
-	return state;
+	bus->Write(0xFF04, 0);
+	sleep = CPU_STOPPED;
+	regs.PC() += 1;
 }
 
-int Cpu::Step(Rom& rom)
+/*
+	Two instructions in one op, dispatched once. The op's operands are the
+	first instruction's followed by the second's; each handler runs as it
+	would on its own, with the second one recorded once PC has reached it.
+*/
+template <u8 first, u8 second>
+void Cpu::FUSED(u8 operandA, u8 operandB)
 {
-	u8 opcode, operandA, operandB;
+	constexpr OpcodeHandler firstHandler = BuildMainOpcodeTable()[first].handler;
+	constexpr OpcodeHandler secondHandler = BuildMainOpcodeTable()[second].handler;
+	constexpr int firstOperands = mainOpcodeLength[first] - 1;
+	u8 secondA = (firstOperands == 0) ? operandA : (firstOperands == 1) ? operandB : 0;
+	u8 secondB = (firstOperands == 0) ? operandB : 0;
+
+	(this->*firstHandler)(operandA, operandB);
+	CatchUp(ticked + mainOpcodeMCycles[first]);
+	Record(second, secondA, secondB);
+	regs.PC() += 1;
+	(this->*secondHandler)(secondA, secondB);
+}
+
+constexpr std::array<Opcode, OPCODE_TBL_SIZE> Cpu::BuildMainOpcodeTable()
+{
+	std::array<Opcode, OPCODE_TBL_SIZE> tbl = {};
+
+	for (int i = 0; i < OPCODE_TBL_SIZE; i++)
+		tbl[i] = { &Cpu::UNKNOWN, mainOpcodeMCycles[i], mainOpcodeLength[i] };
+
+	tbl[0x00].handler = &Cpu::NOP;
+	tbl[0x01].handler = &Cpu::LD_R16_U16<&CpuRegs::BC>;
+	tbl[0x02].handler = &Cpu::LD_IR16_A<&CpuRegs::BC>;
+	tbl[0x03].handler = &Cpu::INC_R16<&CpuRegs::BC>;
+	tbl[0x04].handler = &Cpu::INC_R8<&CpuRegs::B>;
+	tbl[0x05].handler = &Cpu::DEC_R8<&CpuRegs::B>;
+	tbl[0x06].handler = &Cpu::LD_R8_U8<&CpuRegs::B>;
+	tbl[0x07].handler = &Cpu::RLCA;
+	tbl[0x08].handler = &Cpu::LD_IU16_SP;
+	tbl[0x09].handler = &Cpu::ADD_HL_R16<&CpuRegs::BC>;
+	tbl[0x0c].handler = &Cpu::INC_R8<&CpuRegs::C>;
+	tbl[0x0d].handler = &Cpu::DEC_R8<&CpuRegs::C>;
+	tbl[0x0e].handler = &Cpu::LD_R8_U8<&CpuRegs::C>;
+	tbl[0x10].handler = &Cpu::STOP;
+	tbl[0x11].handler = &Cpu::LD_R16_U16<&CpuRegs::DE>;
+	tbl[0x13].handler = &Cpu::INC_R16<&CpuRegs::DE>;
+	tbl[0x15].handler = &Cpu::DEC_R8<&CpuRegs::D>;
+	tbl[0x16].handler = &Cpu::LD_R8_U8<&CpuRegs::D>;
+	tbl[0x17].handler = &Cpu::RLA;
+	tbl[0x18].handler = &Cpu::JR_I8;
+	tbl[0x1a].handler = &Cpu::LD_A_IR16<&CpuRegs::DE>;
+	tbl[0x1d].handler = &Cpu::DEC_R8<&CpuRegs::E>;
+	tbl[0x1e].handler = &Cpu::LD_R8_U8<&CpuRegs::E>;
+	tbl[0x20].handler = &Cpu::JR_NZ_I8;
+	tbl[0x21].handler = &Cpu::LD_R16_U16<&CpuRegs::HL>;
+	tbl[0x22].handler = &Cpu::LD_HLI_A;
+	tbl[0x23].handler = &Cpu::INC_R16<&CpuRegs::HL>;
+	tbl[0x24].handler = &Cpu::INC_R8<&CpuRegs::H>;
+	tbl[0x28].handler = &Cpu::JR_Z_I8;
+	tbl[0x2e].handler = &Cpu::LD_R8_U8<&CpuRegs::L>;
+	tbl[0x31].handler = &Cpu::LD_R16_U16<&CpuRegs::SP>;
+	tbl[0x32].handler = &Cpu::LD_HLD_A;
+	tbl[0x3d].handler = &Cpu::DEC_R8<&CpuRegs::A>;
+	tbl[0x3e].handler = &Cpu::LD_R8_U8<&CpuRegs::A>;
+	tbl[0x47].handler = &Cpu::LD_R8_R8<&CpuRegs::B, &CpuRegs::A>;
+	tbl[0x4f].handler = &Cpu::LD_R8_R8<&CpuRegs::C, &CpuRegs::A>;
+	tbl[0x57].handler = &Cpu::LD_R8_R8<&CpuRegs::D, &CpuRegs::A>;
+	tbl[0x67].handler = &Cpu::LD_R8_R8<&CpuRegs::H, &CpuRegs::A>;
+	tbl[0x76].handler = &Cpu::HALT;
+	tbl[0x77].handler = &Cpu::LD_IHL_R8<&CpuRegs::A>;
+	tbl[0x78].handler = &Cpu::LD_R8_R8<&CpuRegs::A, &CpuRegs::B>;
+	tbl[0x7b].handler = &Cpu::LD_R8_R8<&CpuRegs::A, &CpuRegs::E>;
+	tbl[0x7c].handler = &Cpu::LD_R8_R8<&CpuRegs::A, &CpuRegs::H>;
+	tbl[0x7d].handler = &Cpu::LD_R8_R8<&CpuRegs::A, &CpuRegs::L>;
+	tbl[0x86].handler = &Cpu::ADD_A_IHL;
+	tbl[0x90].handler = &Cpu::SUB_A_R8<&CpuRegs::B>;
+	tbl[0xaf].handler = &Cpu::XOR_A_R8<&CpuRegs::A>;
+	tbl[0xbe].handler = &Cpu::CP_A_IHL;
+	tbl[0xc1].handler = &Cpu::POP_R16<&CpuRegs::BC>;
+	tbl[0xc3].handler = &Cpu::JP_U16;
+	tbl[0xc5].handler = &Cpu::PUSH_R16<&CpuRegs::BC>;
+	tbl[0xc9].handler = &Cpu::RET;
+	tbl[0xcb].handler = &Cpu::PREFIX_CB;
+	tbl[0xcd].handler = &Cpu::CALL_U16;
+	tbl[0xe0].handler = &Cpu::LD_IU8_A;
+	tbl[0xe2].handler = &Cpu::LD_IC_A;
+	tbl[0xea].handler = &Cpu::LD_IU16_A;
+	tbl[0xf0].handler = &Cpu::LD_A_IU16;
+	tbl[0xfe].handler = &Cpu::CP_U8;
+	return tbl;
+}
+
+constexpr std::array<Opcode, OPCODE_TBL_SIZE> Cpu::BuildCbOpcodeTable()
+{
+	std::array<Opcode, OPCODE_TBL_SIZE> tbl = {};
+
+	// The 0xCB prefix itself is already charged by the main table: 1 more
+	// M-cycle for register operands, 2 for BIT n,(HL) and 3 for the other (HL) ones.
+	for (int i = 0; i < OPCODE_TBL_SIZE; i++) {
+		u8 mCycles = ((i & 0x07) != 0x06) ? 1 : ((i >> 6) == 1) ? 2 : 3;
+		tbl[i] = { &Cpu::UNKNOWN_CB, mCycles, 1 };
+	}
+
+	tbl[0x11].handler = &Cpu::RL_R8<&CpuRegs::C>;
+	tbl[0x7c].handler = &Cpu::BIT_X_R8<7, &CpuRegs::H>;
+	return tbl;
+}
+
+const std::array<Opcode, OPCODE_TBL_SIZE> Cpu::mainOpcodeTable = Cpu::BuildMainOpcodeTable();
+const std::array<Opcode, OPCODE_TBL_SIZE> Cpu::cbOpcodeTable = Cpu::BuildCbOpcodeTable();
+
+template <size_t... i>
+constexpr std::array<OpcodeHandler, sizeof...(i)> Cpu::BuildFusedTable(std::index_sequence<i...>)
+{
+	return { { &Cpu::FUSED<fusedPairs[i].first, fusedPairs[i].second>... } };
+}
+
+/*
+	The handler running first and second as one op, nullptr if the pair isn't
+	in fusedPairs. Only DecodeBlock asks, so a linear search will do.
+*/
+OpcodeHandler Cpu::FusedHandler(u8 first, u8 second)
+{
+	static constexpr std::array<OpcodeHandler, fusedPairs.size()> fusedTable =
+		BuildFusedTable(std::make_index_sequence<fusedPairs.size()>());
 
-#ifdef LOGGER_ENABLE
-	state.AF.val = regs.AF();
+	for (size_t i = 0; i < fusedPairs.size(); i++) {
+		if (fusedPairs[i].first == first && fusedPairs[i].second == second)
+			return fusedTable[i];
+	}
+	return nullptr;
+}
+
+/*
+	Whether the pair could go in fusedPairs.
+*/
+bool Cpu::CanFuse(u8 first, u8 second)
+{
+	return FusesWith(first, second) && mainOpcodeTable[first].handler != &Cpu::UNKNOWN &&
+		mainOpcodeTable[second].handler != &Cpu::UNKNOWN;
+}
+
+/*
+	The registers and the 4 bytes at PC, read when asked so that nothing is
+	paid for it on every step.
+*/
+CpuState Cpu::GetCpuState()
+{
+	CpuState state;
+
+	state.AF.val = GetAF();
 	state.BC = regs.BC();
 	state.DE = regs.DE();
 	state.HL = regs.HL();
 	state.PC = regs.PC();
 	state.SP = regs.SP();
-	state.romData[0] = rom.Read(regs.PC());
-	state.romData[1] = rom.Read(regs.PC() + 1);
-	state.romData[2] = rom.Read(regs.PC() + 2);
-	state.romData[3] = rom.Read(regs.PC() + 3);
-#endif
+	for (int i = 0; i < 4; i++)
+		state.romData[i] = bus->Peek(regs.PC() + i);
+	return state;
+}
 
-	opcode = rom.Read(regs.PC());
-	regs.PC() += 1;
-	operandA = rom.Read(regs.PC());
-	operandB = rom.Read(regs.PC() + 1);
+/*
+	A step of a sleeping CPU. Nothing happens until the wake-up condition,
+	and that can only change at a scheduled event, so the step jumps straight
+	to the next one instead of idling M-cycle by M-cycle. Waking up takes a
+	step of its own with no cycles, so the debugger sees the next
+	instruction before it runs.
+*/
+int Cpu::Sleep()
+{
+	bool wake = (sleep == CPU_HALTED) ? bus->PendingInterrupts() != 0 : bus->JoypadPressed();
 
-	mCycles = 0;
-	switch (opcode) {
-	case 0x00:		/* NOP */
-		NOP();
-		break;
-	case 0x01:		/* LD BC,u16 */
-		LD(regs.BC(), U16(operandA, operandB));
-		break;
-	case 0x02:		/* LD (BC),A */
-		LD_IR16_A(regs.BC());
-		break;
-	case 0x03:		/* INC BC */
-		INC(regs.BC());
-		break;
-	case 0x04:		/* INC B */
-		INC(regs.B());
-		break;
-	case 0x05:		/* DEC B */
-		DEC(regs.B());
-		break;
-	case 0x06:		/* LD B,u8 */
-		LD(regs.B(), operandA);
-		break;
-	case 0x07:		/* RLCA */
-		RLCA();
-		break;
-	case 0x08:		/* LD (u16),SP */
-		LD_IU16_SP(U16(operandA, operandB));
-		break;
-	case 0x09:		/* ADD HL, BC */
-		ADD_HL_R16(regs.BC());
-		break;
-	case 0x0d:		/* DEC C */
-		DEC(regs.C());
-		break;
-	case 0x0c:		/* INC C */
-		INC(regs.C());
-		break;
-	case 0x0e:		/* LD C,u8 */
-		LD(regs.C(), operandA);
-		break;
-	case 0x11:		/* LD DE,u16 */
-		LD(regs.DE(), U16(operandA, operandB));
-		break;
-	case 0x13:		/* INC DE */
-		INC(regs.DE());
-		break;
-	case 0x15:		/* DEC D */
-		DEC(regs.D());
-		break;
-	case 0x16:		/* LD D,u8 */
-		LD(regs.D(), operandA);
-		break;
-	case 0x17:		/* RLA */
-		RLA();
-		break;
-	case 0x18:		/* JR i8 */
-		JR_I8(operandA);
-		break;
-	case 0x1a:		/* LD A,(DE) */
-		LD_A_IR16(regs.DE());
-		break;
-	case 0x1d:		/* DEC E */
-		DEC(regs.E());
-		break;
-	case 0x1e:		/* LD E,u8 */
-		LD(regs.E(), operandA);
-		break;
-	case 0x3e:		/* LD A,u8 */
-		LD(regs.A(), operandA);
-		break;
-	case 0x20:		/* JR NZ,i8 */
-		JR_NZ_I8(operandA);
-		break;
-	case 0x21:		/* LD HL,u16 */
-		LD(regs.HL(), U16(operandA, operandB));
-		break;
-	case 0x22:		/* LD (HL+),A */
-		LD_HLI_A();
-		break;
-	case 0x23:		/* INC HL */
-		INC(regs.HL());
-		break;
-	case 0x24:		/* INC H */
-		INC(regs.H());
-		break;
-	case 0x28:		/* JR Z,i8 */
-		JR_Z_I8(operandA);
-		break;
-	case 0x2e:		/* LD L,u8 */
-		LD(regs.L(), operandA);
-		break;
-	case 0x31:		/* LD SP,u16 */
-		LD(regs.SP(), U16(operandA, operandB));
-		break;
-	case 0x32:		/* LD (HL-),A */
-		LD_HLD_A();
-		break;
-	case 0x47:		/* LD B,A */
-		LD(regs.B(), regs.A());
-		break;
-	case 0x3d:		/* DEC A */
-		DEC(regs.A());
-		break;
-	case 0x4f:		/* LD C,A */
-		LD(regs.C(), regs.A());
-		break;
-	case 0x57:		/* LD D,A */
-		LD(regs.D(), regs.A());
-		break;
-	case 0x67:		/* LD H,A */
-		LD(regs.H(), regs.A());
-		break;
-	case 0x77:		/* LD (HL),A */
-		LD_IHL_R8(regs.A());
-		break;
-	case 0x78:		/* LD A, B */
-		LD(regs.A(), regs.B());
-		break;
-	case 0x7b:		/* LD A, E */
-		LD(regs.A(), regs.E());
-		break;
-	case 0x7c:		/* LD A, H */
-		LD(regs.A(), regs.H());
-		break;
-	case 0x7d:
-		LD(regs.A(), regs.L());
-		break;
-	case 0x86:
-		ADD_A_IHL();
-		break;
-	case 0x90:		/* SUB A,B */
-		SUB_A_R8(regs.B());
-		break;
-	case 0xaf:		/* XOR A,A */
-		XOR_A_R8(regs.A());
-		break;
-	case 0xbe:		/* CP A,(HL) */
-		CP_A_IHL();
-		break;
-	case 0xc1:		/* POP BC */
-		POP_R16(regs.BC());
-		break;
-	case 0xc3:		/* JP u16 */
-		JP_U16(U16(operandA, operandB));
-		break;
-	case 0xc5:		/* PUSH BC */
-		PUSH_R16(regs.BC());
-		break;
-	case 0xc9:		/* RET */
-		RET();
-		break;
-	case 0xcb:
-		switch (operandA) {
-		case 0x7c:	/* BIT 7,H */
-			BIT_X_R8(7, regs.H());
+	if (wake) {
+		sleep = CPU_AWAKE;
+		return 0;
+	}
+	return bus->CyclesToNextEvent();
+}
+
+int Cpu::Step()
+{
+	u8 opcode, operandA, operandB;
+	u16 pc = regs.PC();
+
+	if (sleep != CPU_AWAKE)
+		return Sleep();
+
+	const u8* page = bus->ReadPage(pc);
+
+	// All three bytes from one page lookup, unless they cross into the next.
+	if (page != nullptr && (pc & 0xff) <= 0xfd && !haltBug) {
+		opcode = page[pc & 0xff];
+		operandA = page[(pc & 0xff) + 1];
+		operandB = page[(pc & 0xff) + 2];
+	} else {
+		opcode = bus->Read(pc);
+		if (haltBug) {
+			haltBug = false;
+			pc--;
+		}
+		operandA = bus->Read(pc + 1);
+		operandB = bus->Read(pc + 2);
+	}
+	Record(opcode, operandA, operandB);
+	regs.PC() = pc + 1;
+
+	const Opcode& op = mainOpcodeTable[opcode];
+
+	mCycles = op.mCycles;
+	(this->*op.handler)(operandA, operandB);
+	return mCycles;
+}
+
+/*
+	Decode the instructions starting at addr up to the next control flow
+	instruction. The block stops early rather than cross the boot ROM or a
+	16 KiB bank boundary, since what is mapped on the other side can change
+	independently. With fusion on, a pair from fusedPairs becomes one op.
+*/
+std::unique_ptr<BasicBlock> Cpu::DecodeBlock(Rom& rom, u16 addr)
+{
+	std::unique_ptr<BasicBlock> block = std::make_unique<BasicBlock>();
+	int limit = (rom.GetBankKey(addr) == BOOT_ROM_BANK) ? 0x0100 : (addr & 0xc000) + 0x4000;
+
+	while (block->ops.size() < MAX_BLOCK_OPS) {
+		u8 opcode = rom.Read(addr);
+		const Opcode& op = mainOpcodeTable[opcode];
+		DecodedOp decoded = { op.handler, opcode, 0, 0, op.length, op.mCycles };
+		u8 last = opcode;
+		u8 operands[2] = {};
+
+		if (addr + op.length > limit || op.handler == &Cpu::UNKNOWN)
 			break;
-		case 0x11:	/* RL C */
-			RL_R8(regs.C());
+		if (fusion && addr + op.length < limit) {
+			u8 next = rom.Read(addr + op.length);
+			OpcodeHandler fused = FusedHandler(opcode, next);
+
+			if (fused != nullptr && addr + op.length + mainOpcodeTable[next].length <= limit) {
+				decoded.handler = fused;
+				decoded.length += mainOpcodeTable[next].length;
+				decoded.mCycles += mainOpcodeTable[next].mCycles;
+				last = next;
+			}
+		}
+		// The operand bytes, past the second opcode of a fused pair.
+		for (int i = 1, n = 0; i < decoded.length; i++) {
+			if (i != op.length)
+				operands[n++] = rom.Read(addr + i);
+		}
+		decoded.operandA = operands[0];
+		decoded.operandB = operands[1];
+		block->ops.push_back(decoded);
+		addr += decoded.length;
+		if (EndsBlock(last))
 			break;
-		default:
-			spdlog::error("Opcode invalid - ${:02X} ${:02X}", opcode, operandA);
+	}
+	return block;
+}
+
+BasicBlock* Cpu::FetchBlock(Rom& rom, u16 pc)
+{
+	if (blockMapGeneration != rom.GetMapGeneration()) {
+		blockMapGeneration = rom.GetMapGeneration();
+		if (rom.IsBootROMUnlocked())
+			blockCache.InvalidateBank(BOOT_ROM_BANK);
+	}
+
+	u32 bankKey = rom.GetBankKey(pc);
+	BasicBlock* block = blockCache.Lookup(bankKey, pc);
+
+	if (block == nullptr)
+		block = blockCache.Insert(bankKey, pc, DecodeBlock(rom, pc));
+	return block;
+}
+
+int Cpu::RunBlock(Rom& rom, const BasicBlock& block, u16 pc)
+{
+	int total = 0;
+
+	for (const DecodedOp& op : block.ops) {
+		CatchUp(total);
+		Record(op.opcode, op.operandA, op.operandB);
+		regs.PC() = pc + 1;
+		mCycles = op.mCycles;
+		(this->*op.handler)(op.operandA, op.operandB);
+		if (mCycles == OPCODE_UNKNOWN)
 			return OPCODE_UNKNOWN;
-		};
-		regs.PC() += 1;
-		break;
-	case 0xcd:		/* CALL u16 */
-		CALL_U16(U16(operandA, operandB));
-		break;
-	case 0xe0:		/* LD [u16],A */
-		LD_IU8_A(operandA, rom);
-		break;
-	case 0xe2:		/* LD [$FF00+C],A */
-		LD_IC_A();
-		break;
-	case 0xea:		/* LD [u16],A */
-		LD_IU16_A(U16(operandA, operandB));
-		break;
-	case 0xf0:		/* LD A,[$FF00+u8] */
-		LD_A_IU16(operandA);
-		break;
-	case 0xfe:		/* CP A,u8 */
-		CP_U8(operandA);
-		break;
-	default:
-		spdlog::error("Opcode invalid - ${:02X}", opcode);
+		total += mCycles;
+		pc += op.length;
+		// Leave as soon as control flow or the memory map differs from what
+		// the block was decoded against.
+		if (regs.PC() != pc || rom.GetMapGeneration() != blockMapGeneration)
+			break;
+	}
+	return total;
+}
+
+/*
+	Run one cached basic block starting at PC and return the M-cycles it took,
+	or OPCODE_UNKNOWN. Code outside the ROM, addresses where no block can
+	be built, and a sleeping CPU go through Step instead.
+*/
+int Cpu::StepBlock(Rom& rom)
+{
+	u16 pc = regs.PC();
+
+	if (pc >= 0x8000 || sleep != CPU_AWAKE || haltBug)
+		return Step();
+
+	BasicBlock* block = FetchBlock(rom, pc);
+
+	if (block->ops.empty())
+		return Step();
+	return RunBlock(rom, *block, pc);
+}
+
+/*
+	Decode frequent instruction pairs into one op from now on, or stop doing
+	so. Blocks decoded the other way are dropped, compiled ones with them:
+	the JIT translates ops by their opcode and must never see a fused one.
+*/
+void Cpu::SetFusion(bool enable)
+{
+	if (fusion == enable)
+		return;
+	fusion = enable;
+	jit.Reset();
+	blockCache.Clear();
+}
+
+/*
+	Called from JIT compiled code for every instruction it did not translate,
+	with the M-cycles the block has spent before it. Returns the M-cycles
+	taken, with JIT_STOP set when the compiled block must be left after
+	this instruction, or OPCODE_UNKNOWN.
+*/
+int Cpu::JitRunOp(Cpu* cpu, const DecodedOp* op, u32 pc, int spent)
+{
+	cpu->CatchUp(spent);
+	cpu->regs.PC() = pc + 1;
+	cpu->mCycles = op->mCycles;
+	(cpu->*op->handler)(op->operandA, op->operandB);
+	if (cpu->mCycles == OPCODE_UNKNOWN)
 		return OPCODE_UNKNOWN;
-	};
-	return mCycles;
+	if (cpu->regs.PC() != ((pc + op->length) & 0xffff) ||
+		cpu->jitRom->GetMapGeneration() != cpu->blockMapGeneration)
+		return cpu->mCycles | JIT_STOP;
+	return cpu->mCycles;
+}
+
+/*
+	Same as StepBlock, except that blocks executed often enough are compiled to
+	native code. Anything the JIT can't handle runs on the cached interpreter.
+*/
+int Cpu::StepJit(Rom& rom)
+{
+	u16 pc = regs.PC();
+
+	if (pc >= 0x8000 || sleep != CPU_AWAKE || haltBug)
+		return Step();
+
+	BasicBlock* block = FetchBlock(rom, pc);
+
+	if (block->ops.empty())
+		return Step();
+	if (block->code == nullptr && ++block->hits == JIT_THRESHOLD && jit.IsAvailable()) {
+		block->code = jit.Compile(*this, *block, pc);
+		if (block->code == nullptr) {
+			// Out of code space: drop everything and let hot blocks compile again.
+			int mCycles = RunBlock(rom, *block, pc);
+
+			jit.Reset();
+			blockCache.Clear();
+			return mCycles;
+		}
+	}
+	if (block->code != nullptr) {
+		// Compiled code doesn't stop between instructions, so only the
+		// block entries make it into the flight recorder.
+		Record(block->ops[0].opcode, block->ops[0].operandA, block->ops[0].operandB);
+		jitRom = &rom;
+		return block->code(this);
+	}
+	return RunBlock(rom, *block, pc);
+}
+
+/*
+	Keep the last `instructions` executed in the flight recorder (rounded up
+	to a power of two).
+*/
+void Cpu::SetFlightRecorderSize(u32 instructions)
+{
+	recorder.Resize(instructions);
+}
+
+const FlightRecorder& Cpu::GetFlightRecorder() const
+{
+	return recorder;
+}
+
+/*
+	The register file. Decoded blocks and JIT code stay valid: they are keyed
+	by ROM bank, which the Rom section restores.
+*/
+void Cpu::SaveState(StateWriter& state)
+{
+	state.BeginSection(STATE_TAG_CPU);
+	state.Put(GetAF());
+	state.Put(regs.BC());
+	state.Put(regs.DE());
+	state.Put(regs.HL());
+	state.Put(regs.SP());
+	state.Put(regs.PC());
+	state.Put(sleep);
+	state.Put(haltBug);
+	state.EndSection();
+}
+
+void Cpu::LoadState(StateReader& state)
+{
+	u16 af = GetAF();
+
+	state.BeginSection(STATE_TAG_CPU);
+	state.Get(af);
+	SetAF(af);
+	state.Get(regs.BC());
+	state.Get(regs.DE());
+	state.Get(regs.HL());
+	state.Get(regs.SP());
+	state.Get(regs.PC());
+	sleep = CPU_AWAKE;
+	haltBug = false;
+	if (state.GetVersion() >= 4) {
+		state.Get(sleep);
+		state.Get(haltBug);
+	}
+	state.EndSection();
 }
 
-Cpu::Cpu(Bus *pBus) : bus(pBus)
+Cpu::Cpu(Bus *pBus)
 {
+	bus = pBus;
 	// DMG's registers start up value. Src:
 	// https://gbdev.io/pandocs/Power_Up_Sequence.html#power-up-sequence
 	//regs.af.a = 0x01;
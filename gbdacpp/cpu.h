@@ -3,7 +3,18 @@
 #include "common.h"
 #include "rom.h"
 #include "bus.h"
+#include "blockcache.h"
+#include "jit.h"
+#include "flightrecorder.h"
+#include "savestate.h"
 #include <fstream>
+#include <unordered_map>
+#include <utility>
+
+#define OPCODE_UNKNOWN			-1
+#define IDLE_LOOP_MAX_BYTES		16
+#define BULK_LOOP_MAX_BYTES		5
+#define JR_TAKEN_MCYCLES		3
 
 typedef struct CpuState {
 	u16 PC;
@@ -40,159 +51,280 @@ typedef enum {
 	FLAG_C = (1U << 4),
 } CpuFlag;
 
-typedef struct RegisterPair {
+/*
+	The register pairs in the order FlightRecord copies them, each a plain
+	u16 with its low byte first, so the 8-bit registers are bytes of it
+	rather than fields to mask out. AF is the odd one, with A in the low
+	byte.
+*/
+typedef struct CpuRegisters {
 private:
 	union {
-		u16 val;
-		struct {
-			u8 lowByte;
-			u8 highByte;
-		};
+		u16 pairs[6];			// AF, BC, DE, HL, SP, PC
+		u8 bytes[12];
 	};
 public:
-	RegisterPair& operator=(const u16 other)
-	{
-		val = other;
-		return *this;
-	}
-	RegisterPair& operator=(const RegisterPair& other)
+	u16& AF() { return pairs[0]; }
+	u16& BC() { return pairs[1]; }
+	u16& DE() { return pairs[2]; }
+	u16& HL() { return pairs[3]; }
+	u16& SP() { return pairs[4]; }
+	u16& PC() { return pairs[5]; }
+	u8& A() { return bytes[0]; }
+	u8& F() { return bytes[1]; }
+	u8& B() { return bytes[3]; }
+	u8& C() { return bytes[2]; }
+	u8& D() { return bytes[5]; }
+	u8& E() { return bytes[4]; }
+	u8& H() { return bytes[7]; }
+	u8& L() { return bytes[6]; }
+} CpuRegs;
+
+typedef struct Opcode {
+	OpcodeHandler handler;
+	u8 mCycles;
+	u8 length;
+} Opcode;
+
+typedef enum {
+	CPU_AWAKE,
+	CPU_HALTED,				// until an interrupt is pending
+	CPU_STOPPED,			// until a button is pressed
+} CpuSleep;
+
+typedef enum {
+	LOOP_NONE,
+	LOOP_IDLE,				// only polls registers that change at events
+	LOOP_BULK,				// fills or copies memory through HL
+} LoopKind;
+
+typedef enum {
+	EXEC_INTERPRETER,
+	EXEC_CACHED,
+	EXEC_JIT,
+	EXEC_FUSED,				// cached, with frequent instruction pairs run as one op
+} ExecMode;
+
+/*
+	What every step touches, in one cache line at the start of the Cpu:
+	the registers, the sleep and HALT bug state, the step's M-cycles and
+	how many of them the bus has seen, the loop check after each JR, the
+	bus (its read page table is the first thing in it, so fetches are one
+	load away) and the flight recorder. Everything else in Cpu is only
+	reached on block lookups, loop skips and the like.
+*/
+typedef struct alignas(64) CpuCore {
+	CpuRegs regs = {};
+	/*
+		Z is only worked out when something reads it: most instructions that
+		set it leave their result here instead, and Z is set when it is 0.
+		regs.F() holds the other flags, its Z bit is always clear.
+		N, H and C are stored as they are computed on purpose. Record copies
+		AF before every instruction, so deferring them would only move the
+		work there; Z gets away with it because this byte rides along in the
+		record's spare slot.
+	*/
+	u8 zero = 1;
+	bool haltBug = false;			// the next opcode byte is read twice
+	CpuSleep sleep = CPU_AWAKE;
+	int mCycles = 0;
+	int ticked = 0;					// of the current step's M-cycles, already handed to the bus
+	LoopKind loop = LOOP_NONE;		// of the last backward JR
+	Bus* bus = nullptr;
+	FlightRecorder recorder;
+} CpuCore;
+
+static_assert(sizeof(CpuCore) == 64, "the hot CPU state must fit one cache line");
+
+class Cpu : private CpuCore {
+private:
+	friend class Jit;
+
+	typedef u8& (CpuRegs::*R8)();
+	typedef u16& (CpuRegs::*R16)();
+
+	/*
+		A loop that stores A through HL once an iteration and then tests a
+		DEC r8 or BIT 7,H right before its JR NZ. A copy loads A from (DE)
+		first and has an INC DE anywhere in the body.
+	*/
+	typedef struct BulkLoop {
+		int mCycles;			// an iteration, with the taken JR
+		int step;				// what HL goes up by: 1 for LD (HL+),A, -1 for LD (HL-),A
+		bool copy;
+		R8 counter;				// the DEC r8's register, nullptr for BIT 7,H
+		OpcodeHandler test;		// the DEC r8 or BIT 7,H
+	} BulkLoop;
+
+	/*
+		How the loop a backward JR closes was classified, with what
+		TakeLoop hands on for it.
+	*/
+	typedef struct LoopMatch {
+		LoopKind kind;
+		int idleCycles;
+		BulkLoop bulk;
+	} LoopMatch;
+
+	static const std::array<Opcode, 256> mainOpcodeTable;
+	static const std::array<Opcode, 256> cbOpcodeTable;
+	static constexpr std::array<Opcode, 256> BuildMainOpcodeTable();
+	static constexpr std::array<Opcode, 256> BuildCbOpcodeTable();
+	template <size_t... i>
+	static constexpr std::array<OpcodeHandler, sizeof...(i)> BuildFusedTable(std::index_sequence<i...>);
+	static OpcodeHandler FusedHandler(u8, u8);
+
+	int idleLoopCycles = 0;
+	BulkLoop bulkLoop = {};
+	std::unordered_map<u16, LoopMatch> loopCache;		// by the JR's address, for loops in the ROM
+	u32 loopMapGeneration = 0;
+	BlockCache blockCache;
+	u32 blockMapGeneration = 0;
+	bool fusion = false;			// DecodeBlock fuses the pairs in fusedPairs
+	Jit jit;
+	Rom* jitRom = nullptr;
+
+	/*
+		Called with PC still on the instruction. The block paths only know
+		the bytes an instruction uses and record the others as 0; the byte
+		after the operands isn't read at all, to keep this down to a few
+		stores. Its slot holds zero instead, and Z is put back into F when
+		the records are read.
+	*/
+	inline void Record(u8 opcode, u8 operandA, u8 operandB)
 	{
-		this->val = other.val;
-		return *this;
+		FlightRecord record;
+
+		record.af = regs.AF();
+		record.bc = regs.BC();
+		record.de = regs.DE();
+		record.hl = regs.HL();
+		record.sp = regs.SP();
+		record.pc = regs.PC();
+		record.bytes[0] = opcode;
+		record.bytes[1] = operandA;
+		record.bytes[2] = operandB;
+		record.bytes[3] = zero;
+		recorder.Record(record);
 	}
-	RegisterPair& operator+=(const u8 num)
+	void StackPush(u8);
+	u8 StackPop();
+	std::unique_ptr<BasicBlock> DecodeBlock(Rom&, u16);
+	BasicBlock* FetchBlock(Rom&, u16);
+	int RunBlock(Rom&, const BasicBlock&, u16);
+	static int JitRunOp(Cpu*, const DecodedOp*, u32, int);
+	/*
+		Bring the rest of the machine up to `spent` M-cycles into the current
+		step, before an instruction in the middle of a block runs: whatever
+		I/O it touches has to see the time it runs at, as it would on the
+		interpreter. The step's return value still counts every M-cycle;
+		StepWith only ticks what TakeTicked says is left.
+	*/
+	inline void CatchUp(int spent)
 	{
-		val += num;
-		return *this;
+		bus->Tick(spent - ticked);
+		ticked = spent;
 	}
-	RegisterPair& operator^=(const u8 num)
+	int Sleep();
+	int IdleLoopCycles(u16, u16, int);
+	bool MatchBulkLoop(u16, u16, int, BulkLoop&);
+	LoopMatch MatchLoop(u16, u16);
+	void EnterLoop(u16, u16);
+	/*
+		For the JRs, with PC already at the target: a backward jump may
+		close an idle or a bulk loop.
+	*/
+	inline void BranchedTo(i8 offset)
 	{
-		val ^= num;
-		return *this;
+		if (offset >= 0)
+			return;
+
+		u16 head = regs.PC();
+
+		EnterLoop(head, head - offset - 2);
 	}
-	RegisterPair& operator-=(const u8 num)
+
+	void UNKNOWN(u8, u8);
+	void UNKNOWN_CB(u8, u8);
+	void PREFIX_CB(u8, u8);
+	void NOP(u8, u8);
+	void JP_U16(u8, u8);
+	void RLCA(u8, u8);
+	void LD_IU16_SP(u8, u8);
+	template <R16> void ADD_HL_R16(u8, u8);
+	template <R16> void LD_IR16_A(u8, u8);
+	template <R8> void XOR_A_R8(u8, u8);
+	void LD_HLD_A(u8, u8);
+	template <int, R8> void BIT_X_R8(u8, u8);
+	void JR_NZ_I8(u8, u8);
+	template <R8> void INC_R8(u8, u8);
+	template <R16> void INC_R16(u8, u8);
+	template <R8> void LD_R8_U8(u8, u8);
+	template <R8, R8> void LD_R8_R8(u8, u8);
+	template <R16> void LD_R16_U16(u8, u8);
+	void LD_IC_A(u8, u8);
+	template <R8> void LD_IHL_R8(u8, u8);
+	void LD_IU8_A(u8, u8);
+	template <R16> void LD_A_IR16(u8, u8);
+	void CALL_U16(u8, u8);
+	template <R16> void PUSH_R16(u8, u8);
+	template <R8> void RL_R8(u8, u8);
+	void RLA(u8, u8);
+	template <R16> void POP_R16(u8, u8);
+	template <R8> void DEC_R8(u8, u8);
+	void LD_HLI_A(u8, u8);
+	void RET(u8, u8);
+	void CP_U8(u8, u8);
+	void LD_IU16_A(u8, u8);
+	void JR_Z_I8(u8, u8);
+	void JR_I8(u8, u8);
+	void LD_A_IU16(u8, u8);
+	template <R8> void SUB_A_R8(u8, u8);
+	void CP_A_IHL(u8, u8);
+	void ADD_A_IHL(u8, u8);
+	void HALT(u8, u8);
+	void STOP(u8, u8);
+	template <u8, u8> void FUSED(u8, u8);
+protected:
+public:
+	CpuState GetCpuState();
+	inline u16 GetPC() { return regs.PC(); }
+	inline bool IsSleeping() const { return sleep != CPU_AWAKE; }
+	inline void SetFlag(CpuFlag flag, bool val)
 	{
-		val -= num;
-		return *this;
+		if (flag == FLAG_Z)
+			zero = !val;
+		else
+			regs.F() = (val) ? (regs.F() | flag) : (regs.F() & ~flag);
 	}
-	RegisterPair& operator++(int)
+	inline bool GetFlag(CpuFlag flag)
 	{
-		val++;
-		return *this;
+		return (flag == FLAG_Z) ? zero == 0 : (regs.F() & flag) != 0;
 	}
-	RegisterPair& operator--(int)
+	inline u16 GetAF() { return U16(regs.A(), regs.F() | (zero == 0 ? FLAG_Z : 0)); }
+	void SetAF(u16);
+	int Step();
+	int StepBlock(Rom&);
+	int StepJit(Rom&);
+	LoopKind TakeLoop(int&);
+	/*
+		How many of the last step's M-cycles CatchUp already ticked. Reading
+		it clears it.
+	*/
+	inline int TakeTicked()
 	{
-		val--;
-		return *this;
-	}
-	u8& LB() { return lowByte; }
-	u8& HB() { return highByte; }
-	u16& Get() { return val; }
-} RegPair;
-
-typedef struct AFRegisterPair {
-private:
-	union {
-		u16 val;
-		struct {
-			u8 a;
-			union {
-				u8 f;
-				struct {
-					u8 unused0 : 1;
-					u8 unused1 : 1;
-					u8 unused2 : 1;
-					u8 unused3 : 1;
-					u8 c : 1;
-					u8 h : 1;
-					u8 n : 1;
-					u8 z : 1;
-				};
-			};
-		};
-	};
-public:
-	u8& LB() { return f; }
-	u8& HB() { return a; }
-	u16& Get() { return val; }
-} AFRegPair;
-
-typedef struct CpuRegisters {
-private:
-	AFRegPair af;
-	RegPair bc;
-	RegPair de;
-	RegPair hl;
-	RegPair sp;
-	RegPair pc;
-public:
-	u16& AF() { return af.Get(); }
-	u16& BC() { return bc.Get(); }
-	u16& DE() { return de.Get(); }
-	u16& HL() { return hl.Get(); }
-	u16& SP() { return sp.Get(); }
-	u16& PC() { return pc.Get(); }
-	u8& A() { return af.HB(); }
-	u8& F() { return af.LB(); }
-	u8& B() { return bc.HB(); }
-	u8& C() { return bc.LB(); }
-	u8& D() { return de.HB(); }
-	u8& E() { return de.LB(); }
-	u8& H() { return hl.HB(); }
-	u8& L() { return hl.LB(); }
-} CpuRegs;
+		int spent = ticked;
 
-class Cpu {
-private:
-	CpuState state;
-	int mCycles;
-	CpuRegs regs;
-	Bus* bus = nullptr;
-
-	void StackPush(u8);
-	u8 StackPop();
-	void SetZNHC(bool, bool, bool, bool);
-	void NOP();
-	void JP_U16(u16);
-	void RLCA();
-	void LD_IU16_SP(u16);
-	void ADD_HL_R16(u16&);
-	void LD_IR16_A(u16&);
-
-	void XOR_A_R8(u8&);
-	void LD_HLD_A();
-	void BIT_X_R8(int, const u8);
-	void JR_NZ_I8(u8);
-	void INC(u8&);
-	void INC(u16&);
-	void LD(u8&, u8);
-	void LD(u16&, u16);
-	void LD_IC_A();
-	void LD_IHL_R8(u8&);
-	void LD_IU8_A(u8, Rom&);
-	void LD_A_IR16(u16);
-	void CALL_U16(u16);
-	void PUSH_R16(u16&);
-	void RL_R8(u8&);
-	void RLA();
-	void POP_R16(u16&);
-	void DEC(u8&);
-	void LD_HLI_A();
-	void RET();
-	void CP_U8(const u8);
-	void LD_IU16_A(const u16);
-	void JR_Z_I8(u8);
-	void JR_I8(u8);
-	void LD_A_IU16(const u8);
-	void SUB_A_R8(u8&);
-	void CP_A_IHL();
-	void ADD_A_IHL();
-protected:
-public:
-	CpuState GetCpuState() const;
-	void SetFlag(CpuFlag flag, bool val);
-	bool GetFlag(CpuFlag flag);
-	int Step(Rom&);
+		ticked = 0;
+		return spent;
+	}
+	int RunBulkLoop(int);
+	void SetFusion(bool);
+	static bool CanFuse(u8, u8);
+	void SetFlightRecorderSize(u32);
+	const FlightRecorder& GetFlightRecorder() const;
+	void SaveState(StateWriter&);
+	void LoadState(StateReader&);
 	Cpu(Bus *);
 	~Cpu();
 };
@@ -0,0 +1,73 @@
+#include "debugger.h"
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+void Debugger::SetBreakpoint(u16 addr, bool set)
+{
+	breakpoints[addr] = set;
+}
+
+/*
+	Stop after any instruction that accesses addr as `types` (WatchType
+	bits); no bits removes the watchpoint.
+*/
+void Debugger::SetWatchpoint(u16 addr, u8 types)
+{
+	bus->SetWatchpoint(addr, types);
+}
+
+/*
+	Write a binary CPU trace to `path`, or to the next free
+	Log/CpuInstructionLog file when it is nullptr.
+*/
+int Debugger::StartTrace(const char* path)
+{
+	auto logger = std::make_unique<Logger>();
+
+	if (logger->Open(path) == STT_FAILED)
+		return STT_FAILED;
+	trace = std::move(logger);
+	return STT_SUCCESS;
+}
+
+/*
+	Check every instruction from now on against the reference trace or
+	Gameboy-logs text log at refPath, printing `context` instructions before
+	the first mismatch.
+*/
+int Debugger::Verify(const char* refPath, int context)
+{
+	auto reference = std::make_unique<TraceComparator>();
+
+	if (reference->Open(refPath) == STT_FAILED)
+		return STT_FAILED;
+	reference->SetContext(context);
+	comparator = std::move(reference);
+	return STT_SUCCESS;
+}
+
+/*
+	Why the last run stopped, and the verification result if there is one.
+*/
+void Debugger::PrintReport() const
+{
+	if (stopReason == STEP_BREAKPOINT)
+		fmt::print("Breakpoint at {:04X}.\n", stopPc);
+	else if (stopReason == STEP_WATCHPOINT)
+		fmt::print("Watchpoint: the instruction at {:04X} {} {:02X} {} {:04X}.\n", stopPc,
+			(watchHit.type == WATCH_READ) ? "read" : "wrote", watchHit.val,
+			(watchHit.type == WATCH_READ) ? "from" : "to", watchHit.addr);
+	if (comparator != nullptr)
+		comparator->PrintReport();
+}
+
+Debugger::Debugger(Bus* pBus) : bus(pBus)
+{
+
+}
+
+Debugger::~Debugger()
+{
+	bus->ClearWatchpoints();
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+#include "cpu.h"
+#include "bus.h"
+#include "logger.h"
+#include "tracecmp.h"
+#include <bitset>
+#include <memory>
+
+// Step() results besides OPCODE_UNKNOWN.
+#define STEP_TRACE_MISMATCH			-2
+#define STEP_TRACE_END				-3
+#define STEP_BREAKPOINT				-4
+#define STEP_WATCHPOINT				-5
+
+/*
+	The hook policy of a release run: every hook is an empty inline, and
+	Emulator::StepWith drops the calls altogether when `enabled` is false, so
+	that instantiation is the same code as a step that never heard of hooks.
+*/
+struct NoHooks {
+	static constexpr bool enabled = false;
+
+	inline int BeforeStep(Cpu&) { return 0; }
+	inline int AfterStep() { return 0; }
+};
+
+/*
+	The hook policy of a debugging run: breakpoints, watchpoints, a CPU
+	trace and verification against a reference trace, all set up at run time.
+	BeforeStep runs before every instruction and may stop the run ahead of
+	it; AfterStep stops it after an instruction that tripped a watchpoint.
+	Hooks need to see every instruction, so a debugging run stays on the
+	interpreter.
+
+	Watchpoints live in the Bus page tables and cost nothing on unwatched
+	pages; see Bus.
+*/
+class Debugger {
+private:
+	Bus* bus;
+	std::bitset<0x10000> breakpoints;
+	int resumeAt = -1;			// the breakpoint we stopped at runs on the next step
+	int stopReason = 0;			// the STEP_* code of the last stop
+	u16 stopPc = 0;
+	WatchHit watchHit = {};
+	std::unique_ptr<Logger> trace;
+	std::unique_ptr<TraceComparator> comparator;
+public:
+	static constexpr bool enabled = true;
+
+	inline int BeforeStep(Cpu& cpu)
+	{
+		u16 pc = cpu.GetPC();
+
+		// A sleeping CPU runs no instruction, so there's nothing to stop before or trace.
+		if (cpu.IsSleeping())
+			return 0;
+		if (breakpoints[pc] && resumeAt != pc) {
+			resumeAt = pc;
+			stopPc = pc;
+			return stopReason = STEP_BREAKPOINT;
+		}
+		resumeAt = -1;
+		if (trace != nullptr || comparator != nullptr) {
+			TraceRecord record = MakeTraceRecord(cpu.GetCpuState());
+
+			if (trace != nullptr)
+				trace->Log(record);
+			if (comparator != nullptr) {
+				TraceCheck check = comparator->Check(record);
+
+				if (check != TRACE_MATCH)
+					return stopReason = (check == TRACE_MISMATCH) ? STEP_TRACE_MISMATCH : STEP_TRACE_END;
+			}
+		}
+		stopPc = pc;
+		return 0;
+	}
+	inline int AfterStep()
+	{
+		return bus->TakeWatchHit(watchHit) ? (stopReason = STEP_WATCHPOINT) : 0;
+	}
+	void SetBreakpoint(u16, bool);
+	void SetWatchpoint(u16, u8);
+	int StartTrace(const char*);
+	int Verify(const char*, int);
+	void PrintReport() const;
+	Debugger(Bus*);
+	~Debugger();
+};
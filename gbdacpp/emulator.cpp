@@ -1,29 +1,316 @@
 #include <fstream>
 #include <filesystem>
 #include <string>
+#include <algorithm>
 #include "emulator.h"
-#include "logger.h"
-
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
 
 int Emulator::Load(const char* romPath)
 {
-	return rom.Load(romPath);
+	if (rom.Load(romPath) == STT_FAILED)
+		return STT_FAILED;
+	bus.MapRom();
+	return STT_SUCCESS;
 }
 
-void Emulator::Run()
+int Emulator::Step()
 {
-	while(1) {
-#ifdef LOGGER_ENABLE
-		logger.LogCpuState(cpu.GetCpuState());
-#endif
-		if (cpu.Step(rom) == -1)
-			break;
+	if (debugger != nullptr)
+		return StepWith(*debugger);
+
+	NoHooks hooks;
+
+	return StepWith(hooks);
+}
+
+RunStatus Emulator::Run()
+{
+	return RunUntil([] { return false; });
+}
+
+/*
+	Where a run of mCycles that starts now has to stop. Steps are whole
+	instructions (whole blocks in the cached and JIT modes), so a run that
+	ends on its budget usually goes a little past it; the next run is
+	shortened by that much, which keeps back-to-back RunCycles/RunFrame calls
+	on the exact cycle count over time.
+*/
+u64 Emulator::BudgetEnd(u64 mCycles)
+{
+	u64 owed = std::min(overshoot, mCycles);
+
+	mCycles -= owed;
+	overshoot -= owed;
+	return (mCycles > UINT64_MAX - cycles) ? UINT64_MAX : cycles + mCycles;
+}
+
+RunStatus Emulator::RunCycles(u64 mCycles)
+{
+	return RunUntil([] { return false; }, mCycles);
+}
+
+/*
+	Run up to the start of the next VBlank. With the LCD off there is no
+	VBlank, so give up after one frame's worth of cycles instead; a frame-paced
+	frontend keeps its rhythm either way.
+*/
+RunStatus Emulator::RunFrame()
+{
+	u64 frame = ppu.GetFrameCount();
+	RunStatus status = RunUntil([this, frame] { return ppu.GetFrameCount() != frame; }, PPU_MCYCLES_PER_FRAME);
+
+	if (rewind != nullptr && SaveState(rewindState) == STT_SUCCESS)
+		rewind->Capture(rewindState);
+	return status;
+}
+
+/*
+	Run until the boot ROM hands over to the cartridge, e.g. to take the
+	post-boot savestate test runs start from.
+*/
+RunStatus Emulator::RunBootRom(u64 maxMCycles)
+{
+	return RunUntil([this] { return rom.IsBootROMUnlocked(); }, maxMCycles);
+}
+
+/*
+	Snapshot the whole machine into state (see savestate.h), replacing its
+	contents. Needs a loaded ROM.
+*/
+int Emulator::SaveState(std::vector<u8>& state)
+{
+	if (!rom.IsLoaded())
+		return STT_FAILED;
+
+	StateWriter writer(state);
+
+	bus.Sync();
+	writer.BeginSection(STATE_TAG_EMULATOR);
+	writer.Put(cycles);
+	writer.Put(overshoot);
+	writer.EndSection();
+	cpu.SaveState(writer);
+	rom.SaveState(writer);
+	ppu.SaveState(writer);
+	bus.SaveState(writer);
+	return STT_SUCCESS;
+}
+
+/*
+	Restore a snapshot taken by SaveState on the same ROM. A state that
+	doesn't load completely leaves the machine as it was.
+*/
+int Emulator::LoadState(const u8* data, size_t size)
+{
+	if (!rom.IsLoaded())
+		return STT_FAILED;
+
+	StateReader reader(data, size);
+
+	if (reader.Open() == STT_FAILED)
+		return STT_FAILED;
+
+	std::vector<u8> backup;
+
+	SaveState(backup);
+	LoadSections(reader);
+	if (reader.Failed()) {
+		spdlog::error("Can't load the savestate, it is damaged or from another cartridge.");
+		LoadState(backup.data(), backup.size());
+		return STT_FAILED;
 	}
+	bus.ResetDirtyPages(true);
+	return STT_SUCCESS;
+}
+
+/*
+	Same order as SaveState; the Bus goes last so it maps the restored banks.
+*/
+void Emulator::LoadSections(StateReader& reader)
+{
+	reader.BeginSection(STATE_TAG_EMULATOR);
+	reader.Get(cycles);
+	overshoot = 0;
+	if (reader.GetVersion() >= 2)
+		reader.Get(overshoot);
+	reader.EndSection();
+	cpu.LoadState(reader);
+	rom.LoadState(reader);
+	ppu.LoadState(reader);
+	bus.LoadState(reader);
+}
+
+/*
+	Remember the machine as it is now for ResetToCheckpoint, and start
+	tracking the pages written from here on.
+*/
+int Emulator::SetCheckpoint()
+{
+	if (SaveState(checkpoint) == STT_FAILED)
+		return STT_FAILED;
+	bus.TrackDirtyPages(true);
+	return STT_SUCCESS;
+}
+
+/*
+	Go back to the checkpoint. Only the memory pages written since the
+	checkpoint (or the last reset) are copied back, so for a search or
+	fuzzing loop that resets thousands of times a second a reset costs the
+	registers plus a few pages rather than a whole savestate.
+*/
+int Emulator::ResetToCheckpoint()
+{
+	if (checkpoint.empty())
+		return STT_FAILED;
+
+	StateReader reader(checkpoint.data(), checkpoint.size());
+
+	reader.Open();
+	reader.SetPageFilter(&bus.GetDirtyPages());
+	LoadSections(reader);
+	bus.ResetDirtyPages(false);
+	return STT_SUCCESS;
+}
+
+int Emulator::SaveStateFile(const char* path)
+{
+	std::vector<u8> state;
+
+	if (SaveState(state) == STT_FAILED)
+		return STT_FAILED;
+	return WriteStateFile(path, state);
+}
+
+int Emulator::LoadStateFile(const char* path)
+{
+	std::vector<u8> state;
+
+	if (ReadStateFile(path, state) == STT_FAILED)
+		return STT_FAILED;
+	return LoadState(state.data(), state.size());
+}
+
+/*
+	Keep up to `bytes` of history for Rewind, captured at the end of every
+	RunFrame. 0 turns rewinding off and drops the history.
+*/
+void Emulator::SetRewindBudget(size_t bytes)
+{
+	if (bytes == 0)
+		rewind.reset();
+	else
+		rewind = std::make_unique<RewindBuffer>(bytes);
+}
+
+/*
+	Go back to the end of the frame `frames` RunFrames ago; 0 returns to the
+	end of the last one. Later frames are dropped from the history.
+*/
+int Emulator::Rewind(u32 frames)
+{
+	if (rewind == nullptr || rewind->Rewind(frames, rewindState) == STT_FAILED)
+		return STT_FAILED;
+	return LoadState(rewindState.data(), rewindState.size());
+}
+
+/*
+	The debugger, created on first use. While it is attached every run goes
+	through its hooks.
+*/
+Debugger& Emulator::AttachDebugger()
+{
+	if (debugger == nullptr)
+		debugger = std::make_unique<Debugger>(&bus);
+	return *debugger;
+}
+
+/*
+	Drop the debugger with its breakpoints, watchpoints and trace; runs go
+	back to the hook-free step.
+*/
+void Emulator::DetachDebugger()
+{
+	debugger.reset();
+}
+
+/*
+	Check every instruction from now on against the reference trace or
+	Gameboy-logs text log at refPath, printing `context` instructions before
+	the first mismatch.
+*/
+int Emulator::VerifyTrace(const char* refPath, int context)
+{
+	return AttachDebugger().Verify(refPath, context);
+}
+
+void Emulator::SetFlightRecorderSize(u32 instructions)
+{
+	cpu.SetFlightRecorderSize(instructions);
+}
+
+/*
+	Write the flight recorder's instructions, oldest first, as a binary trace.
+*/
+int Emulator::DumpFlightRecorder(const char* path) const
+{
+	return cpu.GetFlightRecorder().Dump(path);
+}
+
+void Emulator::PrintDebugReport() const
+{
+	if (debugger != nullptr)
+		debugger->PrintReport();
+}
+
+/*
+	M-cycles emulated since power on.
+*/
+u64 Emulator::GetCycleCount() const
+{
+	return cycles;
+}
+
+/*
+	The instructions the flight recorder saw since power-on: every one,
+	except in the JIT mode, which only records the first of each block.
+*/
+u64 Emulator::GetRecordCount() const
+{
+	return cpu.GetFlightRecorder().GetRecordCount();
+}
+
+void Emulator::SetExecMode(ExecMode mode)
+{
+	execMode = mode;
+	cpu.SetFusion(mode == EXEC_FUSED);
+}
+
+void Emulator::SetPpuRenderer(PpuRenderer renderer)
+{
+	ppu.SetRenderer(renderer);
+}
+
+const std::string& Emulator::GetSerialOutput() const
+{
+	return bus.GetSerialOutput();
 }
 
-Emulator::Emulator(const char *romPath) : rom(), bus(&rom), cpu(&bus), logger()
+/*
+	fb receives PPU_WIDTH * PPU_HEIGHT shades (0-3); nullptr disables drawing.
+*/
+void Emulator::SetFramebuffer(u8* fb)
 {
+	ppu.SetFramebuffer(fb);
+}
 
+Emulator::Emulator() : rom(), ppu(), timer(), bus(&rom, &ppu, &timer), cpu(&bus)
+{
+#ifdef LOGGER_ENABLE
+	// Logger builds trace every emulator from the start.
+	AttachDebugger().StartTrace(nullptr);
+#endif
 }
 
 Emulator::~Emulator()
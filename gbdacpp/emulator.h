@@ -4,17 +4,210 @@
 #include "cpu.h"
 #include "bus.h"
 #include "rom.h"
-#include "logger.h"
+#include "ppu.h"
+#include "timer.h"
+#include "debugger.h"
+#include "savestate.h"
+#include "rewind.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define CPU_MCYCLES_PER_SECOND		1048576U
+
+typedef enum {
+	RUN_STOPPED,			// reached the requested point (frame, predicate)
+	RUN_BUDGET_SPENT,		// ran out of cycles first
+	RUN_UNKNOWN_OPCODE,
+	RUN_TRACE_MISMATCH,		// diverged from the reference trace
+	RUN_TRACE_END,			// matched the whole reference trace
+	RUN_BREAKPOINT,
+	RUN_WATCHPOINT,
+} RunStatus;
 
 class Emulator {
 private:
-	Cpu cpu;
-	Bus bus;
+	// In construction order: the Bus maps the PPU's memory, the Cpu needs the Bus.
 	Rom rom;
-	Logger logger;
+	Ppu ppu;
+	Timer timer;
+	Bus bus;
+	Cpu cpu;
+	ExecMode execMode = EXEC_INTERPRETER;
+	u64 cycles = 0;
+	u64 overshoot = 0;
+	std::unique_ptr<Debugger> debugger;
+	std::unique_ptr<RewindBuffer> rewind;
+	std::vector<u8> rewindState;
+	std::vector<u8> checkpoint;
+
+	u64 BudgetEnd(u64);
+	void LoadSections(StateReader&);
+	static RunStatus StepFailure(int mCycles)
+	{
+		switch (mCycles) {
+		case STEP_TRACE_MISMATCH:
+			return RUN_TRACE_MISMATCH;
+		case STEP_TRACE_END:
+			return RUN_TRACE_END;
+		case STEP_BREAKPOINT:
+			return RUN_BREAKPOINT;
+		case STEP_WATCHPOINT:
+			return RUN_WATCHPOINT;
+		default:
+			return RUN_UNKNOWN_OPCODE;
+		}
+	}
+	/*
+		After a step that branched back into an idle loop, `elapsed` of
+		whose M-cycles haven't been ticked yet, the M-cycles of the
+		iterations that can be skipped: those that end before the next
+		event, so that all their reads see the same values the last one did.
+		That only holds if no event ran during the last iteration either,
+		which can happen when it took several steps.
+	*/
+	inline int IdleLoopSkip(int elapsed, int loopCycles)
+	{
+		if (bus.CyclesSinceEvents() + elapsed < loopCycles)
+			return 0;
+
+		int iterations = (bus.CyclesToNextEvent() - elapsed - 1) / loopCycles;
+
+		return (iterations > 0) ? iterations * loopCycles : 0;
+	}
+	/*
+		Run one instruction (or block, in the cached and JIT modes) and let
+		the rest of the machine catch up; a block lets it catch up before
+		each of its instructions too. Returns the M-cycles spent,
+		OPCODE_UNKNOWN when the CPU hit an opcode it can't execute, or the
+		STEP_* code of a hook that stopped the run.
+	*/
+	template <typename Hooks>
+	inline int StepWith(Hooks& hooks)
+	{
+		ExecMode mode = execMode;
+		int mCycles;
+
+		if constexpr (Hooks::enabled) {
+			int stop = hooks.BeforeStep(cpu);
+
+			if (stop < 0)
+				return stop;
+			mode = EXEC_INTERPRETER;
+		}
+		switch (mode) {
+		case EXEC_CACHED:
+		case EXEC_FUSED:
+			mCycles = cpu.StepBlock(rom);
+			break;
+		case EXEC_JIT:
+			mCycles = cpu.StepJit(rom);
+			break;
+		default:
+			mCycles = cpu.Step();
+			break;
+		}
+		// A block has already ticked the M-cycles up to its last instruction.
+		int ticked = cpu.TakeTicked();
+
+		if (mCycles == OPCODE_UNKNOWN) {
+			cycles += ticked;
+			return OPCODE_UNKNOWN;
+		}
+
+		int loopCycles;
+		LoopKind loop = cpu.TakeLoop(loopCycles);
+
+		// Hooks have to see every iteration, so debugging runs don't skip any.
+		// Bulk loops stop short of the next event, like idle ones, so that
+		// it sees memory as the iterations would have left it.
+		if constexpr (!Hooks::enabled) {
+			if (loop == LOOP_IDLE)
+				mCycles += IdleLoopSkip(mCycles - ticked, loopCycles);
+			else if (loop == LOOP_BULK)
+				mCycles += cpu.RunBulkLoop(bus.CyclesToNextEvent() - (mCycles - ticked) - 1);
+		}
+		bus.Tick(mCycles - ticked);
+		cycles += mCycles;
+		if constexpr (Hooks::enabled) {
+			int stop = hooks.AfterStep();
+
+			if (stop < 0)
+				return stop;
+		}
+		return mCycles;
+	}
+	template <typename Hooks, typename Pred>
+	RunStatus RunWith(Hooks& hooks, Pred pred, u64 maxMCycles)
+	{
+		u64 end = BudgetEnd(maxMCycles);
+
+		while (cycles < end) {
+			int mCycles = StepWith(hooks);
+
+			if (mCycles < 0) {
+				overshoot = 0;
+				return StepFailure(mCycles);
+			}
+			if (pred()) {
+				overshoot = 0;
+				return RUN_STOPPED;
+			}
+		}
+		overshoot += cycles - end;
+		return RUN_BUDGET_SPENT;
+	}
 public:
-	void Run();
+	int Step();
+	RunStatus Run();
+	RunStatus RunCycles(u64);
+	RunStatus RunFrame();
+	RunStatus RunBootRom(u64 = UINT64_MAX);
+	/*
+		Run until pred() returns true, checked after every step, or until
+		maxMCycles have gone by. The hook policy is picked once per run:
+		the debugger's while one is attached, none otherwise.
+	*/
+	template <typename Pred>
+	RunStatus RunUntil(Pred pred, u64 maxMCycles = UINT64_MAX)
+	{
+		if (debugger != nullptr)
+			return RunWith(*debugger, pred, maxMCycles);
+
+		NoHooks hooks;
+
+		return RunWith(hooks, pred, maxMCycles);
+	}
+	/*
+		Run maxMCycles with a hook policy of the caller's, which sees every
+		instruction on the interpreter the way the debugger does.
+	*/
+	template <typename Hooks>
+	RunStatus RunCyclesWith(Hooks& hooks, u64 maxMCycles)
+	{
+		return RunWith(hooks, [] { return false; }, maxMCycles);
+	}
+	int SaveState(std::vector<u8>&);
+	int LoadState(const u8*, size_t);
+	int SaveStateFile(const char*);
+	int LoadStateFile(const char*);
+	int SetCheckpoint();
+	int ResetToCheckpoint();
+	void SetRewindBudget(size_t);
+	int Rewind(u32);
+	Debugger& AttachDebugger();
+	void DetachDebugger();
+	int VerifyTrace(const char*, int);
+	void PrintDebugReport() const;
+	void SetFlightRecorderSize(u32);
+	int DumpFlightRecorder(const char*) const;
+	u64 GetCycleCount() const;
+	u64 GetRecordCount() const;
+	void SetExecMode(ExecMode);
+	void SetPpuRenderer(PpuRenderer);
+	void SetFramebuffer(u8*);
+	const std::string& GetSerialOutput() const;
 	int Load(const char *);
-	Emulator(const char *);
+	Emulator();
 	~Emulator();
 };
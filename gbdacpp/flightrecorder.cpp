@@ -0,0 +1,87 @@
+#include "flightrecorder.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstdio>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+/*
+	Keep the last `size` instructions, rounded up to a power of two. Whatever
+	was recorded so far is dropped.
+*/
+void FlightRecorder::Resize(u32 size)
+{
+	u32 capacity = FLIGHT_RECORDER_MIN_SIZE;
+
+	while (capacity < size && capacity < (1U << 31))
+		capacity <<= 1;
+	records = std::make_unique<FlightRecord[]>(capacity);
+	mask = capacity - 1;
+	head.store(0, std::memory_order_relaxed);
+}
+
+/*
+	The recorded instructions, oldest first.
+*/
+std::vector<TraceRecord> FlightRecorder::Snapshot() const
+{
+	u64 end = head.load(std::memory_order_acquire);
+	u64 start = end - std::min<u64>(end, (u64)mask + 1);
+	std::vector<TraceRecord> snapshot;
+
+	snapshot.reserve((size_t)(end - start));
+	for (u64 i = start; i < end; i++) {
+		const FlightRecord& r = records[i & mask];
+
+		// Z (bit 7 of F) is set when the result the CPU keeps for it is 0.
+		u8 f = (r.af >> 8) | ((r.bytes[3] == 0) ? 0x80 : 0);
+
+		snapshot.push_back({ r.pc, r.sp, (u16)((r.af << 8) | f), r.bc, r.de, r.hl,
+			{ r.bytes[0], r.bytes[1], r.bytes[2], 0 } });
+	}
+	return snapshot;
+}
+
+/*
+	Write the recorded instructions as a binary trace, which --trace-text
+	turns into text.
+*/
+int FlightRecorder::Dump(const char* path) const
+{
+	std::vector<TraceRecord> snapshot = Snapshot();
+	std::FILE* file = std::fopen(path, "wb");
+
+	if (file == nullptr) {
+		spdlog::error("Can't create {}.", path);
+		return STT_FAILED;
+	}
+
+	bool written = std::fwrite(TRACE_MAGIC, 1, 8, file) == 8 &&
+		std::fwrite(snapshot.data(), sizeof(TraceRecord), snapshot.size(), file) == snapshot.size();
+
+	written = (std::fclose(file) == 0) && written;
+	return written ? STT_SUCCESS : STT_FAILED;
+}
+
+/*
+	Log the last `lines` instructions as errors, for a quick look at a crash.
+*/
+void FlightRecorder::LogTail(int lines) const
+{
+	std::vector<TraceRecord> snapshot = Snapshot();
+	size_t start = snapshot.size() - std::min(snapshot.size(), (size_t)std::max(lines, 0));
+
+	for (size_t i = start; i < snapshot.size(); i++)
+		spdlog::error("  {}", FormatTraceRecord(snapshot[i]));
+}
+
+FlightRecorder::FlightRecorder()
+{
+	Resize(FLIGHT_RECORDER_DEFAULT_SIZE);
+}
+
+FlightRecorder::~FlightRecorder()
+{
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "trace.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#define FLIGHT_RECORDER_DEFAULT_SIZE	(64U * KiB)
+#define FLIGHT_RECORDER_MIN_SIZE		16U
+
+/*
+	A register file copied as is from the CPU (AF with A in the low byte)
+	and the opcode bytes, turned into TraceRecords only when read out. F
+	comes without Z: bytes[3], past the operands, holds the result Z is
+	worked out from instead (see Cpu::zero).
+*/
+typedef struct FlightRecord {
+	u16 af;
+	u16 bc;
+	u16 de;
+	u16 hl;
+	u16 sp;
+	u16 pc;
+	u8 bytes[4];
+} FlightRecord;
+
+static_assert(sizeof(FlightRecord) == 16, "flight records must stay 16 bytes");
+
+/*
+	Ring buffer of the last executed instructions. The CPU thread is the
+	only writer and never waits: a record is a 16-byte copy plus a counter
+	bump. Readers take a snapshot; one taken from
+	another thread while the CPU runs may catch the oldest records being
+	overwritten, so post-mortem dumps should come from the CPU thread or
+	after it stopped.
+*/
+class FlightRecorder {
+private:
+	std::unique_ptr<FlightRecord[]> records;
+	u32 mask = 0;
+	std::atomic<u64> head{ 0 };
+public:
+	inline void Record(const FlightRecord& record)
+	{
+		u64 h = head.load(std::memory_order_relaxed);
+
+		records[h & mask] = record;
+		head.store(h + 1, std::memory_order_release);
+	}
+	// Everything recorded so far, including what was overwritten since.
+	inline u64 GetRecordCount() const
+	{
+		return head.load(std::memory_order_acquire);
+	}
+	void Resize(u32);
+	std::vector<TraceRecord> Snapshot() const;
+	int Dump(const char*) const;
+	void LogTail(int) const;
+	FlightRecorder();
+	~FlightRecorder();
+};
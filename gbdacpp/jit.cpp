@@ -0,0 +1,359 @@
+#include "jit.h"
+#include "cpu.h"
+#include <algorithm>
+#include <vector>
+#define FMT_HEADER_ONLY
+#include <spdlog/spdlog.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_X64
+#endif
+
+#ifdef JIT_X64
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+#define JIT_BUFFER_SIZE			(4 * MiB)
+#define JIT_MAX_OP_SIZE			64
+
+/*
+	Generated code layout: rbx holds the Cpu pointer and r12d the M-cycles
+	spent so far in the block, both callee-saved in the Windows and System V
+	ABIs. Untranslated instructions call Cpu::JitRunOp(cpu, op, pc, r12d).
+*/
+#define AL						0
+#define CL						1
+#define DL						2
+
+static int Offset(const Cpu& cpu, const void* field)
+{
+	return static_cast<int>(reinterpret_cast<const u8*>(field) - reinterpret_cast<const u8*>(&cpu));
+}
+
+void Jit::Emit8(u8 val)
+{
+	buffer[used++] = val;
+}
+
+void Jit::Emit16(u16 val)
+{
+	Emit8(LSB(val));
+	Emit8(MSB(val));
+}
+
+void Jit::Emit32(u32 val)
+{
+	Emit16(val & 0xffff);
+	Emit16(val >> 16);
+}
+
+void Jit::Emit64(u64 val)
+{
+	Emit32(val & 0xffffffff);
+	Emit32(val >> 32);
+}
+
+/*
+	Emit "opcode reg, [rbx + disp32]".
+*/
+void Jit::EmitMem(u8 opcode, u8 reg, int disp)
+{
+	Emit8(opcode);
+	Emit8(0x80 | (reg << 3) | 0x03);
+	Emit32(static_cast<u32>(disp));
+}
+
+/*
+	Emit a 0F-prefixed conditional jump (or E9 jmp when cc is 0) with a rel32
+	to be patched later, and return the position of the rel32.
+*/
+size_t Jit::EmitJump32(u8 cc)
+{
+	if (cc) {
+		Emit8(0x0f);
+		Emit8(cc);
+	} else {
+		Emit8(0xe9);
+	}
+	Emit32(0);
+	return used - 4;
+}
+
+void Jit::PatchJump32(size_t at, size_t target)
+{
+	u32 rel = static_cast<u32>(target - (at + 4));
+
+	for (int i = 0; i < 4; i++)
+		buffer[at + i] = (rel >> (i * 8)) & 0xff;
+}
+
+/*
+	Offset of an 8-bit register, numbered the way opcodes encode them:
+	B, C, D, E, H, L, (HL), A. -1 for (HL).
+*/
+int Jit::RegOffset(Cpu& cpu, int r)
+{
+	switch (r) {
+	case 0: return Offset(cpu, &cpu.regs.B());
+	case 1: return Offset(cpu, &cpu.regs.C());
+	case 2: return Offset(cpu, &cpu.regs.D());
+	case 3: return Offset(cpu, &cpu.regs.E());
+	case 4: return Offset(cpu, &cpu.regs.H());
+	case 5: return Offset(cpu, &cpu.regs.L());
+	case 7: return Offset(cpu, &cpu.regs.A());
+	default: return -1;
+	}
+}
+
+/*
+	Translate the register-only instructions. Flags are stored exactly like
+	the interpreter's handlers do: the result into Cpu::zero and N, H and C
+	into F, leaving its low nibble untouched. Returns false for anything that
+	has to go through the interpreter.
+*/
+bool Jit::EmitNative(Cpu& cpu, const DecodedOp& op)
+{
+	u8 opcode = op.opcode;
+	int dst = RegOffset(cpu, (opcode >> 3) & 0x07), src = RegOffset(cpu, opcode & 0x07);
+	int f = Offset(cpu, &cpu.regs.F()), zero = Offset(cpu, &cpu.zero);
+
+	if (opcode == 0x00) {									/* NOP */
+		return true;
+	} else if ((opcode & 0xc7) == 0x06 && dst >= 0) {		/* LD r8,u8 */
+		EmitMem(0xc6, 0, dst);
+		Emit8(op.operandA);
+		return true;
+	} else if (IN_RANGE(opcode, 0x40, 0x7f) && dst >= 0 && src >= 0) {		/* LD r8,r8 */
+		EmitMem(0x8a, AL, src);
+		EmitMem(0x88, AL, dst);
+		return true;
+	} else if ((opcode & 0xcf) == 0x03) {					/* INC r16 */
+		const u16* r16[] = { &cpu.regs.BC(), &cpu.regs.DE(), &cpu.regs.HL(), &cpu.regs.SP() };
+
+		Emit8(0x66);
+		EmitMem(0xff, 0, Offset(cpu, r16[opcode >> 4]));
+		return true;
+	} else if ((opcode & 0xc7) == 0x04 && dst >= 0) {		/* INC r8 */
+		EmitMem(0x8a, AL, dst);
+		EmitMem(0x8a, DL, f);
+		Emit8(0x80); Emit8(0xe2); Emit8(0x1f);				// and dl, 0x1f
+		Emit8(0x88); Emit8(0xc1);							// mov cl, al
+		Emit8(0xfe); Emit8(0xc0);							// inc al
+		Emit8(0x30); Emit8(0xc1);							// xor cl, al
+		Emit8(0x80); Emit8(0xe1); Emit8(0x10);				// and cl, 0x10
+		Emit8(0x00); Emit8(0xc9);							// add cl, cl
+		Emit8(0x08); Emit8(0xca);							// or dl, cl
+		EmitMem(0x88, AL, dst);
+		EmitMem(0x88, AL, zero);
+		EmitMem(0x88, DL, f);
+		return true;
+	} else if ((opcode & 0xc7) == 0x05 && dst >= 0) {		/* DEC r8 */
+		EmitMem(0x8a, AL, dst);
+		EmitMem(0x8a, DL, f);
+		Emit8(0x80); Emit8(0xe2); Emit8(0x1f);				// and dl, 0x1f
+		Emit8(0x80); Emit8(0xca); Emit8(FLAG_N);			// or dl, FLAG_N
+		Emit8(0x88); Emit8(0xc1);							// mov cl, al
+		Emit8(0xfe); Emit8(0xc8);							// dec al
+		Emit8(0x30); Emit8(0xc1);							// xor cl, al
+		Emit8(0x80); Emit8(0xe1); Emit8(0x10);				// and cl, 0x10
+		Emit8(0x00); Emit8(0xc9);							// add cl, cl
+		Emit8(0x08); Emit8(0xca);							// or dl, cl
+		EmitMem(0x88, AL, dst);
+		EmitMem(0x88, AL, zero);
+		EmitMem(0x88, DL, f);
+		return true;
+	} else if (IN_RANGE(opcode, 0xa8, 0xaf) && src >= 0) {	/* XOR A,r8 */
+		int a = RegOffset(cpu, 7);
+
+		EmitMem(0x8a, AL, a);
+		EmitMem(0x32, AL, src);
+		EmitMem(0x80, 4, f);								// and byte [F], 0x0f
+		Emit8(0x0f);
+		EmitMem(0x88, AL, a);
+		EmitMem(0x88, AL, zero);
+		return true;
+	}
+	return false;
+}
+
+/*
+	Make the pages holding buffer[from, to) writable, or executable, never
+	both: kernels that enforce W^X refuse pages that are. Compiled code
+	only runs between Compile calls, so flipping pages under it is safe.
+*/
+bool Jit::Protect(size_t from, size_t to, bool exec)
+{
+#ifdef JIT_X64
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	size_t pageSize = info.dwPageSize;
+#else
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	size_t first = from & ~(pageSize - 1);
+	size_t last = std::min(((to + pageSize - 1) & ~(pageSize - 1)), (size_t)JIT_BUFFER_SIZE);
+	bool ok;
+
+#ifdef _WIN32
+	DWORD old;
+
+	ok = VirtualProtect(buffer + first, last - first, exec ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old) != 0;
+	if (ok && exec)
+		FlushInstructionCache(GetCurrentProcess(), buffer + first, last - first);
+#else
+	ok = mprotect(buffer + first, last - first, exec ? (PROT_READ | PROT_EXEC) : (PROT_READ | PROT_WRITE)) == 0;
+#endif
+	if (!ok && !protectFailed) {
+		spdlog::error("Can't switch JIT code pages between writable and executable, the JIT is off.");
+		protectFailed = true;
+	}
+	return ok;
+#else
+	return false;
+#endif
+}
+
+/*
+	Compile a basic block that starts at pc into a function returning the
+	M-cycles it took (or -1 for an unknown opcode). Returns nullptr when the
+	code buffer is full, or when its pages can't be made writable and then
+	executable again.
+*/
+JitCode Jit::Compile(Cpu& cpu, const BasicBlock& block, u16 pc)
+{
+#ifdef JIT_X64
+	std::vector<size_t> toDone, toUnknown;
+	size_t start = used, done, ret;
+	size_t end = used + (block.ops.size() + 2) * JIT_MAX_OP_SIZE;
+	u32 pending = 0;
+	bool pcDirty = false;
+
+	if (buffer == nullptr || end > JIT_BUFFER_SIZE || !Protect(start, end, false))
+		return nullptr;
+
+	Emit8(0x53);											// push rbx
+	Emit8(0x41); Emit8(0x54);								// push r12
+	Emit8(0x48); Emit8(0x83); Emit8(0xec); Emit8(0x28);		// sub rsp, 40
+#ifdef _WIN32
+	Emit8(0x48); Emit8(0x89); Emit8(0xcb);					// mov rbx, rcx
+#else
+	Emit8(0x48); Emit8(0x89); Emit8(0xfb);					// mov rbx, rdi
+#endif
+	Emit8(0x45); Emit8(0x31); Emit8(0xe4);					// xor r12d, r12d
+
+	for (const DecodedOp& op : block.ops) {
+		if (EmitNative(cpu, op)) {
+			pending += op.mCycles;
+			pcDirty = true;
+		} else {
+			if (pending) {
+				Emit8(0x41); Emit8(0x81); Emit8(0xc4); Emit32(pending);	// add r12d, pending
+				pending = 0;
+			}
+#ifdef _WIN32
+			Emit8(0x48); Emit8(0x89); Emit8(0xd9);			// mov rcx, rbx
+			Emit8(0x48); Emit8(0xba); Emit64(reinterpret_cast<u64>(&op));	// mov rdx, op
+			Emit8(0x41); Emit8(0xb8); Emit32(pc);			// mov r8d, pc
+			Emit8(0x45); Emit8(0x89); Emit8(0xe1);			// mov r9d, r12d
+#else
+			Emit8(0x48); Emit8(0x89); Emit8(0xdf);			// mov rdi, rbx
+			Emit8(0x48); Emit8(0xbe); Emit64(reinterpret_cast<u64>(&op));	// mov rsi, op
+			Emit8(0xba); Emit32(pc);						// mov edx, pc
+			Emit8(0x44); Emit8(0x89); Emit8(0xe1);			// mov ecx, r12d
+#endif
+			Emit8(0x48); Emit8(0xb8); Emit64(reinterpret_cast<u64>(&Cpu::JitRunOp));	// mov rax, JitRunOp
+			Emit8(0xff); Emit8(0xd0);						// call rax
+			Emit8(0x85); Emit8(0xc0);						// test eax, eax
+			toUnknown.push_back(EmitJump32(0x88));			// js unknown
+			Emit8(0x0f); Emit8(0xb6); Emit8(0xc8);			// movzx ecx, al
+			Emit8(0x41); Emit8(0x01); Emit8(0xcc);			// add r12d, ecx
+			Emit8(0xf6); Emit8(0xc4); Emit8(JIT_STOP >> 8);	// test ah, JIT_STOP >> 8
+			toDone.push_back(EmitJump32(0x85));				// jnz done
+			pcDirty = false;
+		}
+		pc += op.length;
+	}
+	if (pending) {
+		Emit8(0x41); Emit8(0x81); Emit8(0xc4); Emit32(pending);	// add r12d, pending
+	}
+	if (pcDirty) {
+		Emit8(0x66);
+		EmitMem(0xc7, 0, Offset(cpu, &cpu.regs.PC()));		// mov word [PC], pc
+		Emit16(pc);
+	}
+
+	done = used;
+	Emit8(0x44); Emit8(0x89); Emit8(0xe0);					// mov eax, r12d
+	ret = used;
+	Emit8(0x48); Emit8(0x83); Emit8(0xc4); Emit8(0x28);		// add rsp, 40
+	Emit8(0x41); Emit8(0x5c);								// pop r12
+	Emit8(0x5b);											// pop rbx
+	Emit8(0xc3);											// ret
+	for (size_t at : toUnknown)
+		PatchJump32(at, used);
+	Emit8(0xb8); Emit32(0xffffffff);						// mov eax, -1
+	Emit8(0xeb); Emit8(static_cast<u8>(ret - (used + 1)));	// jmp ret
+	for (size_t at : toDone)
+		PatchJump32(at, done);
+	if (!Protect(start, used, true))
+		return nullptr;
+	return reinterpret_cast<JitCode>(buffer + start);
+#else
+	return nullptr;
+#endif
+}
+
+/*
+	The code buffer is only allocated the first time a block gets hot. It
+	starts out writable; Compile makes each block executable once written.
+*/
+bool Jit::IsAvailable()
+{
+#ifdef JIT_X64
+	if (buffer == nullptr && !allocFailed) {
+#ifdef _WIN32
+		buffer = static_cast<u8*>(VirtualAlloc(nullptr, JIT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+		void* mem = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		buffer = (mem == MAP_FAILED) ? nullptr : static_cast<u8*>(mem);
+#endif
+		allocFailed = (buffer == nullptr);
+	}
+	return buffer != nullptr && !protectFailed;
+#else
+	return false;
+#endif
+}
+
+void Jit::Reset()
+{
+	used = 0;
+}
+
+Jit::Jit()
+{
+
+}
+
+Jit::~Jit()
+{
+#ifdef JIT_X64
+	if (buffer != nullptr) {
+#ifdef _WIN32
+		VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+		munmap(buffer, JIT_BUFFER_SIZE);
+#endif
+	}
+#endif
+}
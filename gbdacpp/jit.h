@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "blockcache.h"
+#include <cstddef>
+
+#define JIT_STOP				0x100
+
+/*
+	x86-64 code generator for hot ROM basic blocks. Register-only instructions
+	are translated to native code; everything else (memory and I/O accesses,
+	control flow) calls back into the interpreter's handler for that opcode, so
+	both produce exactly the same machine state.
+*/
+class Jit {
+private:
+	u8* buffer = nullptr;
+	size_t used = 0;
+	bool allocFailed = false;
+	bool protectFailed = false;		// the OS won't switch pages between writable and executable
+
+	void Emit8(u8);
+	void Emit16(u16);
+	void Emit32(u32);
+	void Emit64(u64);
+	void EmitMem(u8, u8, int);
+	size_t EmitJump32(u8);
+	void PatchJump32(size_t, size_t);
+	bool EmitNative(Cpu&, const DecodedOp&);
+	int RegOffset(Cpu&, int);
+	bool Protect(size_t, size_t, bool);
+public:
+	bool IsAvailable();
+	JitCode Compile(Cpu&, const BasicBlock&, u16);
+	void Reset();
+	Jit();
+	~Jit();
+};
@@ -1,23 +1,124 @@
 #include "logger.h"
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <string>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
 
-void Logger::LogCpuState(const CpuState state)
-{	
-	/* 
-		using the boot rom's log file from https://github.com/wheremyfoodat/Gameboy-logs
-		to see if something goes wrong 
-	 */
-	cpuStateLogger->info("A: {:02X} F: {:02X} B: {:02X} C: {:02X} D: {:02X} E: {:02X} H: {:02X} L: {:02X} SP: {:04X} PC: 00:{:04X} ({:02X} {:02X} {:02X} {:02X})", 
-			state.AF.A, state.AF.F, MSB(state.BC), LSB(state.BC), MSB(state.DE), LSB(state.DE),
-			MSB(state.HL), LSB(state.HL), state.SP, state.PC,
-			state.romData[0], state.romData[1], state.romData[2], state.romData[3]);
+/*
+	The line format of https://github.com/wheremyfoodat/Gameboy-logs.
+*/
+static void AppendTraceText(fmt::memory_buffer& text, const TraceRecord& r)
+{
+	fmt::format_to(std::back_inserter(text),
+		"A: {:02X} F: {:02X} B: {:02X} C: {:02X} D: {:02X} E: {:02X} H: {:02X} L: {:02X} SP: {:04X} PC: 00:{:04X} ({:02X} {:02X} {:02X} {:02X})",
+		MSB(r.af), LSB(r.af), MSB(r.bc), LSB(r.bc), MSB(r.de), LSB(r.de), MSB(r.hl), LSB(r.hl), r.sp, r.pc,
+		r.romData[0], r.romData[1], r.romData[2], r.romData[3]);
+}
+
+std::string FormatTraceRecord(const TraceRecord& record)
+{
+	fmt::memory_buffer text;
+
+	AppendTraceText(text, record);
+	return fmt::to_string(text);
+}
+
+void Logger::Flush()
+{
+	if (file != nullptr && used > 0)
+		std::fwrite(buffer.get(), sizeof(TraceRecord), used, file);
+	used = 0;
 }
 
-Logger::Logger()
+/*
+	Start a trace at `path`. Several emulators can live in one process (the
+	batch runner), so without a path every Logger gets a file of its own; the
+	first one is Log/CpuInstructionLog.bin.
+*/
+int Logger::Open(const char* path)
 {
-	cpuStateLogger = spdlog::basic_logger_mt("cpu instruction", "Log/CpuInstructionLog.txt", true);
-	cpuStateLogger->set_pattern("%v");
+	static std::atomic<int> instances{ 0 };
+	std::string name;
+	std::error_code ec;
+
+	if (path == nullptr) {
+		int id = instances++;
+
+		name = (id == 0) ? "Log/CpuInstructionLog.bin" : fmt::format("Log/CpuInstructionLog.{}.bin", id);
+		std::filesystem::create_directories("Log", ec);
+	} else {
+		name = path;
+	}
+	Flush();
+	if (file != nullptr)
+		std::fclose(file);
+	file = std::fopen(name.c_str(), "wb");
+	if (file == nullptr) {
+		spdlog::error("Can't create the trace file {}.", name);
+		return STT_FAILED;
+	}
+	// The records are buffered here already.
+	std::setvbuf(file, nullptr, _IONBF, 0);
+	std::fwrite(TRACE_MAGIC, 1, 8, file);
+	return STT_SUCCESS;
+}
+
+Logger::Logger() : buffer(std::make_unique<TraceRecord[]>(TRACE_BUFFER_RECORDS))
+{
+
 }
 
 Logger::~Logger()
 {
-}
\ No newline at end of file
+	Flush();
+	if (file != nullptr)
+		std::fclose(file);
+}
+
+/*
+	Render a binary trace as a Gameboy-logs text log, one line per record.
+*/
+int ConvertTraceToText(const char* tracePath, const char* textPath)
+{
+	std::FILE* in = std::fopen(tracePath, "rb");
+	char magic[8];
+
+	if (in == nullptr) {
+		spdlog::error("Can't open the trace file {}.", tracePath);
+		return STT_FAILED;
+	}
+	if (std::fread(magic, 1, 8, in) != 8 || std::memcmp(magic, TRACE_MAGIC, 8) != 0) {
+		spdlog::error("{} is not a CPU trace.", tracePath);
+		std::fclose(in);
+		return STT_FAILED;
+	}
+
+	std::FILE* out = std::fopen(textPath, "wb");
+
+	if (out == nullptr) {
+		spdlog::error("Can't create {}.", textPath);
+		std::fclose(in);
+		return STT_FAILED;
+	}
+
+	auto records = std::make_unique<TraceRecord[]>(TRACE_BUFFER_RECORDS);
+	fmt::memory_buffer text;
+	size_t count;
+
+	while ((count = std::fread(records.get(), sizeof(TraceRecord), TRACE_BUFFER_RECORDS, in)) > 0) {
+		text.clear();
+		for (size_t i = 0; i < count; i++) {
+			AppendTraceText(text, records[i]);
+			text.push_back('\n');
+		}
+		std::fwrite(text.data(), 1, text.size(), out);
+	}
+	std::fclose(in);
+	std::fclose(out);
+	return STT_SUCCESS;
+}
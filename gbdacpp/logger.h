@@ -2,19 +2,54 @@
 
 #include "common.h"
 #include "cpu.h"
+#include "trace.h"
+#include <cstdio>
+#include <memory>
+#include <string>
 
-#define FMT_HEADER_ONLY
-#include <fmt/core.h>
+#define TRACE_BUFFER_RECORDS		(64U * KiB)
 
-#include <spdlog/spdlog.h>
-#include <spdlog/sinks/basic_file_sink.h>
+static inline TraceRecord MakeTraceRecord(const CpuState& state)
+{
+	TraceRecord record;
 
+	record.pc = state.PC;
+	record.sp = state.SP;
+	record.af = U16(state.AF.F, state.AF.A);
+	record.bc = state.BC;
+	record.de = state.DE;
+	record.hl = state.HL;
+	for (int i = 0; i < 4; i++)
+		record.romData[i] = state.romData[i];
+	return record;
+}
+
+/*
+	Writes the CPU trace, one TraceRecord per instruction, into a
+	TRACE_BUFFER_RECORDS record buffer that goes to disk in one write when
+	full; nothing is written until Open. ConvertTraceToText renders a
+	trace in the text format of the Gameboy-logs reference logs afterwards.
+*/
 class Logger {
 private:
-	std::shared_ptr<spdlog::logger> cpuStateLogger;
+	std::FILE* file = nullptr;
+	std::unique_ptr<TraceRecord[]> buffer;
+	u32 used = 0;
+
+	void Flush();
 public:
-	void LogCpuState(const CpuState);
-    Logger();
+	inline void Log(const TraceRecord& record)
+	{
+		buffer[used] = record;
+		if (++used == TRACE_BUFFER_RECORDS)
+			Flush();
+	}
+	int Open(const char*);
+	Logger();
+	Logger(const Logger&) = delete;
+	Logger& operator=(const Logger&) = delete;
 	~Logger();
 };
 
+std::string FormatTraceRecord(const TraceRecord&);
+int ConvertTraceToText(const char*, const char*);
@@ -1,11 +1,222 @@
 #include "emulator.h"
+#include "batch.h"
+#include "bench.h"
+#include "logger.h"
+#include "profile.h"
+#include "test.h"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#define CRASH_TRACE_PATH		"Log/FlightRecorder.bin"
+
+static bool ParseExecMode(const char* name, ExecMode& mode)
+{
+	if (!strcmp(name, "cached"))
+		mode = EXEC_CACHED;
+	else if (!strcmp(name, "jit"))
+		mode = EXEC_JIT;
+	else if (!strcmp(name, "interpreter"))
+		mode = EXEC_INTERPRETER;
+	else if (!strcmp(name, "fused"))
+		mode = EXEC_FUSED;
+	else
+		return false;
+	return true;
+}
+
+/*
+	gbdacpp --batch [--cycles n] [--threads n] [--exec mode] [--state-dir dir] <rom|dir>...
+*/
+static int BatchMain(int argc, char* argv[])
+{
+	BatchOptions options;
+	std::vector<std::string> paths;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--cycles") && i + 1 < argc)
+			options.cycleBudget = std::strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			options.threads = std::atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--exec") && i + 1 < argc)
+			ParseExecMode(argv[++i], options.execMode);
+		else if (!strcmp(argv[i], "--state-dir") && i + 1 < argc)
+			options.stateDir = argv[++i];
+		else
+			paths.push_back(argv[i]);
+	}
+
+	std::vector<std::string> roms = CollectBatchRoms(paths);
+
+	if (roms.empty()) {
+		fmt::print(stderr, "No ROMs to run.\n");
+		return EXIT_FAILURE;
+	}
+	// Per-ROM header chatter from a dozen threads at once is just noise.
+	spdlog::set_level(spdlog::level::warn);
+	return (PrintBatchResults(RunBatch(roms, options)) == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+}
+
+/*
+	gbdacpp --fusion-profile [--cycles n] [--top n] <rom|dir>...
+*/
+static int FusionProfileMain(int argc, char* argv[])
+{
+	u64 cycles = PROFILE_DEFAULT_CYCLES;
+	int top = PROFILE_DEFAULT_TOP;
+	std::vector<std::string> paths;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--cycles") && i + 1 < argc)
+			cycles = std::strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "--top") && i + 1 < argc)
+			top = std::atoi(argv[++i]);
+		else
+			paths.push_back(argv[i]);
+	}
+
+	std::vector<std::string> roms = CollectBatchRoms(paths);
+
+	if (roms.empty()) {
+		fmt::print(stderr, "No ROMs to profile.\n");
+		return EXIT_FAILURE;
+	}
+	spdlog::set_level(spdlog::level::warn);
+	return (RunFusionProfile(roms, cycles, top) == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+}
+
+/*
+	gbdacpp --bench [--cycles n] [--exec mode] <rom|dir>...
+	gbdacpp --bench --tiles
+*/
+static int BenchMain(int argc, char* argv[])
+{
+	BenchOptions options;
+	std::vector<std::string> paths;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--cycles") && i + 1 < argc)
+			options.mCycles = std::strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "--exec") && i + 1 < argc)
+			ParseExecMode(argv[++i], options.execMode);
+		else if (!strcmp(argv[i], "--tiles"))
+			options.tiles = true;
+		else
+			paths.push_back(argv[i]);
+	}
+	if (options.tiles)
+		return (RunTileBenchmark() == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+
+	std::vector<std::string> roms = CollectBatchRoms(paths);
+
+	if (roms.empty()) {
+		fmt::print(stderr, "No ROMs to benchmark.\n");
+		return EXIT_FAILURE;
+	}
+	spdlog::set_level(spdlog::level::warn);
+	return (RunBenchmark(roms, options) == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+}
+
+/*
+	gbdacpp --self-test [--cycles n] [<rom|dir>...]
+*/
+static int SelfTestMain(int argc, char* argv[])
+{
+	u64 cycles = SELF_TEST_DEFAULT_CYCLES;
+	std::vector<std::string> paths;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--cycles") && i + 1 < argc)
+			cycles = std::strtoull(argv[++i], nullptr, 0);
+		else
+			paths.push_back(argv[i]);
+	}
+	spdlog::set_level(spdlog::level::warn);
+	return (RunSelfTests(CollectBatchRoms(paths), cycles) == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+}
 
 int main(int argc, char* argv[])
 {
-	Emulator emu(const_cast<const char *>(argv[1]));
+	if (argc < 2)
+		return EXIT_FAILURE;
+	if (!strcmp(argv[1], "--batch"))
+		return BatchMain(argc, argv);
+	if (!strcmp(argv[1], "--fusion-profile"))
+		return FusionProfileMain(argc, argv);
+	if (!strcmp(argv[1], "--bench"))
+		return BenchMain(argc, argv);
+	if (!strcmp(argv[1], "--self-test"))
+		return SelfTestMain(argc, argv);
+	// gbdacpp --trace-text <trace.bin> <out.txt>
+	if (!strcmp(argv[1], "--trace-text"))
+		return (argc == 4 && ConvertTraceToText(argv[2], argv[3]) == STT_SUCCESS) ? 0 : EXIT_FAILURE;
+
+	Emulator emu;
+	const char* reference = nullptr;
+	const char* loadState = nullptr;
+	const char* saveState = nullptr;
+	int context = TRACE_CONTEXT_DEFAULT;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--exec") && i + 1 < argc) {
+			ExecMode mode;
+
+			if (ParseExecMode(argv[++i], mode))
+				emu.SetExecMode(mode);
+		} else if (!strcmp(argv[i], "--ppu") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "fifo"))
+				emu.SetPpuRenderer(PPU_RENDER_FIFO);
+			else if (!strcmp(argv[i], "scanline"))
+				emu.SetPpuRenderer(PPU_RENDER_SCANLINE);
+		} else if (!strcmp(argv[i], "--verify") && i + 1 < argc) {
+			reference = argv[++i];
+		} else if (!strcmp(argv[i], "--context") && i + 1 < argc) {
+			context = std::atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--recorder") && i + 1 < argc) {
+			emu.SetFlightRecorderSize((u32)std::strtoul(argv[++i], nullptr, 0));
+		} else if (!strcmp(argv[i], "--load-state") && i + 1 < argc) {
+			loadState = argv[++i];
+		} else if (!strcmp(argv[i], "--save-state") && i + 1 < argc) {
+			saveState = argv[++i];
+		} else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			if (emu.AttachDebugger().StartTrace(argv[++i]) == STT_FAILED)
+				return EXIT_FAILURE;
+		} else if (!strcmp(argv[i], "--break") && i + 1 < argc) {
+			emu.AttachDebugger().SetBreakpoint((u16)std::strtoul(argv[++i], nullptr, 16), true);
+		} else if (!strcmp(argv[i], "--watch") && i + 1 < argc) {
+			emu.AttachDebugger().SetWatchpoint((u16)std::strtoul(argv[++i], nullptr, 16), WATCH_READ | WATCH_WRITE);
+		}
+	}
 
 	if (emu.Load(argv[1]) == STT_FAILED)
 		return EXIT_FAILURE;
-	emu.Run();
+	if (loadState != nullptr && emu.LoadStateFile(loadState) == STT_FAILED)
+		return EXIT_FAILURE;
+	if (reference != nullptr && emu.VerifyTrace(reference, context) == STT_FAILED)
+		return EXIT_FAILURE;
+
+	RunStatus status = emu.Run();
+
+	// Why a debugging run stopped: a breakpoint, a watchpoint, the trace check.
+	emu.PrintDebugReport();
+	// Where the run stopped, to pick up from later with --load-state.
+	if (saveState != nullptr && emu.SaveStateFile(saveState) == STT_FAILED)
+		return EXIT_FAILURE;
+	if (status == RUN_UNKNOWN_OPCODE) {
+		std::error_code ec;
+
+		std::filesystem::create_directories("Log", ec);
+		if (emu.DumpFlightRecorder(CRASH_TRACE_PATH) == STT_SUCCESS)
+			spdlog::error("The last instructions are in {}.", CRASH_TRACE_PATH);
+		return EXIT_FAILURE;
+	}
+	if (reference != nullptr)
+		return (status == RUN_TRACE_END) ? 0 : EXIT_FAILURE;
 	return 0;
 }
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+
+/*
+	A whole file mapped read-only into memory (mmap, or a file mapping object
+	on Windows). Empty files can't be mapped.
+*/
+class MappedFile {
+private:
+	void* view = nullptr;
+	u64 size = 0;
+public:
+	int Open(const char*);
+	void Close();
+	const u8* GetData() const;
+	u64 GetSize() const;
+	MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+};
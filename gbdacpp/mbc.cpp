@@ -0,0 +1,327 @@
+#include "mbc.h"
+#include <chrono>
+
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#define RTC_S					0
+#define RTC_M					1
+#define RTC_H					2
+#define RTC_DL					3
+#define RTC_DH					4
+
+static i64 HostSeconds()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/*
+	Set the controller up for a cartridge header's type byte (0x0147). romBanks
+	is the number of 16 KiB banks actually present and ramSize the external RAM
+	in bytes.
+*/
+int Mbc::Init(u8 romType, u32 romBanks, u32 ramSize)
+{
+	hasRtc = false;
+	switch (romType) {
+	case 0x00: case 0x08: case 0x09:
+		type = MBC_NONE;
+		break;
+	case 0x01: case 0x02: case 0x03:
+		type = MBC_1;
+		break;
+	case 0x05: case 0x06:
+		type = MBC_2;
+		ramSize = MBC2_RAM_SIZE;
+		break;
+	case 0x0F: case 0x10:
+		hasRtc = true;
+		[[fallthrough]];
+	case 0x11: case 0x12: case 0x13:
+		type = MBC_3;
+		break;
+	case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+		type = MBC_5;
+		break;
+	default:
+		spdlog::error("Unsupported cartridge type: ${:02X}", romType);
+		return STT_FAILED;
+	}
+
+	romBankCount = romBanks;
+	ram.assign(ramSize, 0);
+	// Cartridges without a controller have nothing to enable their RAM with.
+	ramEnabled = (type == MBC_NONE);
+	romBankLow = 1;
+	bankHigh = 0;
+	mode = 0;
+	rtcLatch = 0xff;
+	rtcLastUpdate = HostSeconds();
+	UpdateBanks();
+	return STT_SUCCESS;
+}
+
+/*
+	Recompute the mapped banks from the register contents. Constant time; runs
+	only when a register is written.
+*/
+void Mbc::UpdateBanks()
+{
+	u32 bank0 = 0, bank1 = 1;
+
+	ramBank = 0;
+	switch (type) {
+	case MBC_NONE:
+		break;
+	case MBC_1:
+		bank1 = ((u32)bankHigh << 5) | (romBankLow & 0x1f);
+		if (mode) {
+			bank0 = (u32)bankHigh << 5;
+			ramBank = bankHigh;
+		}
+		break;
+	case MBC_2:
+		bank1 = romBankLow & 0x0f;
+		break;
+	case MBC_3:
+		bank1 = romBankLow & 0x7f;
+		ramBank = bankHigh & 0x03;
+		break;
+	case MBC_5:
+		bank1 = romBankLow & 0x1ff;
+		ramBank = bankHigh & 0x0f;
+		break;
+	}
+	romBank[0] = bank0 % romBankCount;
+	romBank[1] = bank1 % romBankCount;
+	if (!ram.empty())
+		ramBank %= (ram.size() + RAM_BANK_SIZE - 1) / RAM_BANK_SIZE;
+}
+
+/*
+	Handle a write to the register area 0x0000-0x7FFF. Returns true if the
+	ROM or RAM mapping changed.
+*/
+bool Mbc::Write(u16 addr, u8 val)
+{
+	u32 oldRomBank[2] = { romBank[0], romBank[1] };
+	u32 oldRamBank = ramBank;
+	bool oldRamEnabled = ramEnabled;
+	bool oldRtcSelected = RtcSelected();
+
+	switch (type) {
+	case MBC_NONE:
+		return false;
+	case MBC_1:
+		if (addr <= 0x1fff) {
+			ramEnabled = (val & 0x0f) == 0x0a;
+		} else if (addr <= 0x3fff) {
+			romBankLow = val & 0x1f;
+			if (romBankLow == 0)
+				romBankLow = 1;
+		} else if (addr <= 0x5fff) {
+			bankHigh = val & 0x03;
+		} else {
+			mode = val & 0x01;
+		}
+		break;
+	case MBC_2:
+		if (addr > 0x3fff)
+			return false;
+		if (addr & 0x0100) {
+			romBankLow = val & 0x0f;
+			if (romBankLow == 0)
+				romBankLow = 1;
+		} else {
+			ramEnabled = (val & 0x0f) == 0x0a;
+		}
+		break;
+	case MBC_3:
+		if (addr <= 0x1fff) {
+			ramEnabled = (val & 0x0f) == 0x0a;
+		} else if (addr <= 0x3fff) {
+			romBankLow = val & 0x7f;
+			if (romBankLow == 0)
+				romBankLow = 1;
+		} else if (addr <= 0x5fff) {
+			bankHigh = val;
+		} else {
+			if (hasRtc && rtcLatch == 0x00 && val == 0x01) {
+				UpdateRtc();
+				for (int i = 0; i < 5; i++)
+					rtcLatched[i] = rtc[i];
+			}
+			rtcLatch = val;
+		}
+		break;
+	case MBC_5:
+		if (addr <= 0x1fff)
+			ramEnabled = (val & 0x0f) == 0x0a;
+		else if (addr <= 0x2fff)
+			romBankLow = (romBankLow & 0x100) | val;
+		else if (addr <= 0x3fff)
+			romBankLow = (romBankLow & 0xff) | ((u16)(val & 0x01) << 8);
+		else if (addr <= 0x5fff)
+			bankHigh = val;
+		break;
+	}
+
+	UpdateBanks();
+	return romBank[0] != oldRomBank[0] || romBank[1] != oldRomBank[1] ||
+		ramBank != oldRamBank || ramEnabled != oldRamEnabled ||
+		RtcSelected() != oldRtcSelected;
+}
+
+bool Mbc::RtcSelected() const
+{
+	return type == MBC_3 && bankHigh >= 0x08;
+}
+
+/*
+	Advance the live MBC3 clock registers by the host time elapsed since the
+	last update, unless the clock is halted (DH bit 6).
+*/
+void Mbc::UpdateRtc()
+{
+	i64 now = HostSeconds();
+	i64 elapsed = now - rtcLastUpdate;
+
+	rtcLastUpdate = now;
+	if (NTHBIT(rtc[RTC_DH], 6) || elapsed <= 0)
+		return;
+
+	i64 seconds = rtc[RTC_S] + rtc[RTC_M] * 60LL + rtc[RTC_H] * 3600LL +
+		(((rtc[RTC_DH] & 0x01) << 8) | rtc[RTC_DL]) * 86400LL + elapsed;
+	i64 days = seconds / 86400;
+
+	rtc[RTC_S] = seconds % 60;
+	rtc[RTC_M] = (seconds / 60) % 60;
+	rtc[RTC_H] = (seconds / 3600) % 24;
+	rtc[RTC_DL] = days & 0xff;
+	rtc[RTC_DH] = (rtc[RTC_DH] & 0xfe) | ((days >> 8) & 0x01);
+	if (days > 0x1ff)
+		SET(rtc[RTC_DH], 7);
+}
+
+/*
+	Slow path for 0xA000-0xBFFF accesses GetRamBank could not hand out a bank
+	for: disabled RAM, MBC2's nibble RAM and the MBC3 clock registers.
+*/
+u8 Mbc::ReadRam(u16 addr)
+{
+	if (!ramEnabled)
+		return 0xff;
+	if (RtcSelected())
+		return (hasRtc && bankHigh <= 0x0c) ? rtcLatched[bankHigh - 0x08] : 0xff;
+	if (ram.empty())
+		return 0xff;
+	if (type == MBC_2)
+		return 0xf0 | (ram[addr & (MBC2_RAM_SIZE - 1)] & 0x0f);
+	return ram[(ramBank * RAM_BANK_SIZE + (addr & (RAM_BANK_SIZE - 1))) % ram.size()];
+}
+
+void Mbc::WriteRam(u16 addr, u8 val)
+{
+	if (!ramEnabled)
+		return;
+	if (RtcSelected()) {
+		if (hasRtc && bankHigh <= 0x0c) {
+			UpdateRtc();
+			rtc[bankHigh - 0x08] = val;
+			rtcLatched[bankHigh - 0x08] = val;
+		}
+		return;
+	}
+	if (ram.empty())
+		return;
+	if (type == MBC_2)
+		ram[addr & (MBC2_RAM_SIZE - 1)] = val & 0x0f;
+	else
+		ram[(ramBank * RAM_BANK_SIZE + (addr & (RAM_BANK_SIZE - 1))) % ram.size()] = val;
+}
+
+/*
+	Bank currently mapped in the first (0) or second (1) 16 KiB ROM window.
+*/
+u32 Mbc::GetRomBank(int window) const
+{
+	return romBank[window];
+}
+
+/*
+	The 8 KiB RAM bank currently visible at 0xA000-0xBFFF, or nullptr if
+	accesses there need ReadRam/WriteRam.
+*/
+u8* Mbc::GetRamBank()
+{
+	if (!ramEnabled || ram.size() < RAM_BANK_SIZE || type == MBC_2 || RtcSelected())
+		return nullptr;
+	return &ram[ramBank * RAM_BANK_SIZE];
+}
+
+/*
+	The registers, cartridge RAM and clock. The mapped banks are worked out
+	again from the registers on load.
+*/
+void Mbc::SaveState(StateWriter& state) const
+{
+	u32 ramSize = (u32)ram.size();
+
+	state.BeginSection(STATE_TAG_MBC);
+	state.Put(type);
+	state.Put(ramEnabled);
+	state.Put(romBankLow);
+	state.Put(bankHigh);
+	state.Put(mode);
+	state.Put(ramSize);
+	state.Put(ram.data(), ram.size());
+	state.Put(rtc);
+	state.Put(rtcLatched);
+	state.Put(rtcLatch);
+	state.Put(rtcLastUpdate);
+	state.EndSection();
+}
+
+/*
+	The state must come from a cartridge of the same type and RAM size.
+*/
+void Mbc::LoadState(StateReader& state)
+{
+	MbcType savedType = MBC_NONE;
+	u32 ramSize = 0;
+
+	state.BeginSection(STATE_TAG_MBC);
+	state.Get(savedType);
+	state.Get(ramEnabled);
+	state.Get(romBankLow);
+	state.Get(bankHigh);
+	state.Get(mode);
+	state.Get(ramSize);
+	if (savedType != type || ramSize != ram.size()) {
+		state.Fail();
+		return;
+	}
+	// Any write to cartridge RAM, whatever the bank, goes through 0xA000-0xBFFF.
+	if (state.AnyPages(0xA0, 0x20))
+		state.Get(ram.data(), ram.size());
+	else
+		state.Skip(ram.size());
+	state.Get(rtc);
+	state.Get(rtcLatched);
+	state.Get(rtcLatch);
+	state.Get(rtcLastUpdate);
+	state.EndSection();
+	UpdateBanks();
+}
+
+Mbc::Mbc()
+{
+
+}
+
+Mbc::~Mbc()
+{
+
+}
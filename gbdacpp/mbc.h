@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+#include "savestate.h"
+#include <vector>
+
+#define ROM_BANK_SIZE				(16 * KiB)
+#define RAM_BANK_SIZE				(8 * KiB)
+#define MBC2_RAM_SIZE				512
+
+typedef enum {
+	MBC_NONE,
+	MBC_1,
+	MBC_2,
+	MBC_3,
+	MBC_5,
+} MbcType;
+
+/*
+	The cartridge bank controller. Writes to 0x0000-0x7FFF land in its
+	registers; from them it works out which ROM bank is visible in each 16 KiB
+	half of 0x0000-0x7FFF and which RAM bank (if any) is visible at
+	0xA000-0xBFFF. Nothing is copied on a switch: callers re-point their
+	windows at the banks reported by GetRomBank/GetRamBank.
+*/
+class Mbc {
+private:
+	MbcType type = MBC_NONE;
+	u32 romBankCount = 2;
+	std::vector<u8> ram;
+	bool ramEnabled = false;
+	bool hasRtc = false;
+	// Raw register contents, interpreted per MBC type in UpdateBanks.
+	u16 romBankLow = 1;
+	u8 bankHigh = 0;
+	u8 mode = 0;
+	// Result of the last UpdateBanks.
+	u32 romBank[2] = { 0, 1 };
+	u32 ramBank = 0;
+	// MBC3 clock: live registers, latched copy, and the host time (seconds)
+	// the live registers were last brought up to date.
+	u8 rtc[5] = {};
+	u8 rtcLatched[5] = {};
+	u8 rtcLatch = 0xff;
+	i64 rtcLastUpdate = 0;
+
+	void UpdateBanks();
+	void UpdateRtc();
+	bool RtcSelected() const;
+public:
+	int Init(u8, u32, u32);
+	bool Write(u16, u8);
+	u8 ReadRam(u16);
+	void WriteRam(u16, u8);
+	u32 GetRomBank(int) const;
+	u8* GetRamBank();
+	void SaveState(StateWriter&) const;
+	void LoadState(StateReader&);
+	Mbc();
+	~Mbc();
+};
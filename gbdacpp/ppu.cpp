@@ -0,0 +1,649 @@
+#include "ppu.h"
+#include "tiledecode.h"
+#include <algorithm>
+#include <cstring>
+
+#define OAM_SCAN_DOTS				80
+#define SCANLINE_DRAWING_DOTS		172
+// The fetcher's first tile of a line is thrown away, which costs 6 dots.
+#define FIFO_STARTUP_DOTS			6
+#define FIFO_FETCH_DOTS				6
+#define SPRITE_FETCH_DOTS			6
+
+#define LCDC_BG_ENABLE				(1U << 0)
+#define LCDC_OBJ_ENABLE				(1U << 1)
+#define LCDC_OBJ_SIZE				(1U << 2)
+#define LCDC_BG_MAP					(1U << 3)
+#define LCDC_TILE_DATA				(1U << 4)
+#define LCDC_WINDOW_ENABLE			(1U << 5)
+#define LCDC_WINDOW_MAP				(1U << 6)
+#define LCDC_LCD_ENABLE				(1U << 7)
+
+#define OBJ_PALETTE					(1U << 4)
+#define OBJ_FLIP_X					(1U << 5)
+#define OBJ_FLIP_Y					(1U << 6)
+#define OBJ_BEHIND_BG				(1U << 7)
+
+static inline u8 Shade(u8 palette, u8 color)
+{
+	return (palette >> (color * 2)) & 0x03;
+}
+
+void Ppu::SetMode(PpuMode newMode)
+{
+	mode = newMode;
+	stat = (stat & ~0x03) | newMode;
+	UpdateStat();
+}
+
+/*
+	Refresh the LY=LYC flag and raise the STAT interrupt on a rising edge of
+	the combined STAT condition.
+*/
+void Ppu::UpdateStat()
+{
+	if (ly == lyc)
+		SET(stat, 2);
+	else
+		RES(stat, 2);
+	if (!(lcdc & LCDC_LCD_ENABLE))
+		return;
+
+	bool line = (NTHBIT(stat, 6) && NTHBIT(stat, 2)) ||
+		(NTHBIT(stat, 3) && mode == PPU_MODE_HBLANK) ||
+		(NTHBIT(stat, 4) && mode == PPU_MODE_VBLANK) ||
+		(NTHBIT(stat, 5) && mode == PPU_MODE_OAM_SCAN);
+
+	if (line && !statLine)
+		interrupts |= INT_STAT;
+	statLine = line;
+}
+
+void Ppu::StartLine()
+{
+	if (ly == wy)
+		windowTriggered = true;
+	OamScan();
+	SetMode(PPU_MODE_OAM_SCAN);
+}
+
+/*
+	Pick the (at most 10) sprites on this line, ordered the way they are drawn:
+	lower X first, OAM order between equal X.
+*/
+void Ppu::OamScan()
+{
+	int height = (lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+
+	lineSpriteCount = 0;
+	for (int i = 0; i < 40 && lineSpriteCount < PPU_MAX_LINE_SPRITES; i++) {
+		const u8* entry = &oam[i * 4];
+
+		if (ly + 16 >= entry[0] && ly + 16 < entry[0] + height) {
+			LineSprite sprite = { entry[0], entry[1], entry[2], entry[3] };
+			int pos = lineSpriteCount++;
+
+			while (pos > 0 && lineSprites[pos - 1].x > sprite.x) {
+				lineSprites[pos] = lineSprites[pos - 1];
+				pos--;
+			}
+			lineSprites[pos] = sprite;
+		}
+	}
+}
+
+/*
+	VRAM offset of row `row` of tile `tile`, following LCDC bit 4 for the
+	background and window. Sprites always use the 0x8000 table.
+*/
+u16 Ppu::TileRowAddr(u8 tile, u8 row, bool obj) const
+{
+	if (obj || (lcdc & LCDC_TILE_DATA))
+		return tile * 16 + row * 2;
+	return 0x1000 + (i8)tile * 16 + row * 2;
+}
+
+u8* Ppu::FramebufferLine()
+{
+	return (framebuffer != nullptr) ? &framebuffer[ly * PPU_WIDTH] : nullptr;
+}
+
+/*
+	Draw this line's sprites over a line of background shades. bg holds the
+	background colour indices, for the BG-over-OBJ attribute.
+*/
+void Ppu::RenderSprites(const u8* bg, u8* line) const
+{
+	if (!(lcdc & LCDC_OBJ_ENABLE))
+		return;
+
+	int height = (lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+	// A sprite pixel, even one hidden behind the background, hides the pixels
+	// of every lower priority sprite.
+	bool taken[PPU_WIDTH] = {};
+
+	for (int i = 0; i < lineSpriteCount; i++) {
+		const LineSprite& sprite = lineSprites[i];
+		u8 tile = (height == 16) ? (sprite.tile & 0xfe) : sprite.tile;
+		u8 row = ly + 16 - sprite.y;
+		u8 palette = (sprite.attr & OBJ_PALETTE) ? obp1 : obp0;
+		u8 pixels[8];
+
+		if (sprite.attr & OBJ_FLIP_Y)
+			row = height - 1 - row;
+		DecodeTileRow(&vram[TileRowAddr(tile, row, true)], sprite.attr & OBJ_FLIP_X, pixels);
+		for (int p = 0; p < 8; p++) {
+			int x = sprite.x - 8 + p;
+
+			if (x < 0 || x >= PPU_WIDTH || pixels[p] == 0 || taken[x])
+				continue;
+			taken[x] = true;
+			if ((sprite.attr & OBJ_BEHIND_BG) && bg[x] != 0)
+				continue;
+			line[x] = Shade(palette, pixels[p]);
+		}
+	}
+}
+
+/*
+	Fast renderer: draw the whole line at once. The bitplanes of the 21 tiles
+	the background touches (and then of the window) are gathered and handed to
+	the tile decoder, which produces colour indices and shades for all of them
+	in one go. The window is pasted over the background and the sprites are
+	drawn on top.
+*/
+void Ppu::RenderScanline()
+{
+	windowDrawn = (lcdc & (LCDC_BG_ENABLE | LCDC_WINDOW_ENABLE)) == (LCDC_BG_ENABLE | LCDC_WINDOW_ENABLE) &&
+		windowTriggered && wx <= 166;
+
+	u8* line = FramebufferLine();
+
+	if (line == nullptr)
+		return;
+
+	const int tiles = PPU_WIDTH / 8 + 1;
+	u8 planes[tiles * 2];
+	u8 indices[tiles * 8];
+	u8 shades[tiles * 8];
+	int offset = scx & 7;
+
+	if (lcdc & LCDC_BG_ENABLE) {
+		u8 y = ly + scy;
+		const u8* map = &vram[((lcdc & LCDC_BG_MAP) ? 0x1c00 : 0x1800) + (y >> 3) * 32];
+
+		for (int col = 0; col < tiles; col++) {
+			const u8* row = &vram[TileRowAddr(map[((scx >> 3) + col) & 31], y & 7, false)];
+
+			planes[col * 2] = row[0];
+			planes[col * 2 + 1] = row[1];
+		}
+		decodeRows(planes, tiles, bgp, indices, shades);
+	} else {
+		std::memset(indices, 0, sizeof(indices));
+		std::memset(shades, Shade(bgp, 0), sizeof(shades));
+	}
+
+	if (windowDrawn) {
+		const u8* map = &vram[((lcdc & LCDC_WINDOW_MAP) ? 0x1c00 : 0x1800) + (windowLine >> 3) * 32];
+		int start = wx - 7;
+		int windowTiles = (PPU_WIDTH - start + 7) / 8;
+		u8 windowIndices[tiles * 8];
+		u8 windowShades[tiles * 8];
+
+		for (int col = 0; col < windowTiles; col++) {
+			const u8* row = &vram[TileRowAddr(map[col], windowLine & 7, false)];
+
+			planes[col * 2] = row[0];
+			planes[col * 2 + 1] = row[1];
+		}
+		decodeRows(planes, windowTiles, bgp, windowIndices, windowShades);
+
+		int first = std::max(start, 0);
+
+		std::memcpy(&indices[offset + first], &windowIndices[first - start], PPU_WIDTH - first);
+		std::memcpy(&shades[offset + first], &windowShades[first - start], PPU_WIDTH - first);
+	}
+
+	std::memcpy(line, &shades[offset], PPU_WIDTH);
+	RenderSprites(&indices[offset], line);
+}
+
+/*
+	Accurate renderer: reset the fetcher and FIFOs at the start of mode 3.
+*/
+void Ppu::StartFifo()
+{
+	bgFifoHead = 0;
+	bgFifoCount = 0;
+	std::memset(objFifo, 0, sizeof(objFifo));
+	std::memset(objFifoAttr, 0, sizeof(objFifoAttr));
+	fetcherDot = -FIFO_STARTUP_DOTS;
+	fetcherX = 0;
+	fetchingWindow = false;
+	windowDrawn = false;
+	discard = scx & 7;
+	lcdX = 0;
+	spriteStall = 0;
+	spritesFetched = 0;
+}
+
+/*
+	Mix a sprite's row into the sprite FIFO. Slots already holding a visible
+	pixel belong to a higher priority sprite and are left alone.
+*/
+void Ppu::FetchSprite(const LineSprite& sprite)
+{
+	int height = (lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+	u8 tile = (height == 16) ? (sprite.tile & 0xfe) : sprite.tile;
+	u8 row = ly + 16 - sprite.y;
+	u8 pixels[8];
+
+	if (sprite.attr & OBJ_FLIP_Y)
+		row = height - 1 - row;
+	DecodeTileRow(&vram[TileRowAddr(tile, row, true)], sprite.attr & OBJ_FLIP_X, pixels);
+	for (int p = 0; p < 8; p++) {
+		int slot = sprite.x - 8 + p - lcdX;
+
+		if (slot < 0 || slot >= 8 || pixels[p] == 0 || objFifo[slot] != 0)
+			continue;
+		objFifo[slot] = pixels[p];
+		objFifoAttr[slot] = sprite.attr;
+	}
+}
+
+/*
+	Advance mode 3 by one dot: the background fetcher refills the FIFO whenever
+	it has run dry, a sprite starting at the next pixel stalls everything while
+	it is fetched, and otherwise one pixel is shifted out (the first SCX % 8
+	are dropped).
+*/
+void Ppu::StepFifo()
+{
+	if (spriteStall > 0) {
+		spriteStall--;
+		return;
+	}
+
+	if (!fetchingWindow && (lcdc & (LCDC_BG_ENABLE | LCDC_WINDOW_ENABLE)) == (LCDC_BG_ENABLE | LCDC_WINDOW_ENABLE) &&
+		windowTriggered && wx <= 166 && lcdX + 7 >= wx && discard == 0) {
+		fetchingWindow = true;
+		windowDrawn = true;
+		bgFifoCount = 0;
+		fetcherDot = 0;
+		fetcherX = 0;
+	}
+
+	if (++fetcherDot >= FIFO_FETCH_DOTS && bgFifoCount == 0) {
+		u8 tile, row;
+
+		if (fetchingWindow) {
+			tile = vram[((lcdc & LCDC_WINDOW_MAP) ? 0x1c00 : 0x1800) + (windowLine >> 3) * 32 + fetcherX];
+			row = windowLine & 7;
+		} else {
+			u8 y = ly + scy;
+
+			tile = vram[((lcdc & LCDC_BG_MAP) ? 0x1c00 : 0x1800) + (y >> 3) * 32 + (((scx >> 3) + fetcherX) & 31)];
+			row = y & 7;
+		}
+		DecodeTileRow(&vram[TileRowAddr(tile, row, false)], false, bgFifo);
+		bgFifoHead = 0;
+		bgFifoCount = 8;
+		fetcherX = (fetcherX + 1) & 31;
+		fetcherDot = 0;
+	}
+
+	if (bgFifoCount == 0)
+		return;
+
+	if (lcdc & LCDC_OBJ_ENABLE) {
+		for (int i = 0; i < lineSpriteCount; i++) {
+			if (spritesFetched & (1U << i))
+				continue;
+			// Sorted by X, so only the first unfetched sprite can be due.
+			if (lineSprites[i].x <= lcdX + 8) {
+				FetchSprite(lineSprites[i]);
+				spritesFetched |= 1U << i;
+				spriteStall = SPRITE_FETCH_DOTS + std::max(0, 5 - ((lineSprites[i].x + scx) & 7)) - 1;
+				return;
+			}
+			break;
+		}
+	}
+
+	u8 bgColor = bgFifo[bgFifoHead++];
+
+	bgFifoCount--;
+	if (discard > 0) {
+		discard--;
+		return;
+	}
+
+	u8 objColor = objFifo[0];
+	u8 objAttr = objFifoAttr[0];
+
+	std::memmove(objFifo, objFifo + 1, 7);
+	std::memmove(objFifoAttr, objFifoAttr + 1, 7);
+	objFifo[7] = 0;
+	objFifoAttr[7] = 0;
+
+	if (!(lcdc & LCDC_BG_ENABLE))
+		bgColor = 0;
+
+	u8* line = FramebufferLine();
+
+	if (line != nullptr) {
+		if (objColor != 0 && !((objAttr & OBJ_BEHIND_BG) && bgColor != 0))
+			line[lcdX] = Shade((objAttr & OBJ_PALETTE) ? obp1 : obp0, objColor);
+		else
+			line[lcdX] = Shade(bgp, bgColor);
+	}
+	lcdX++;
+}
+
+void Ppu::EndLine()
+{
+	dot = 0;
+	if (windowDrawn)
+		windowLine++;
+	windowDrawn = false;
+	ly++;
+	if (ly == PPU_HEIGHT) {
+		SetMode(PPU_MODE_VBLANK);
+		interrupts |= INT_VBLANK;
+		frameCount++;
+	} else if (ly == PPU_LINES_PER_FRAME) {
+		ly = 0;
+		windowLine = 0;
+		windowTriggered = false;
+		StartLine();
+	} else if (ly < PPU_HEIGHT) {
+		StartLine();
+	} else {
+		UpdateStat();
+	}
+}
+
+/*
+	The dot the current mode ends at, outside of FIFO drawing.
+*/
+int Ppu::ModeEndDot() const
+{
+	return (mode == PPU_MODE_OAM_SCAN) ? OAM_SCAN_DOTS :
+		(mode == PPU_MODE_DRAWING) ? OAM_SCAN_DOTS + SCANLINE_DRAWING_DOTS : PPU_DOTS_PER_LINE;
+}
+
+/*
+	Advance the PPU by the given number of M-cycles (4 dots each) and return the
+	interrupts it raised since the last call, as IF bits.
+*/
+int Ppu::Tick(int mCycles)
+{
+	int dots = mCycles * 4;
+
+	while ((lcdc & LCDC_LCD_ENABLE) && dots > 0) {
+		if (mode == PPU_MODE_DRAWING && lineRenderer == PPU_RENDER_FIFO) {
+			StepFifo();
+			dot++;
+			dots--;
+			if (lcdX >= PPU_WIDTH)
+				SetMode(PPU_MODE_HBLANK);
+			continue;
+		}
+
+		// Everything else only changes at mode boundaries, so jump to the next.
+		int next = ModeEndDot();
+		int step = std::min(dots, next - dot);
+
+		dot += step;
+		dots -= step;
+		if (dot < next)
+			break;
+
+		switch (mode) {
+		case PPU_MODE_OAM_SCAN:
+			lineRenderer = renderer;
+			if (lineRenderer == PPU_RENDER_FIFO)
+				StartFifo();
+			SetMode(PPU_MODE_DRAWING);
+			break;
+		case PPU_MODE_DRAWING:
+			RenderScanline();
+			SetMode(PPU_MODE_HBLANK);
+			break;
+		default:
+			EndLine();
+			break;
+		}
+	}
+
+	int raised = interrupts;
+
+	interrupts = 0;
+	return raised;
+}
+
+/*
+	M-cycles until the PPU next changes something the CPU can see (a mode,
+	LY, an interrupt), or -1 while the LCD is off and it changes nothing.
+	Ticking it any less often than that is the same as ticking it every
+	M-cycle.
+*/
+int Ppu::CyclesToNextEvent() const
+{
+	if (!(lcdc & LCDC_LCD_ENABLE))
+		return -1;
+	if (mode == PPU_MODE_DRAWING && lineRenderer == PPU_RENDER_FIFO)
+		return 1;
+
+	return std::max((ModeEndDot() - dot + 3) / 4, 1);
+}
+
+u8 Ppu::ReadRegister(u16 addr)
+{
+	switch (addr) {
+	case 0xFF40: return lcdc;
+	case 0xFF41: return stat | 0x80;
+	case 0xFF42: return scy;
+	case 0xFF43: return scx;
+	case 0xFF44: return ly;
+	case 0xFF45: return lyc;
+	case 0xFF47: return bgp;
+	case 0xFF48: return obp0;
+	case 0xFF49: return obp1;
+	case 0xFF4A: return wy;
+	case 0xFF4B: return wx;
+	default: return 0xff;
+	}
+}
+
+void Ppu::WriteRegister(u16 addr, u8 val)
+{
+	switch (addr) {
+	case 0xFF40:
+		if ((lcdc & LCDC_LCD_ENABLE) && !(val & LCDC_LCD_ENABLE)) {
+			// LCD off: the PPU stops at line 0 and reports mode 0.
+			lcdc = val;
+			ly = 0;
+			dot = 0;
+			windowLine = 0;
+			windowTriggered = false;
+			statLine = false;
+			SetMode(PPU_MODE_HBLANK);
+		} else if (!(lcdc & LCDC_LCD_ENABLE) && (val & LCDC_LCD_ENABLE)) {
+			lcdc = val;
+			ly = 0;
+			dot = 0;
+			StartLine();
+		} else {
+			lcdc = val;
+		}
+		break;
+	case 0xFF41:
+		stat = (stat & 0x07) | (val & 0x78);
+		UpdateStat();
+		break;
+	case 0xFF42: scy = val; break;
+	case 0xFF43: scx = val; break;
+	case 0xFF45:
+		lyc = val;
+		UpdateStat();
+		break;
+	case 0xFF47: bgp = val; break;
+	case 0xFF48: obp0 = val; break;
+	case 0xFF49: obp1 = val; break;
+	case 0xFF4A: wy = val; break;
+	case 0xFF4B: wx = val; break;
+	default: break;
+	}
+}
+
+u8* Ppu::GetVram()
+{
+	return vram;
+}
+
+u8* Ppu::GetOam()
+{
+	return oam;
+}
+
+/*
+	fb must hold PPU_WIDTH * PPU_HEIGHT bytes and stay valid until replaced;
+	nullptr turns drawing off.
+*/
+void Ppu::SetFramebuffer(u8* fb)
+{
+	framebuffer = fb;
+}
+
+/*
+	Takes effect from the next line.
+*/
+void Ppu::SetRenderer(PpuRenderer newRenderer)
+{
+	renderer = newRenderer;
+}
+
+/*
+	Force a particular tile decoder for the scanline renderer, e.g. to compare
+	kernels. Fails if this CPU can't run it.
+*/
+int Ppu::SetTileDecodeKernel(TileDecodeKernel kernel)
+{
+	TileDecodeFn fn = GetTileDecoder(kernel);
+
+	if (fn == nullptr)
+		return STT_FAILED;
+	decodeRows = fn;
+	return STT_SUCCESS;
+}
+
+u64 Ppu::GetFrameCount() const
+{
+	return frameCount;
+}
+
+/*
+	VRAM, OAM, the registers and the position in the frame, down to the
+	pixel FIFOs mid-line. The framebuffer, renderer choice and tile decoder
+	belong to the frontend and stay as they are.
+*/
+void Ppu::SaveState(StateWriter& state) const
+{
+	state.BeginSection(STATE_TAG_PPU);
+	state.Put(vram);
+	state.Put(oam);
+	state.Put(lcdc);
+	state.Put(stat);
+	state.Put(scy);
+	state.Put(scx);
+	state.Put(ly);
+	state.Put(lyc);
+	state.Put(bgp);
+	state.Put(obp0);
+	state.Put(obp1);
+	state.Put(wy);
+	state.Put(wx);
+	state.Put(lineRenderer);
+	state.Put(mode);
+	state.Put(dot);
+	state.Put(statLine);
+	state.Put(windowTriggered);
+	state.Put(windowDrawn);
+	state.Put(windowLine);
+	state.Put(frameCount);
+	state.Put(interrupts);
+	state.Put(lineSprites);
+	state.Put(lineSpriteCount);
+	state.Put(bgFifo);
+	state.Put(bgFifoHead);
+	state.Put(bgFifoCount);
+	state.Put(objFifo);
+	state.Put(objFifoAttr);
+	state.Put(fetcherDot);
+	state.Put(fetcherX);
+	state.Put(fetchingWindow);
+	state.Put(discard);
+	state.Put(lcdX);
+	state.Put(spriteStall);
+	state.Put(spritesFetched);
+	state.EndSection();
+}
+
+void Ppu::LoadState(StateReader& state)
+{
+	state.BeginSection(STATE_TAG_PPU);
+	state.GetPages(vram, 0x80, 0x20);
+	state.GetPages(oam, 0xFE, 1);
+	state.Get(lcdc);
+	state.Get(stat);
+	state.Get(scy);
+	state.Get(scx);
+	state.Get(ly);
+	state.Get(lyc);
+	state.Get(bgp);
+	state.Get(obp0);
+	state.Get(obp1);
+	state.Get(wy);
+	state.Get(wx);
+	state.Get(lineRenderer);
+	state.Get(mode);
+	state.Get(dot);
+	state.Get(statLine);
+	state.Get(windowTriggered);
+	state.Get(windowDrawn);
+	state.Get(windowLine);
+	state.Get(frameCount);
+	state.Get(interrupts);
+	state.Get(lineSprites);
+	state.Get(lineSpriteCount);
+	state.Get(bgFifo);
+	state.Get(bgFifoHead);
+	state.Get(bgFifoCount);
+	state.Get(objFifo);
+	state.Get(objFifoAttr);
+	state.Get(fetcherDot);
+	state.Get(fetcherX);
+	state.Get(fetchingWindow);
+	state.Get(discard);
+	state.Get(lcdX);
+	state.Get(spriteStall);
+	state.Get(spritesFetched);
+	state.EndSection();
+}
+
+Ppu::Ppu() : vram{}, oam{}, lcdc(0), stat(0), scy(0), scx(0), ly(0), lyc(0), bgp(0), obp0(0),
+	obp1(0), wy(0), wx(0), mode(PPU_MODE_HBLANK), dot(0), statLine(false), windowTriggered(false),
+	windowDrawn(false), windowLine(0), frameCount(0), interrupts(0), lineSprites{}, lineSpriteCount(0),
+	bgFifo{}, bgFifoHead(0), bgFifoCount(0), objFifo{}, objFifoAttr{}, fetcherDot(0), fetcherX(0),
+	fetchingWindow(false), discard(0), lcdX(0), spriteStall(0), spritesFetched(0),
+	decodeRows(GetTileDecoder())
+{
+
+}
+
+Ppu::~Ppu()
+{
+
+}
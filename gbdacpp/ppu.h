@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common.h"
+#include "tiledecode.h"
+#include "savestate.h"
+
+#define PPU_WIDTH					160
+#define PPU_HEIGHT					144
+#define PPU_DOTS_PER_LINE			456
+#define PPU_LINES_PER_FRAME			154
+#define PPU_MAX_LINE_SPRITES		10
+#define PPU_MCYCLES_PER_FRAME		(PPU_DOTS_PER_LINE * PPU_LINES_PER_FRAME / 4)
+
+typedef enum {
+	PPU_RENDER_SCANLINE,
+	PPU_RENDER_FIFO,
+} PpuRenderer;
+
+typedef enum {
+	PPU_MODE_HBLANK,
+	PPU_MODE_VBLANK,
+	PPU_MODE_OAM_SCAN,
+	PPU_MODE_DRAWING,
+} PpuMode;
+
+typedef struct LineSprite {
+	u8 y;
+	u8 x;
+	u8 tile;
+	u8 attr;
+} LineSprite;
+
+/*
+	The picture processing unit. Pixels are written as DMG shades (0 = white to
+	3 = black, after the palettes) into a PPU_WIDTH * PPU_HEIGHT framebuffer
+	owned by the caller; without one the PPU still keeps LY, STAT and the
+	interrupts going but skips drawing.
+
+	Two renderers share the same timing skeleton:
+	- PPU_RENDER_SCANLINE draws a whole line at once at the end of a fixed
+	  172-dot mode 3, decoding the line's tiles with the SIMD tile decoder.
+	- PPU_RENDER_FIFO runs the background fetcher and pixel FIFOs dot by dot,
+	  so mode 3 gets longer with SCX, the window and sprites like on hardware.
+*/
+class Ppu {
+private:
+	u8 vram[0x2000];
+	// 0xFE00-0xFEFF; only the first 0xA0 bytes are sprite attributes.
+	u8 oam[0x100];
+	u8 lcdc, stat, scy, scx, ly, lyc, bgp, obp0, obp1, wy, wx;
+
+	u8* framebuffer = nullptr;
+	PpuRenderer renderer = PPU_RENDER_SCANLINE;
+	PpuRenderer lineRenderer = PPU_RENDER_SCANLINE;
+	PpuMode mode;
+	int dot;
+	bool statLine;
+	bool windowTriggered;
+	bool windowDrawn;
+	u8 windowLine;
+	u64 frameCount;
+	u8 interrupts;
+
+	LineSprite lineSprites[PPU_MAX_LINE_SPRITES];
+	int lineSpriteCount;
+
+	// Pixel FIFO state, only used by PPU_RENDER_FIFO.
+	u8 bgFifo[8];
+	int bgFifoHead, bgFifoCount;
+	u8 objFifo[8];
+	u8 objFifoAttr[8];
+	int fetcherDot;
+	u8 fetcherX;
+	bool fetchingWindow;
+	int discard;
+	int lcdX;
+	int spriteStall;
+	u16 spritesFetched;
+
+	TileDecodeFn decodeRows;
+
+	void SetMode(PpuMode);
+	void UpdateStat();
+	void StartLine();
+	void OamScan();
+	u16 TileRowAddr(u8, u8, bool) const;
+	u8* FramebufferLine();
+	void RenderSprites(const u8*, u8*) const;
+	void RenderScanline();
+	void StartFifo();
+	void StepFifo();
+	void FetchSprite(const LineSprite&);
+	void EndLine();
+	int ModeEndDot() const;
+public:
+	int Tick(int);
+	int CyclesToNextEvent() const;
+	u8 ReadRegister(u16);
+	void WriteRegister(u16, u8);
+	u8* GetVram();
+	u8* GetOam();
+	void SetFramebuffer(u8*);
+	void SetRenderer(PpuRenderer);
+	int SetTileDecodeKernel(TileDecodeKernel);
+	u64 GetFrameCount() const;
+	void SaveState(StateWriter&) const;
+	void LoadState(StateReader&);
+	Ppu();
+	~Ppu();
+};
@@ -0,0 +1,78 @@
+#include "profile.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+
+/*
+	Pairs don't reach from one ROM into the next.
+*/
+void OpcodeProfile::EndRom()
+{
+	last = -1;
+}
+
+/*
+	Print the most frequent pairs Cpu::CanFuse allows as a fusedPairs
+	definition, each with the share of all the instructions counted that it
+	would run without a dispatch of their own.
+*/
+void OpcodeProfile::Print(int top) const
+{
+	std::vector<u32> order;
+
+	for (u32 pair = 0; pair < pairs.size(); pair++) {
+		if (pairs[pair] != 0 && Cpu::CanFuse(pair >> 8, pair & 0xff))
+			order.push_back(pair);
+	}
+	std::sort(order.begin(), order.end(), [this](u32 a, u32 b) {
+		return (pairs[a] != pairs[b]) ? pairs[a] > pairs[b] : a < b;
+	});
+	order.resize(std::min<size_t>(order.size(), std::max(top, 0)));
+
+	fmt::print("// {} instructions run from ROM.\n", instructions);
+	fmt::print("static constexpr std::array<FusedPair, {}> fusedPairs = {{ {{\n", order.size());
+	for (u32 pair : order) {
+		double share = (instructions != 0) ? 100.0 * pairs[pair] / instructions : 0;
+
+		fmt::print("\t{{ 0x{:02x}, 0x{:02x} }},\t\t// {:5.2f}%\n", pair >> 8, pair & 0xff, share);
+	}
+	fmt::print("}} }};\n");
+	std::fflush(stdout);
+}
+
+OpcodeProfile::OpcodeProfile() : pairs(0x10000)
+{
+
+}
+
+OpcodeProfile::~OpcodeProfile()
+{
+
+}
+
+int RunFusionProfile(const std::vector<std::string>& roms, u64 mCycles, int top)
+{
+	OpcodeProfile profile;
+	size_t profiled = 0;
+
+	for (const std::string& path : roms) {
+		// Each Emulator is a few hundred KiB, keep it off the stack.
+		auto emu = std::make_unique<Emulator>();
+
+		if (emu->Load(path.c_str()) == STT_FAILED) {
+			fmt::print(stderr, "Can't load {}, skipped.\n", path);
+			continue;
+		}
+		// What ran up to an unknown opcode still counts.
+		if (emu->RunCyclesWith(profile, mCycles) == RUN_UNKNOWN_OPCODE)
+			fmt::print(stderr, "{} stopped at an unknown opcode.\n", path);
+		profile.EndRom();
+		profiled++;
+	}
+	if (profiled == 0)
+		return STT_FAILED;
+	profile.Print(top);
+	return STT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "cpu.h"
+#include "emulator.h"
+#include <string>
+#include <vector>
+
+// A few emulated seconds per ROM, past the boot ROM and into the test's main loop.
+#define PROFILE_DEFAULT_CYCLES		(10ULL * CPU_MCYCLES_PER_SECOND)
+#define PROFILE_DEFAULT_TOP			24
+
+/*
+	A hook policy that counts, for every instruction run from ROM, which
+	opcode ran right before it: the histogram the fused execution mode picks
+	its instruction pairs from. Code in RAM is never cached, so it isn't
+	counted, and pairs don't reach across it.
+*/
+class OpcodeProfile {
+private:
+	std::vector<u64> pairs;		// indexed by first << 8 | second
+	u64 instructions = 0;
+	int last = -1;				// the opcode that ran before, -1 if it wasn't in ROM
+public:
+	static constexpr bool enabled = true;
+
+	inline int BeforeStep(Cpu& cpu)
+	{
+		if (cpu.IsSleeping())
+			return 0;
+		if (cpu.GetPC() >= 0x8000) {
+			last = -1;
+			return 0;
+		}
+
+		u8 opcode = cpu.GetCpuState().romData[0];
+
+		if (last >= 0)
+			pairs[last << 8 | opcode]++;
+		last = opcode;
+		instructions++;
+		return 0;
+	}
+	inline int AfterStep() { return 0; }
+	void EndRom();
+	void Print(int) const;
+	OpcodeProfile();
+	~OpcodeProfile();
+};
+
+/*
+	gbdacpp --fusion-profile: run every ROM from power-on for mCycles on the
+	interpreter, and print the `top` most frequent pairs that can be fused
+	as entries for fusedPairs in cpu.cpp.
+*/
+int RunFusionProfile(const std::vector<std::string>&, u64, int);
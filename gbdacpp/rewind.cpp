@@ -0,0 +1,181 @@
+#include "rewind.h"
+#include <algorithm>
+#include <cstring>
+
+static inline u64 LoadWord(const u8* p)
+{
+	u64 word;
+
+	std::memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline void PutU32(std::vector<u8>& out, u32 val)
+{
+	const u8* bytes = reinterpret_cast<const u8*>(&val);
+
+	out.insert(out.end(), bytes, bytes + sizeof(val));
+}
+
+/*
+	Pack state ^ key as (u32 zero words, u32 literal words, the literal
+	words) runs, then the XOR of the bytes past the last whole word. The
+	zero runs are skipped 32 bytes at a time, which the compiler turns into
+	vector compares.
+*/
+static void PackDelta(const std::vector<u8>& state, const std::vector<u8>& key, std::vector<u8>& out)
+{
+	const u8* a = state.data();
+	const u8* b = key.data();
+	size_t words = state.size() / 8;
+	size_t i = 0;
+
+	while (i < words) {
+		size_t zeroStart = i;
+
+		while (i + 4 <= words && ((LoadWord(a + i * 8) ^ LoadWord(b + i * 8)) |
+			(LoadWord(a + i * 8 + 8) ^ LoadWord(b + i * 8 + 8)) |
+			(LoadWord(a + i * 8 + 16) ^ LoadWord(b + i * 8 + 16)) |
+			(LoadWord(a + i * 8 + 24) ^ LoadWord(b + i * 8 + 24))) == 0)
+			i += 4;
+		while (i < words && LoadWord(a + i * 8) == LoadWord(b + i * 8))
+			i++;
+
+		size_t literalStart = i;
+
+		while (i < words && LoadWord(a + i * 8) != LoadWord(b + i * 8))
+			i++;
+		PutU32(out, (u32)(literalStart - zeroStart));
+		PutU32(out, (u32)(i - literalStart));
+		for (size_t w = literalStart; w < i; w++) {
+			u64 x = LoadWord(a + w * 8) ^ LoadWord(b + w * 8);
+			const u8* bytes = reinterpret_cast<const u8*>(&x);
+
+			out.insert(out.end(), bytes, bytes + 8);
+		}
+	}
+	for (size_t j = words * 8; j < state.size(); j++)
+		out.push_back(a[j] ^ b[j]);
+}
+
+/*
+	state holds the keyframe on entry and the packed frame on return.
+*/
+static void UnpackDelta(const std::vector<u8>& delta, std::vector<u8>& state)
+{
+	size_t words = state.size() / 8;
+	size_t i = 0, pos = 0;
+
+	while (i < words) {
+		u32 zeros, literals;
+
+		std::memcpy(&zeros, &delta[pos], sizeof(zeros));
+		std::memcpy(&literals, &delta[pos + 4], sizeof(literals));
+		pos += 8;
+		i += zeros;
+		for (u32 w = 0; w < literals; w++, i++, pos += 8) {
+			u64 x = LoadWord(&state[i * 8]) ^ LoadWord(&delta[pos]);
+
+			std::memcpy(&state[i * 8], &x, sizeof(x));
+		}
+	}
+	for (size_t j = words * 8; j < state.size(); j++)
+		state[j] ^= delta[pos++];
+}
+
+/*
+	Drop the oldest keyframe and the deltas against it.
+*/
+void RewindBuffer::DropOldest()
+{
+	do {
+		used -= frames.front().data.size();
+		frames.pop_front();
+	} while (!frames.empty() && !frames.front().keyframe);
+}
+
+/*
+	Append the savestate of the frame that just ended.
+*/
+void RewindBuffer::Capture(const std::vector<u8>& state)
+{
+	RewindFrame frame;
+
+	if (frames.empty() || sinceKeyframe >= REWIND_KEYFRAME_INTERVAL || state.size() != lastKeyframe.size()) {
+		frame.data = state;
+		frame.keyframe = true;
+		lastKeyframe = state;
+		sinceKeyframe = 0;
+	} else {
+		// Packed into a scratch buffer first so each delta is allocated once, at its size.
+		packed.clear();
+		PackDelta(state, lastKeyframe, packed);
+		frame.data.assign(packed.begin(), packed.end());
+		frame.keyframe = false;
+	}
+	sinceKeyframe++;
+	used += frame.data.size();
+	frames.push_back(std::move(frame));
+	// Always keep the newest keyframe's run, however small the budget.
+	while (used > budget && frames.size() > sinceKeyframe)
+		DropOldest();
+}
+
+/*
+	Put the savestate from `back` captures before the last one into state
+	(0 is the last capture itself) and forget everything captured after it,
+	so the next Capture continues from there. Asking for more than is kept
+	goes to the oldest frame.
+*/
+int RewindBuffer::Rewind(u32 back, std::vector<u8>& state)
+{
+	if (frames.empty())
+		return STT_FAILED;
+
+	size_t target = frames.size() - 1 - std::min<size_t>(back, frames.size() - 1);
+	size_t key = target;
+
+	while (!frames[key].keyframe)
+		key--;
+	state = frames[key].data;
+	if (key != target)
+		UnpackDelta(frames[target].data, state);
+	while (frames.size() > target + 1) {
+		used -= frames.back().data.size();
+		frames.pop_back();
+	}
+	lastKeyframe = frames[key].data;
+	sinceKeyframe = (u32)(target - key + 1);
+	return STT_SUCCESS;
+}
+
+void RewindBuffer::Clear()
+{
+	frames.clear();
+	lastKeyframe.clear();
+	used = 0;
+	sinceKeyframe = 0;
+}
+
+size_t RewindBuffer::GetFrameCount() const
+{
+	return frames.size();
+}
+
+/*
+	Bytes held by the captured frames.
+*/
+size_t RewindBuffer::GetMemoryUsed() const
+{
+	return used;
+}
+
+RewindBuffer::RewindBuffer(size_t budgetBytes) : budget(budgetBytes)
+{
+
+}
+
+RewindBuffer::~RewindBuffer()
+{
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#define REWIND_DEFAULT_BUDGET		(32U * MiB)
+#define REWIND_KEYFRAME_INTERVAL	60
+
+typedef struct RewindFrame {
+	std::vector<u8> data;		// the savestate for keyframes, else its packed XOR against the keyframe
+	bool keyframe;
+} RewindFrame;
+
+/*
+	History of savestates, one per captured frame. Every
+	REWIND_KEYFRAME_INTERVAL-th frame is kept whole as a keyframe; the ones
+	in between are stored as their XOR against the last keyframe, with the
+	runs of zero words squeezed out. A frame's delta is mostly zeros (the
+	registers, a few PPU fields, whatever RAM the game touched), so it
+	typically packs into a few hundred bytes.
+
+	When the frames add up to more than the byte budget, the oldest keyframe
+	goes together with the deltas that need it.
+*/
+class RewindBuffer {
+private:
+	std::deque<RewindFrame> frames;
+	std::vector<u8> lastKeyframe;
+	std::vector<u8> packed;
+	size_t budget;
+	size_t used = 0;
+	u32 sinceKeyframe = 0;
+
+	void DropOldest();
+public:
+	void Capture(const std::vector<u8>&);
+	int Rewind(u32, std::vector<u8>&);
+	void Clear();
+	size_t GetFrameCount() const;
+	size_t GetMemoryUsed() const;
+	RewindBuffer(size_t = REWIND_DEFAULT_BUDGET);
+	~RewindBuffer();
+};
@@ -3,6 +3,8 @@
 #include <fstream>
 #include <filesystem>
 #include <string>
+#include <algorithm>
+#include <cstring>
 
 #define FMT_HEADER_ONLY
 #include <fmt/core.h>
@@ -11,6 +13,8 @@
 
 #define DMG_BOOT_ROM_SIZE			256
 
+static const u32 ramSizes[] = { 0, 2 * KiB, 8 * KiB, 32 * KiB, 128 * KiB, 64 * KiB };
+
 static std::array<u8, DMG_BOOT_ROM_SIZE> dmgBootRom = {
 	0x31, 0xfe, 0xff, 0xaf, 0x21, 0xff, 0x9f, 0x32, 0xcb, 0x7c, 0x20, 0xfb,
 	0x21, 0x26, 0xff, 0x0e, 0x11, 0x3e, 0x80, 0x32, 0xe2, 0x0c, 0x3e, 0xf3,
@@ -36,7 +40,7 @@ static std::array<u8, DMG_BOOT_ROM_SIZE> dmgBootRom = {
 	0x3e, 0x01, 0xe0, 0x50
 };
 
-static std::array<u8, 48> nintendoLogo = {
+const std::array<u8, 48> nintendoLogo = {
 	0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B,
 	0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
 	0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
@@ -52,6 +56,11 @@ bool IsGbFile(const std::string& romPath)
 
 int Rom::ParseHeader()
 {
+	if (dataSize < 0x0150) {
+		spdlog::error("The ROM file is too small to hold a header.");
+		return STT_FAILED;
+	}
+
 	for (int i = 0; i < 48; i++) {
 		if (data[0x0104 + i] != nintendoLogo[i]) {
 			spdlog::error("This ROM is not a genuine GB ROM!");
@@ -59,12 +68,16 @@ int Rom::ParseHeader()
 		}
 	}
 
+	header.title.clear();
 	for (int i = 0; i < 16; i++)
 		header.title.push_back(data[0x134 + i]);
 	spdlog::info("ROM title: {}", header.title);
 
+	header.romType = data[0x0147];
 	header.romSize = 32 * KiB * (1 << data[0x0148]);
+	header.ramSize = (data[0x0149] < 6) ? ramSizes[data[0x0149]] : 0;
 	spdlog::info("Rom size: {} KiB", header.romSize / KiB);
+	spdlog::info("Cartridge type: ${:02X}, RAM size: {} KiB", header.romType, header.ramSize / KiB);
 
 	u8 checksum = 0;
 	for (u16 addr = 0x0134; addr <= 0x014C; addr++)
@@ -82,27 +95,77 @@ u8 Rom::BootRomRead(u16 addr)
 	return dmgBootRom[addr];
 }
 
+/*
+	Cartridge reads: ROM at 0x0000-0x7FFF through the current bank windows,
+	external RAM at 0xA000-0xBFFF through the MBC.
+*/
 u8 Rom::Read(u16 addr)
 {
 	u8 ret;
 
 	if (!disableBootROM && addr < 0x0100) {
 		ret = BootRomRead(addr);
+	} else if (addr <= 0x7FFF) {
+		ret = romWindow[addr >> 14][addr & (ROM_BANK_SIZE - 1)];
 	} else {
-		ret = data[addr];
+		ret = mbc.ReadRam(addr);
 	}
 		
 	return ret;
 }
 
+/*
+	Return the 256 bytes currently mapped at page (addr >> 8) of 0x0000-0x7FFF.
+*/
+const u8* Rom::GetPage(u8 page) const
+{
+	if (!disableBootROM && page == 0x00)
+		return dmgBootRom.data();
+	if (romWindow[0] == nullptr)
+		return nullptr;
+	return romWindow[page >> 6] + ((page & 0x3f) << 8);
+}
+
+/*
+	Start of the 16 KiB bank mapped in window 0 (0x0000-0x3FFF) or 1
+	(0x4000-0x7FFF), ignoring the boot ROM.
+*/
+const u8* Rom::GetRomWindow(int window) const
+{
+	return romWindow[window];
+}
+
+/*
+	Start of the 8 KiB external RAM bank mapped at 0xA000-0xBFFF, or nullptr
+	when accesses there have to go through Read/Write.
+*/
+u8* Rom::GetRamWindow()
+{
+	return mbc.GetRamBank();
+}
+
 void Rom::Write(u16 addr, u8 data)
 {
+	if (addr <= 0x7FFF) {
+		if (mbc.Write(addr, data)) {
+			UpdateWindows();
+			mapGeneration++;
+		}
+	} else {
+		mbc.WriteRam(addr, data);
+	}
+}
 
+void Rom::UpdateWindows()
+{
+	romWindow[0] = data + (u64)mbc.GetRomBank(0) * ROM_BANK_SIZE;
+	romWindow[1] = data + (u64)mbc.GetRomBank(1) * ROM_BANK_SIZE;
 }
 
 void Rom::UnlockBootROM()
 {
 	disableBootROM = true;
+	mapGeneration++;
 }
 
 bool Rom::IsBootROMUnlocked() const
@@ -110,23 +173,160 @@ bool Rom::IsBootROMUnlocked() const
 	return disableBootROM;
 }
 
+bool Rom::IsLoaded() const
+{
+	return data != nullptr;
+}
+
+/*
+	Identifies what is currently mapped at addr: the boot ROM, or a ROM bank
+	together with the 16 KiB window it is mapped in (MBC1 can map the same bank
+	in either one).
+*/
+u32 Rom::GetBankKey(u16 addr) const
+{
+	if (!disableBootROM && addr < 0x0100)
+		return BOOT_ROM_BANK;
+	return (mbc.GetRomBank(addr >> 14) << 1) | (addr >> 14);
+}
+
+/*
+	Bumped every time the memory mapping of 0x0000-0x7FFF or 0xA000-0xBFFF
+	changes, so code that
+	caches ROM contents knows when to look again.
+*/
+u32 Rom::GetMapGeneration() const
+{
+	return mapGeneration;
+}
+
+/*
+	Map the ROM file read-only straight into our address space. Nothing is
+	copied: pages are faulted in from the page cache when the CPU first
+	touches them, and several emulators running the same cartridge share them.
+*/
+int Rom::LoadMapped(const char* romPath)
+{
+	if (mappedFile.Open(romPath) == STT_FAILED)
+		return STT_FAILED;
+	data = mappedFile.GetData();
+	dataSize = mappedFile.GetSize();
+	return STT_SUCCESS;
+}
+
+/*
+	Fallback for when the file can't be mapped: copy it into a heap buffer.
+*/
+int Rom::LoadBuffered(const char* romPath)
+{
+	std::ifstream fs(romPath, std::ios::binary);
+
+	if (!fs.is_open())
+		return STT_FAILED;
+
+	fs.seekg(0, std::ios::end);
+	u64 fileSize = fs.tellg();
+	fs.seekg(0, std::ios::beg);
+
+	buffer = std::make_unique<u8[]>(fileSize);
+	fs.read(reinterpret_cast<char*>(buffer.get()), fileSize);
+	if (!fs) {
+		buffer.reset();
+		return STT_FAILED;
+	}
+	data = buffer.get();
+	dataSize = fileSize;
+	return STT_SUCCESS;
+}
+
+/*
+	Every bank the MBC can select has to be a full 16 KiB, so a short or odd
+	sized file is copied into a buffer padded with 0xFF. Real cartridges are
+	always a power of two of at least 32 KiB and stay mapped.
+*/
+void Rom::PadToBanks()
+{
+	if (dataSize >= 2 * ROM_BANK_SIZE && dataSize % ROM_BANK_SIZE == 0)
+		return;
+
+	u64 paddedSize = std::max<u64>(2 * ROM_BANK_SIZE,
+		(dataSize + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE * ROM_BANK_SIZE);
+	std::unique_ptr<u8[]> padded = std::make_unique<u8[]>(paddedSize);
+
+	std::memcpy(padded.get(), data, dataSize);
+	std::memset(padded.get() + dataSize, 0xff, paddedSize - dataSize);
+	Unload();
+	buffer = std::move(padded);
+	data = buffer.get();
+	dataSize = paddedSize;
+}
+
+void Rom::Unload()
+{
+	mappedFile.Close();
+	buffer.reset();
+	data = nullptr;
+	dataSize = 0;
+	romWindow[0] = romWindow[1] = nullptr;
+}
+
 int Rom::Load(const char* romPath)
 {
-	std::ifstream fs(romPath);
+	Unload();
+	if (!IsGbFile(romPath)) {
+		spdlog::error("{} is not a .gb file.", romPath);
+		return STT_FAILED;
+	}
 
-	if (!fs.is_open() && !IsGbFile(romPath)) {
+	if (LoadMapped(romPath) == STT_FAILED && LoadBuffered(romPath) == STT_FAILED) {
 		spdlog::error("Can't open the ROM file.");
-	} else {
-		fs.seekg(0, std::ios::end);
-		u64 fileSize = fs.tellg();
-		fs.seekg(0, std::ios::beg);
-
-		data = std::make_unique<u8[]>(fileSize);
-        fs.read(reinterpret_cast<char*>(data.get()), fileSize);
-        fs.close();
-        return ParseHeader();
+		return STT_FAILED;
 	}
-	return STT_FAILED;
+	// A ROM that fails past this point must not look loaded: SaveState and
+	// the header checks would read past the end of a short file.
+	if (ParseHeader() == STT_FAILED) {
+		Unload();
+		return STT_FAILED;
+	}
+
+	PadToBanks();
+	if (mbc.Init(header.romType, (u32)(dataSize / ROM_BANK_SIZE), header.ramSize) == STT_FAILED) {
+		Unload();
+		return STT_FAILED;
+	}
+	UpdateWindows();
+	mapGeneration++;
+	return STT_SUCCESS;
+}
+
+/*
+	The boot ROM lock and the MBC. The cartridge itself isn't saved, only its
+	header checksums, so a state only loads back over the ROM it came from.
+*/
+void Rom::SaveState(StateWriter& state) const
+{
+	state.BeginSection(STATE_TAG_ROM);
+	state.Put(&data[0x014D], 3);
+	state.Put(disableBootROM);
+	state.EndSection();
+	mbc.SaveState(state);
+}
+
+void Rom::LoadState(StateReader& state)
+{
+	u8 checksums[3] = {};
+
+	state.BeginSection(STATE_TAG_ROM);
+	state.Get(checksums, 3);
+	if (std::memcmp(checksums, &data[0x014D], 3) != 0) {
+		state.Fail();
+		return;
+	}
+	state.Get(disableBootROM);
+	state.EndSection();
+	mbc.LoadState(state);
+	UpdateWindows();
+	mapGeneration++;
 }
 
 Rom::Rom() : disableBootROM(false)
@@ -136,5 +336,5 @@ Rom::Rom() : disableBootROM(false)
 
 Rom::~Rom()
 {
-
+	Unload();
 }
@@ -1,10 +1,17 @@
 #pragma once
 
 #include "common.h"
+#include "mbc.h"
+#include "mappedfile.h"
 #include <array>
 #include <memory>
 #include <string>
 
+#define BOOT_ROM_BANK				0xFFFFFFFFU
+
+// What every cartridge header holds at 0x0104; the boot ROM won't start one without it.
+extern const std::array<u8, 48> nintendoLogo;
+
 typedef struct RomHeader {
 	std::string title;
 	u8 romType;
@@ -15,16 +22,37 @@ typedef struct RomHeader {
 class Rom {
 private:
 	RomHeader header;
-	std::unique_ptr<u8[]> data = nullptr;
+	const u8* data = nullptr;
+	u64 dataSize = 0;
+	std::unique_ptr<u8[]> buffer = nullptr;
+	MappedFile mappedFile;
+	Mbc mbc;
+	const u8* romWindow[2] = { nullptr, nullptr };
 	bool disableBootROM = false;
+	u32 mapGeneration = 0;
 	u8 BootRomRead(u16);
+	int LoadMapped(const char*);
+	int LoadBuffered(const char*);
+	void PadToBanks();
+	void UpdateWindows();
+	void Unload();
 public:
 	int Load(const char*);
 	int ParseHeader();
 	void UnlockBootROM();
 	bool IsBootROMUnlocked() const;
+	bool IsLoaded() const;
+	u32 GetBankKey(u16) const;
+	u32 GetMapGeneration() const;
 	u8 Read(u16);
+	const u8* GetPage(u8) const;
+	const u8* GetRomWindow(int) const;
+	u8* GetRamWindow();
+	void SaveState(StateWriter&) const;
+	void LoadState(StateReader&);
 	void Write(u16, u8);
 	Rom();
+	Rom(const Rom&) = delete;
+	Rom& operator=(const Rom&) = delete;
 	~Rom();
 };
@@ -0,0 +1,229 @@
+#include "savestate.h"
+#include <cstdio>
+#include <cstring>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+void StateWriter::Put(const void* src, size_t len)
+{
+	const u8* bytes = static_cast<const u8*>(src);
+
+	out.insert(out.end(), bytes, bytes + len);
+}
+
+void StateWriter::BeginSection(u32 tag)
+{
+	u32 len = 0;
+
+	Put(tag);
+	sectionStart = out.size();
+	Put(len);
+}
+
+/*
+	Patch the byte count of the section BeginSection opened.
+*/
+void StateWriter::EndSection()
+{
+	u32 len = (u32)(out.size() - sectionStart - sizeof(u32));
+
+	std::memcpy(&out[sectionStart], &len, sizeof(len));
+}
+
+/*
+	Starts a savestate in out, replacing what it held. Reusing the same
+	vector for every save keeps its capacity, so steady-state saves don't
+	allocate.
+*/
+StateWriter::StateWriter(std::vector<u8>& buffer) : out(buffer)
+{
+	u32 version = SAVESTATE_VERSION;
+
+	out.clear();
+	Put(SAVESTATE_MAGIC, 8);
+	Put(version);
+}
+
+StateWriter::~StateWriter()
+{
+
+}
+
+void StateReader::Get(void* dst, size_t len)
+{
+	size_t end = (sectionEnd != 0) ? sectionEnd : size;
+
+	if (failed || len > end - pos) {
+		failed = true;
+		return;
+	}
+	std::memcpy(dst, data + pos, len);
+	pos += len;
+}
+
+/*
+	Read `count` pages of memory that sit at address-space page `first` and
+	up.
+*/
+void StateReader::GetPages(void* dst, u8 first, u32 count)
+{
+	u8* pages = static_cast<u8*>(dst);
+
+	if (pageFilter == nullptr) {
+		Get(dst, (size_t)count << 8);
+		return;
+	}
+	for (u32 i = 0; i < count; i++) {
+		if ((*pageFilter)[first + i])
+			Get(pages + ((size_t)i << 8), 0x100);
+		else
+			Skip(0x100);
+	}
+}
+
+void StateReader::Skip(size_t len)
+{
+	size_t end = (sectionEnd != 0) ? sectionEnd : size;
+
+	if (failed || len > end - pos) {
+		failed = true;
+		return;
+	}
+	pos += len;
+}
+
+/*
+	Whether the page filter lets any of the `count` pages from `first` on
+	through; for memory that isn't laid out by address, like banked
+	cartridge RAM.
+*/
+bool StateReader::AnyPages(u8 first, u32 count) const
+{
+	if (pageFilter == nullptr)
+		return true;
+	for (u32 i = 0; i < count; i++) {
+		if ((*pageFilter)[first + i])
+			return true;
+	}
+	return false;
+}
+
+/*
+	nullptr reads every page again.
+*/
+void StateReader::SetPageFilter(const PageSet* filter)
+{
+	pageFilter = filter;
+}
+
+/*
+	Check the header. Fails on anything that isn't a savestate, or on one from
+	a newer version.
+*/
+int StateReader::Open()
+{
+	char magic[8];
+
+	pos = 0;
+	sectionEnd = 0;
+	failed = false;
+	Get(magic, 8);
+	Get(version);
+	if (failed || std::memcmp(magic, SAVESTATE_MAGIC, 8) != 0) {
+		spdlog::error("Not a savestate.");
+		return STT_FAILED;
+	}
+	if (version == 0 || version > SAVESTATE_VERSION) {
+		spdlog::error("Savestate version {} is not supported (up to {}).", version, SAVESTATE_VERSION);
+		return STT_FAILED;
+	}
+	return STT_SUCCESS;
+}
+
+void StateReader::BeginSection(u32 expected)
+{
+	u32 tag = 0, len = 0;
+
+	Get(tag);
+	Get(len);
+	if (failed || tag != expected || len > size - pos) {
+		failed = true;
+		return;
+	}
+	sectionEnd = pos + len;
+}
+
+void StateReader::EndSection()
+{
+	if (pos != sectionEnd)
+		failed = true;
+	sectionEnd = 0;
+}
+
+/*
+	For loaders that find a field they can't take, e.g. a RAM size that
+	doesn't match the cartridge.
+*/
+void StateReader::Fail()
+{
+	failed = true;
+}
+
+bool StateReader::Failed() const
+{
+	return failed;
+}
+
+u32 StateReader::GetVersion() const
+{
+	return version;
+}
+
+StateReader::StateReader(const u8* pData, size_t dataSize) : data(pData), size(dataSize)
+{
+
+}
+
+StateReader::~StateReader()
+{
+
+}
+
+int WriteStateFile(const char* path, const std::vector<u8>& state)
+{
+	std::FILE* file = std::fopen(path, "wb");
+
+	if (file == nullptr) {
+		spdlog::error("Can't create {}.", path);
+		return STT_FAILED;
+	}
+
+	bool written = std::fwrite(state.data(), 1, state.size(), file) == state.size();
+
+	written = (std::fclose(file) == 0) && written;
+	return written ? STT_SUCCESS : STT_FAILED;
+}
+
+int ReadStateFile(const char* path, std::vector<u8>& state)
+{
+	std::FILE* file = std::fopen(path, "rb");
+
+	if (file == nullptr) {
+		spdlog::error("Can't open {}.", path);
+		return STT_FAILED;
+	}
+
+	bool read = std::fseek(file, 0, SEEK_END) == 0;
+	long fileSize = read ? std::ftell(file) : -1;
+
+	read = fileSize >= 0 && std::fseek(file, 0, SEEK_SET) == 0;
+	if (read) {
+		state.resize((size_t)fileSize);
+		read = std::fread(state.data(), 1, state.size(), file) == state.size();
+	}
+	std::fclose(file);
+	if (!read)
+		spdlog::error("Can't read {}.", path);
+	return read ? STT_SUCCESS : STT_FAILED;
+}
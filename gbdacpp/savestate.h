@@ -0,0 +1,99 @@
+#pragma once
+
+#include "common.h"
+#include <bitset>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#define SAVESTATE_MAGIC				"GBDASAVE"
+/*
+	1: the first layout. 2: Emulator's overshoot. 3: the timer's section.
+	4: the CPU's HALT/STOP state.
+*/
+#define SAVESTATE_VERSION			4U
+
+#define STATE_TAG(a, b, c, d)		((u32)(a) | ((u32)(b) << 8) | ((u32)(c) << 16) | ((u32)(d) << 24))
+#define STATE_TAG_EMULATOR			STATE_TAG('E', 'M', 'U', ' ')
+#define STATE_TAG_CPU				STATE_TAG('C', 'P', 'U', ' ')
+#define STATE_TAG_BUS				STATE_TAG('B', 'U', 'S', ' ')
+#define STATE_TAG_ROM				STATE_TAG('R', 'O', 'M', ' ')
+#define STATE_TAG_MBC				STATE_TAG('M', 'B', 'C', ' ')
+#define STATE_TAG_PPU				STATE_TAG('P', 'P', 'U', ' ')
+#define STATE_TAG_TIMER				STATE_TAG('T', 'I', 'M', ' ')
+
+// One bit per 256-byte page of the address space.
+typedef std::bitset<256> PageSet;
+
+/*
+	A savestate is an 8-byte SAVESTATE_MAGIC and a u32 SAVESTATE_VERSION,
+	followed by one section per component: a u32 tag, a u32 byte count and
+	the component's fields copied as raw host (little-endian) memory, in a
+	fixed order. There is no per-field encoding, so saving and loading are a
+	handful of memcpys.
+
+	A component writes its own section from SaveState and reads it back in
+	LoadState. A loader accepts states of its own version or older and asks
+	GetVersion() for fields that were added later; a section has to be read
+	to its exact end.
+*/
+class StateWriter {
+private:
+	std::vector<u8>& out;
+	size_t sectionStart = 0;
+public:
+	void Put(const void*, size_t);
+	template <typename T>
+	inline void Put(const T& val)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "savestate fields are copied as raw memory");
+		Put(&val, sizeof(T));
+	}
+	void BeginSection(u32);
+	void EndSection();
+	StateWriter(std::vector<u8>&);
+	~StateWriter();
+};
+
+/*
+	Reads fail softly: after the first short read or section mismatch every
+	Get leaves its destination alone and Failed() stays true, so a loader can
+	check once at the end.
+
+	With a page filter set, GetPages only copies the pages of memory in the
+	filter and skips the rest. Resetting to a checkpoint uses it to copy back
+	just the pages written since (see Bus::GetDirtyPages).
+*/
+class StateReader {
+private:
+	const u8* data;
+	size_t size;
+	size_t pos = 0;
+	size_t sectionEnd = 0;
+	u32 version = 0;
+	bool failed = false;
+	const PageSet* pageFilter = nullptr;
+public:
+	void Get(void*, size_t);
+	template <typename T>
+	inline void Get(T& val)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "savestate fields are copied as raw memory");
+		Get(&val, sizeof(T));
+	}
+	void GetPages(void*, u8, u32);
+	void Skip(size_t);
+	bool AnyPages(u8, u32) const;
+	void SetPageFilter(const PageSet*);
+	int Open();
+	void BeginSection(u32);
+	void EndSection();
+	void Fail();
+	bool Failed() const;
+	u32 GetVersion() const;
+	StateReader(const u8*, size_t);
+	~StateReader();
+};
+
+int WriteStateFile(const char*, const std::vector<u8>&);
+int ReadStateFile(const char*, std::vector<u8>&);
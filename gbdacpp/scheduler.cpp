@@ -0,0 +1,62 @@
+#include "scheduler.h"
+
+void Scheduler::UpdateNext()
+{
+	next = EVENT_NEVER;
+	for (u64 deadline : deadlines)
+		next = (deadline < next) ? deadline : next;
+}
+
+/*
+	Set (or move) the event's deadline to the absolute cycle `when`.
+*/
+void Scheduler::Schedule(EventType type, u64 when)
+{
+	deadlines[type] = when;
+	UpdateNext();
+}
+
+void Scheduler::Cancel(EventType type)
+{
+	deadlines[type] = EVENT_NEVER;
+	UpdateNext();
+}
+
+/*
+	Take the earliest event that is due by now, if any. The caller handles
+	it and schedules the event's next occurrence.
+*/
+bool Scheduler::PopDue(EventType& type)
+{
+	if (now < next)
+		return false;
+	for (int i = 0; i < EVENT_COUNT; i++) {
+		if (deadlines[i] == next) {
+			type = (EventType)i;
+			deadlines[i] = EVENT_NEVER;
+			UpdateNext();
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	Restart the clock at 0 with nothing scheduled.
+*/
+void Scheduler::Reset()
+{
+	now = 0;
+	deadlines.fill(EVENT_NEVER);
+	next = EVENT_NEVER;
+}
+
+Scheduler::Scheduler()
+{
+	Reset();
+}
+
+Scheduler::~Scheduler()
+{
+
+}
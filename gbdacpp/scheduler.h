@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include <array>
+
+#define EVENT_NEVER					UINT64_MAX
+
+typedef enum {
+	EVENT_PPU,				// the next PPU mode change (or dot, while the FIFO draws)
+	EVENT_TIMER,			// a TIMA overflow or reload
+	EVENT_COUNT,
+} EventType;
+
+/*
+	Keeps the M-cycle clock the hardware runs on and, for every kind of
+	event, the absolute cycle it is due at. The CPU only compares the clock
+	against the earliest deadline after each instruction; components are
+	brought up to date when one of their events comes due, or when the CPU
+	touches their registers.
+
+	There is one slot per EventType rather than a heap: with a handful of
+	kinds a linear scan on (re)scheduling is cheaper than keeping a heap in
+	order, and the deadline the CPU checks is cached either way.
+*/
+class Scheduler {
+private:
+	u64 now = 0;
+	u64 next = EVENT_NEVER;
+	std::array<u64, EVENT_COUNT> deadlines;
+
+	void UpdateNext();
+public:
+	inline u64 Now() const { return now; }
+	inline u64 NextDeadline() const { return next; }
+	/*
+		Returns true when an event is due.
+	*/
+	inline bool Advance(int mCycles)
+	{
+		now += mCycles;
+		return now >= next;
+	}
+	void Schedule(EventType, u64);
+	void Cancel(EventType);
+	bool PopDue(EventType&);
+	void Reset();
+	Scheduler();
+	~Scheduler();
+};
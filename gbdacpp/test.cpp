@@ -0,0 +1,338 @@
+#include "test.h"
+#include "rom.h"
+#include "tiledecode.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+
+#define TEST_ROM_SIZE			(32 * KiB)
+#define TEST_ROM_CODE			0x0150
+// The boot ROM takes almost 6 s, the programs end in a JR $ a frame or two later.
+#define TEST_PROGRAM_CYCLES		(8ULL * CPU_MCYCLES_PER_SECOND)
+// Up to the 21 tiles a scanline touches.
+#define TILE_TEST_MAX_TILES		(PPU_WIDTH / 8 + 1)
+// Every palette with every line length, once.
+#define TILE_TEST_LINES			(256 * TILE_TEST_MAX_TILES)
+
+typedef struct ModeRun {
+	bool loaded = false;
+	RunStatus status = RUN_BUDGET_SPENT;
+	u64 bootCycles = 0;
+	std::string serial;
+} ModeRun;
+
+static const ExecMode execModes[] = { EXEC_INTERPRETER, EXEC_CACHED, EXEC_JIT, EXEC_FUSED };
+static const char* execModeNames[] = { "interpreter", "cached", "jit", "fused" };
+
+/*
+	Send A over the link port: the batch runner's way of seeing output.
+*/
+static void EmitSerialSend(std::vector<u8>& code)
+{
+	code.insert(code.end(), {
+		0xE0, 0x01,				// LDH (SB),A
+		0x3E, 0x81,				// LD A,0x81
+		0xE0, 0x02,				// LDH (SC),A
+	});
+}
+
+/*
+	Starts the timer, then prints DIV, TIMA, LY and STAT 80 times, a
+	block of NOPs apart so that every read lands well into a block. The DIV
+	read is the second half of a fused pair.
+*/
+static std::vector<u8> IoPollProgram()
+{
+	std::vector<u8> code = {
+		0x3E, 0x05,				// LD A,0x05
+		0xE0, 0x07,				// LDH (TAC),A: TIMA counts every 4 M-cycles
+		0x06, 0x50,				// LD B,80
+	};
+	size_t loop = code.size();
+
+	code.insert(code.end(), 40, 0x00);
+	code.insert(code.end(), { 0x0E, 0x00, 0xF0, 0x04 });		// LD C,0; LDH A,(DIV)
+	EmitSerialSend(code);
+	for (u8 reg : { 0x05, 0x44, 0x41 }) {						// TIMA, LY, STAT
+		code.insert(code.end(), { 0xF0, reg });
+		EmitSerialSend(code);
+	}
+	code.push_back(0x05);										// DEC B
+	code.push_back(0x20);										// JR NZ,loop
+	code.push_back((u8)(loop - (code.size() + 1)));
+	code.insert(code.end(), { 0x18, 0xFE });					// JR $
+	return code;
+}
+
+/*
+	A 32 KiB ROM-only cartridge that jumps to code at 0x0150, with a header
+	the boot ROM accepts.
+*/
+static std::vector<u8> BuildTestRom(const std::vector<u8>& code)
+{
+	std::vector<u8> rom(TEST_ROM_SIZE, 0x00);
+	const char title[] = "SELFTEST";
+	u8 checksum = 0;
+
+	rom[0x0100] = 0x00;										// NOP
+	rom[0x0101] = 0xC3;										// JP 0x0150
+	rom[0x0102] = LSB(TEST_ROM_CODE);
+	rom[0x0103] = MSB(TEST_ROM_CODE);
+	std::copy(nintendoLogo.begin(), nintendoLogo.end(), rom.begin() + 0x0104);
+	std::copy(title, title + sizeof(title) - 1, rom.begin() + 0x0134);
+	for (u16 addr = 0x0134; addr <= 0x014C; addr++)
+		checksum = checksum - rom[addr] - 1;
+	rom[0x014D] = checksum;
+	std::copy(code.begin(), code.end(), rom.begin() + TEST_ROM_CODE);
+	return rom;
+}
+
+static ModeRun RunInMode(const std::string& path, ExecMode mode, u64 mCycles)
+{
+	// Each Emulator is a few hundred KiB, keep it off the stack.
+	auto emu = std::make_unique<Emulator>();
+	ModeRun run;
+
+	emu->SetExecMode(mode);
+	if (emu->Load(path.c_str()) == STT_FAILED)
+		return run;
+	run.loaded = true;
+	run.status = emu->RunBootRom(mCycles);
+	run.bootCycles = emu->GetCycleCount();
+	if (run.status == RUN_STOPPED)
+		run.status = emu->RunCycles(mCycles - std::min(mCycles, run.bootCycles));
+	run.serial = emu->GetSerialOutput();
+	return run;
+}
+
+/*
+	Run path in every mode and compare each with the interpreter.
+*/
+static bool CompareModes(const std::string& path, u64 mCycles)
+{
+	ModeRun reference = RunInMode(path, EXEC_INTERPRETER, mCycles);
+	bool passed = reference.loaded;
+
+	if (!reference.loaded)
+		fmt::print("FAIL    {}: can't load it\n", path);
+	for (size_t i = 1; i < std::size(execModes) && reference.loaded; i++) {
+		ModeRun run = RunInMode(path, execModes[i], mCycles);
+		const char* name = execModeNames[i];
+
+		if (!run.loaded) {
+			fmt::print("FAIL    {}: can't load it in {} mode\n", path, name);
+			passed = false;
+			continue;
+		}
+		if (run.bootCycles != reference.bootCycles) {
+			fmt::print("FAIL    {}: {} mode leaves the boot ROM at M-cycle {}, the interpreter at {}\n", path, name,
+				run.bootCycles, reference.bootCycles);
+			passed = false;
+		}
+		if (run.serial != reference.serial) {
+			size_t at = std::mismatch(run.serial.begin(), run.serial.end(), reference.serial.begin(),
+				reference.serial.end()).first - run.serial.begin();
+
+			fmt::print("FAIL    {}: {} mode's serial output differs from the interpreter's at byte {}\n", path, name, at);
+			passed = false;
+		}
+		if ((run.status == RUN_UNKNOWN_OPCODE) != (reference.status == RUN_UNKNOWN_OPCODE)) {
+			fmt::print("FAIL    {}: only one of {} mode and the interpreter hit an unknown opcode\n", path, name);
+			passed = false;
+		}
+	}
+	if (passed)
+		fmt::print("PASS    {}\n", path);
+	return passed;
+}
+
+/*
+	The built-in programs go through a ROM file in the temp directory, the
+	only way into an Emulator. Returns its path, or an empty one if it
+	can't be written.
+*/
+static std::filesystem::path WriteTestRom(const char* name, const std::vector<u8>& code)
+{
+	std::error_code ec;
+	std::filesystem::path path = std::filesystem::temp_directory_path(ec) / fmt::format("gbdacpp-{}.gb", name);
+	std::vector<u8> rom = BuildTestRom(code);
+	std::ofstream fs(path, std::ios::binary);
+
+	fs.write(reinterpret_cast<const char*>(rom.data()), rom.size());
+	fs.close();
+	if (!fs) {
+		fmt::print("FAIL    {}: can't write {}\n", name, path.string());
+		return {};
+	}
+	return path;
+}
+
+static bool CompareModesOnProgram(const char* name, const std::vector<u8>& code)
+{
+	std::filesystem::path path = WriteTestRom(name, code);
+	std::error_code ec;
+
+	if (path.empty())
+		return false;
+
+	bool passed = CompareModes(path.string(), TEST_PROGRAM_CYCLES);
+
+	std::filesystem::remove(path, ec);
+	return passed;
+}
+
+/*
+	Turn a current savestate into what a version-`version` build would have
+	written: the fields later versions appended to a section are cut off
+	its end, and sections they added are left out.
+*/
+static std::vector<u8> DowngradeState(const std::vector<u8>& state, u32 version)
+{
+	const size_t header = 8 + sizeof(u32);
+	std::vector<u8> old(state.begin(), state.begin() + header);
+	size_t pos = header;
+
+	std::memcpy(&old[8], &version, sizeof(version));
+	while (pos + 2 * sizeof(u32) <= state.size()) {
+		u32 tag, len;
+
+		std::memcpy(&tag, &state[pos], sizeof(tag));
+		std::memcpy(&len, &state[pos + sizeof(tag)], sizeof(len));
+
+		const u8* body = &state[pos + 2 * sizeof(u32)];
+		u32 keep = len;
+
+		pos += 2 * sizeof(u32) + len;
+		if (tag == STATE_TAG_EMULATOR && version < 2)
+			keep = sizeof(u64);							// cycles, without the overshoot
+		else if (tag == STATE_TAG_TIMER && version < 3)
+			continue;
+		else if (tag == STATE_TAG_CPU && version < 4)
+			keep = 6 * sizeof(u16);						// the registers, without the sleep state
+		old.insert(old.end(), reinterpret_cast<const u8*>(&tag), reinterpret_cast<const u8*>(&tag) + sizeof(tag));
+		old.insert(old.end(), reinterpret_cast<const u8*>(&keep), reinterpret_cast<const u8*>(&keep) + sizeof(keep));
+		old.insert(old.end(), body, body + keep);
+	}
+	return old;
+}
+
+/*
+	A state saved by any older version has to load and put the clock back
+	where it was saved (see savestate.h).
+*/
+static bool CheckOldStates(const std::vector<u8>& code)
+{
+	std::filesystem::path path = WriteTestRom("old-states", code);
+	std::error_code ec;
+	bool passed = !path.empty();
+
+	if (!passed)
+		return false;
+
+	auto emu = std::make_unique<Emulator>();
+	std::vector<u8> state;
+
+	if (emu->Load(path.string().c_str()) == STT_FAILED || emu->RunBootRom(TEST_PROGRAM_CYCLES) != RUN_STOPPED ||
+		emu->RunCycles(CPU_MCYCLES_PER_SECOND / 10) == RUN_UNKNOWN_OPCODE || emu->SaveState(state) == STT_FAILED) {
+		fmt::print("FAIL    old states: can't run the test program\n");
+		passed = false;
+	}
+
+	u64 savedAt = emu->GetCycleCount();
+
+	for (u32 version = 1; version < SAVESTATE_VERSION && passed; version++) {
+		std::vector<u8> old = DowngradeState(state, version);
+
+		emu->RunCycles(CPU_MCYCLES_PER_SECOND / 10);
+		if (emu->LoadState(old.data(), old.size()) == STT_FAILED) {
+			fmt::print("FAIL    old states: a version {} state doesn't load\n", version);
+			passed = false;
+		} else if (emu->GetCycleCount() != savedAt) {
+			fmt::print("FAIL    old states: a version {} state loads at M-cycle {}, it was saved at {}\n", version,
+				emu->GetCycleCount(), savedAt);
+			passed = false;
+		}
+	}
+	if (passed)
+		fmt::print("PASS    old states, versions 1 to {}\n", SAVESTATE_VERSION - 1);
+	std::filesystem::remove(path, ec);
+	return passed;
+}
+
+/*
+	The tile decoder spelled out a pixel at a time, the way the PPU reads
+	a tile row: the golden output every kernel has to match.
+*/
+static void DecodeTileRowsReference(const u8* planes, int tiles, u8 palette, u8* indices, u8* shades)
+{
+	for (int p = 0; p < tiles * 8; p++) {
+		int bit = 7 - (p & 7);
+		u8 index = ((planes[(p >> 3) * 2] >> bit) & 1) | (((planes[(p >> 3) * 2 + 1] >> bit) & 1) << 1);
+
+		indices[p] = index;
+		shades[p] = (palette >> (index * 2)) & 3;
+	}
+}
+
+/*
+	Decode random lines with kernel and compare the indices and shades
+	with the reference. Line n has 1 + n % 21 tiles and palette n & 0xff,
+	so every palette is tried at every length. The outputs are poisoned
+	first, so a pixel a kernel skips shows up as well.
+*/
+static bool CheckTileDecoder(TileDecodeKernel kernel)
+{
+	const char* name = GetTileDecodeKernelName(kernel);
+	TileDecodeFn decode = GetTileDecoder(kernel);
+	std::mt19937 random(TILE_TEST_LINES);
+	u8 planes[TILE_TEST_MAX_TILES * 2];
+	u8 indices[2][TILE_TEST_MAX_TILES * 8];
+	u8 shades[2][TILE_TEST_MAX_TILES * 8];
+
+	if (decode == nullptr) {
+		fmt::print("SKIP    tile decoder {}: this CPU can't run it\n", name);
+		return true;
+	}
+	for (int line = 0; line < TILE_TEST_LINES; line++) {
+		int tiles = 1 + line % TILE_TEST_MAX_TILES;
+		u8 palette = (u8)line;
+
+		for (u8& plane : planes)
+			plane = (u8)random();
+		std::memset(indices, 0xAA, sizeof(indices));
+		std::memset(shades, 0xAA, sizeof(shades));
+		DecodeTileRowsReference(planes, tiles, palette, indices[0], shades[0]);
+		decode(planes, tiles, palette, indices[1], shades[1]);
+		for (int p = 0; p < tiles * 8; p++) {
+			if (indices[1][p] != indices[0][p] || shades[1][p] != shades[0][p]) {
+				fmt::print("FAIL    tile decoder {}: line {} ({} tiles, palette {:02X}) differs from the reference at pixel {}\n",
+					name, line, tiles, palette, p);
+				return false;
+			}
+		}
+	}
+	fmt::print("PASS    tile decoder {}\n", name);
+	return true;
+}
+
+int RunSelfTests(const std::vector<std::string>& roms, u64 mCycles)
+{
+	size_t failed = 0;
+
+	for (int kernel = 0; kernel < TILE_DECODE_KERNEL_COUNT; kernel++)
+		failed += !CheckTileDecoder((TileDecodeKernel)kernel);
+	failed += !CompareModesOnProgram("io-poll", IoPollProgram());
+	failed += !CheckOldStates(IoPollProgram());
+	for (const std::string& path : roms)
+		failed += !CompareModes(path, mCycles);
+	fmt::print("{} checks, {} failed\n", TILE_DECODE_KERNEL_COUNT + 2 + roms.size(), failed);
+	std::fflush(stdout);
+	return (failed == 0) ? STT_SUCCESS : STT_FAILED;
+}
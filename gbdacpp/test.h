@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+#include "emulator.h"
+#include <string>
+#include <vector>
+
+// Enough for a Blargg or Mooneye test ROM to print its verdict.
+#define SELF_TEST_DEFAULT_CYCLES	(30ULL * CPU_MCYCLES_PER_SECOND)
+
+/*
+	gbdacpp --self-test: checks that all execution modes run a ROM the same
+	way. Built-in test programs, and every ROM given, run once per mode and
+	have to leave the boot ROM at the same M-cycle and print the same serial
+	output as on the interpreter. The built-in ones read DIV, TIMA, LY and
+	STAT in the middle of blocks and fused pairs, and print what they read.
+	Before them, every tile decode kernel the CPU runs is checked against
+	a plain per-pixel decode, and after them states in every older
+	savestate layout have to load. Returns STT_SUCCESS only if every check
+	passed.
+*/
+int RunSelfTests(const std::vector<std::string>&, u64);
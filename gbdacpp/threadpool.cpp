@@ -0,0 +1,87 @@
+#include "threadpool.h"
+#include <thread>
+
+bool ThreadPool::PopLocal(size_t id, Task& task)
+{
+	Worker& worker = *workers[id];
+	std::lock_guard<std::mutex> guard(worker.lock);
+
+	if (worker.tasks.empty())
+		return false;
+	task = std::move(worker.tasks.back());
+	worker.tasks.pop_back();
+	return true;
+}
+
+bool ThreadPool::Steal(size_t id, Task& task)
+{
+	for (size_t i = 1; i < workers.size(); i++) {
+		Worker& victim = *workers[(id + i) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+
+		if (victim.tasks.empty())
+			continue;
+		task = std::move(victim.tasks.front());
+		victim.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::WorkerLoop(size_t id)
+{
+	Task task;
+
+	// Nothing is submitted while the pool runs, so once every queue is
+	// empty there is no work left to find.
+	while (PopLocal(id, task) || Steal(id, task))
+		task();
+}
+
+void ThreadPool::Submit(Task task)
+{
+	Worker& worker = *workers[nextWorker];
+	std::lock_guard<std::mutex> guard(worker.lock);
+
+	worker.tasks.push_back(std::move(task));
+	nextWorker = (nextWorker + 1) % workers.size();
+}
+
+/*
+	Run every submitted task and return when all of them are done. The
+	calling thread works as worker 0.
+*/
+void ThreadPool::Run()
+{
+	std::vector<std::thread> threads;
+
+	for (size_t id = 1; id < workers.size(); id++)
+		threads.emplace_back(&ThreadPool::WorkerLoop, this, id);
+	WorkerLoop(0);
+	for (std::thread& thread : threads)
+		thread.join();
+	nextWorker = 0;
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+	return workers.size();
+}
+
+/*
+	threads <= 0 uses one thread per hardware thread.
+*/
+ThreadPool::ThreadPool(int threads)
+{
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+	for (int i = 0; i < threads; i++)
+		workers.push_back(std::make_unique<Worker>());
+}
+
+ThreadPool::~ThreadPool()
+{
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+typedef std::function<void()> Task;
+
+/*
+	A work-stealing pool for a fixed batch of independent tasks. Submit deals
+	the tasks out round robin; during Run every worker drains its own queue
+	from the back and, once it is empty, steals from the front of the others,
+	so a worker stuck with a few long tasks doesn't hold up the batch. Tasks
+	must not submit more tasks.
+*/
+class ThreadPool {
+private:
+	typedef struct Worker {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	} Worker;
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	size_t nextWorker = 0;
+
+	bool PopLocal(size_t, Task&);
+	bool Steal(size_t, Task&);
+	void WorkerLoop(size_t);
+public:
+	void Submit(Task);
+	void Run();
+	size_t GetThreadCount() const;
+	ThreadPool(int);
+	~ThreadPool();
+};
@@ -0,0 +1,182 @@
+#include "tiledecode.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define TILE_DECODE_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC accepts any intrinsic in any function.
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2		__attribute__((target("sse2")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+#endif
+#endif
+
+#define BROADCAST_BYTE		0x0101010101010101ULL
+
+static void DecodeTileRowsScalar(const u8* planes, int tiles, u8 palette, u8* indices, u8* shades)
+{
+	u8 shadeOf[4] = { (u8)(palette & 3), (u8)((palette >> 2) & 3), (u8)((palette >> 4) & 3), (u8)(palette >> 6) };
+
+	for (int t = 0; t < tiles; t++) {
+		DecodeTileRow(&planes[t * 2], false, &indices[t * 8]);
+		for (int p = t * 8; p < t * 8 + 8; p++)
+			shades[p] = shadeOf[indices[p]];
+	}
+}
+
+#ifdef TILE_DECODE_X86
+/*
+	Both SIMD kernels work the same way. Each tile's bitplane bytes are
+	broadcast to its 8 pixel lanes and tested against a per-lane bit mask,
+	which gives all-ones lanes l and h where the low/high bit is set. Then
+	  index = (l & 1) | (h & 2)
+	  shade = S0 ^ (l & (S0 ^ S1)) ^ (h & (S0 ^ S2)) ^ (l & h & (S0 ^ S1 ^ S2 ^ S3))
+	where Sn is the palette shade for colour n, so the palette costs a few
+	logic ops instead of a lookup per pixel.
+*/
+TARGET_SSE2 static void DecodeTileRowsSse2(const u8* planes, int tiles, u8 palette, u8* indices, u8* shades)
+{
+	const __m128i bits = _mm_set1_epi64x((long long)0x0102040810204080ULL);
+	u8 s0 = palette & 3, s1 = (palette >> 2) & 3, s2 = (palette >> 4) & 3, s3 = palette >> 6;
+	const __m128i base = _mm_set1_epi8(s0);
+	const __m128i lowTerm = _mm_set1_epi8(s0 ^ s1);
+	const __m128i highTerm = _mm_set1_epi8(s0 ^ s2);
+	const __m128i bothTerm = _mm_set1_epi8(s0 ^ s1 ^ s2 ^ s3);
+	int t = 0;
+
+	for (; t + 2 <= tiles; t += 2) {
+		const u8* p = &planes[t * 2];
+		__m128i low = _mm_set_epi64x((long long)(p[2] * BROADCAST_BYTE), (long long)(p[0] * BROADCAST_BYTE));
+		__m128i high = _mm_set_epi64x((long long)(p[3] * BROADCAST_BYTE), (long long)(p[1] * BROADCAST_BYTE));
+
+		low = _mm_cmpeq_epi8(_mm_and_si128(low, bits), bits);
+		high = _mm_cmpeq_epi8(_mm_and_si128(high, bits), bits);
+
+		__m128i index = _mm_or_si128(_mm_and_si128(low, _mm_set1_epi8(1)), _mm_and_si128(high, _mm_set1_epi8(2)));
+		__m128i shade = _mm_xor_si128(_mm_xor_si128(base, _mm_and_si128(low, lowTerm)),
+			_mm_xor_si128(_mm_and_si128(high, highTerm), _mm_and_si128(_mm_and_si128(low, high), bothTerm)));
+
+		_mm_storeu_si128((__m128i*)&indices[t * 8], index);
+		_mm_storeu_si128((__m128i*)&shades[t * 8], shade);
+	}
+	if (t < tiles)
+		DecodeTileRowsScalar(&planes[t * 2], tiles - t, palette, &indices[t * 8], &shades[t * 8]);
+}
+
+TARGET_AVX2 static void DecodeTileRowsAvx2(const u8* planes, int tiles, u8 palette, u8* indices, u8* shades)
+{
+	const __m256i bits = _mm256_set1_epi64x((long long)0x0102040810204080ULL);
+	u8 s0 = palette & 3, s1 = (palette >> 2) & 3, s2 = (palette >> 4) & 3, s3 = palette >> 6;
+	const __m256i base = _mm256_set1_epi8(s0);
+	const __m256i lowTerm = _mm256_set1_epi8(s0 ^ s1);
+	const __m256i highTerm = _mm256_set1_epi8(s0 ^ s2);
+	const __m256i bothTerm = _mm256_set1_epi8(s0 ^ s1 ^ s2 ^ s3);
+	int t = 0;
+
+	// Both 128-bit lanes hold a copy of the 8 plane bytes; pshufb then picks
+	// tile 0/1 (lane 0) and tile 2/3 (lane 1) bytes out for each pixel.
+	const __m256i lowSelect = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+		4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+	const __m256i highSelect = _mm256_add_epi8(lowSelect, _mm256_set1_epi8(1));
+
+	for (; t + 4 <= tiles; t += 4) {
+		__m256i p = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i*)&planes[t * 2]));
+		__m256i low = _mm256_shuffle_epi8(p, lowSelect);
+		__m256i high = _mm256_shuffle_epi8(p, highSelect);
+
+		low = _mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits);
+		high = _mm256_cmpeq_epi8(_mm256_and_si256(high, bits), bits);
+
+		__m256i index = _mm256_or_si256(_mm256_and_si256(low, _mm256_set1_epi8(1)), _mm256_and_si256(high, _mm256_set1_epi8(2)));
+		__m256i shade = _mm256_xor_si256(_mm256_xor_si256(base, _mm256_and_si256(low, lowTerm)),
+			_mm256_xor_si256(_mm256_and_si256(high, highTerm), _mm256_and_si256(_mm256_and_si256(low, high), bothTerm)));
+
+		_mm256_storeu_si256((__m256i*)&indices[t * 8], index);
+		_mm256_storeu_si256((__m256i*)&shades[t * 8], shade);
+	}
+	// Leave the upper YMM halves clean before running legacy SSE code, or
+	// every SSE instruction in the tail pays a state transition penalty.
+	_mm256_zeroupper();
+	if (t < tiles)
+		DecodeTileRowsSse2(&planes[t * 2], tiles - t, palette, &indices[t * 8], &shades[t * 8]);
+}
+
+static bool CpuHasSse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[3] >> 26) & 1;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool CpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	// The OS must also save the YMM registers (OSXSAVE + XCR0 bits 1 and 2).
+	__cpuid(info, 1);
+	if (!((info[2] >> 27) & 1) || !((info[2] >> 28) & 1) || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/*
+	The decoder for a specific kernel, or nullptr if this CPU can't run it.
+*/
+TileDecodeFn GetTileDecoder(TileDecodeKernel kernel)
+{
+	switch (kernel) {
+#ifdef TILE_DECODE_X86
+	case TILE_DECODE_AVX2:
+		return CpuHasAvx2() ? DecodeTileRowsAvx2 : nullptr;
+	case TILE_DECODE_SSE2:
+		return CpuHasSse2() ? DecodeTileRowsSse2 : nullptr;
+#endif
+	case TILE_DECODE_SCALAR:
+		return DecodeTileRowsScalar;
+	default:
+		return nullptr;
+	}
+}
+
+TileDecodeKernel GetBestTileDecodeKernel()
+{
+	static const TileDecodeKernel best =
+		(GetTileDecoder(TILE_DECODE_AVX2) != nullptr) ? TILE_DECODE_AVX2 :
+		(GetTileDecoder(TILE_DECODE_SSE2) != nullptr) ? TILE_DECODE_SSE2 : TILE_DECODE_SCALAR;
+
+	return best;
+}
+
+/*
+	The fastest decoder this CPU supports, picked once.
+*/
+TileDecodeFn GetTileDecoder()
+{
+	return GetTileDecoder(GetBestTileDecodeKernel());
+}
+
+const char* GetTileDecodeKernelName(TileDecodeKernel kernel)
+{
+	static const char* names[TILE_DECODE_KERNEL_COUNT] = { "scalar", "sse2", "avx2" };
+
+	return (kernel < TILE_DECODE_KERNEL_COUNT) ? names[kernel] : "unknown";
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include <cstring>
+
+typedef enum {
+	TILE_DECODE_SCALAR,
+	TILE_DECODE_SSE2,
+	TILE_DECODE_AVX2,
+	TILE_DECODE_KERNEL_COUNT,
+} TileDecodeKernel;
+
+/*
+	Decode `tiles` 2bpp tile rows, stored back to back as (low, high) bitplane
+	byte pairs, into 8 * tiles colour indices and, in the same pass, the shades
+	they map to through `palette` (BGP/OBP0/OBP1 layout).
+*/
+typedef void (*TileDecodeFn)(const u8* planes, int tiles, u8 palette, u8* indices, u8* shades);
+
+TileDecodeFn GetTileDecoder();
+TileDecodeFn GetTileDecoder(TileDecodeKernel);
+TileDecodeKernel GetBestTileDecodeKernel();
+const char* GetTileDecodeKernelName(TileDecodeKernel);
+
+/*
+	A 2bpp tile row is a low and a high bitplane byte, leftmost pixel in bit 7.
+	tileRowTable[b] spreads the bits of b out into one byte per pixel, leftmost
+	pixel in the lowest byte, so a whole row of colour indices is
+	tileRowTable[low] | (tileRowTable[high] << 1) with no per-pixel work.
+	tileRowFlipTable is the same for horizontally flipped sprites.
+*/
+static constexpr std::array<u64, 256> BuildTileRowTable(bool flip)
+{
+	std::array<u64, 256> tbl = {};
+
+	for (int b = 0; b < 256; b++) {
+		for (int bit = 0; bit < 8; bit++) {
+			int pixel = flip ? bit : 7 - bit;
+
+			tbl[b] |= (u64)((b >> bit) & 1) << (pixel * 8);
+		}
+	}
+	return tbl;
+}
+
+static constexpr std::array<u64, 256> tileRowTable = BuildTileRowTable(false);
+static constexpr std::array<u64, 256> tileRowFlipTable = BuildTileRowTable(true);
+
+/*
+	Single row version for the sprite and pixel FIFO paths.
+*/
+static inline void DecodeTileRow(const u8* row, bool flip, u8* pixels)
+{
+	const std::array<u64, 256>& tbl = flip ? tileRowFlipTable : tileRowTable;
+	u64 decoded = tbl[row[0]] | (tbl[row[1]] << 1);
+
+	// Byte order matches the pixel order on little-endian hosts.
+	std::memcpy(pixels, &decoded, 8);
+}
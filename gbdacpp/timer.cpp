@@ -0,0 +1,203 @@
+#include "timer.h"
+#include "scheduler.h"
+
+// The system counter bit each TAC clock select watches.
+static constexpr int tacBits[4] = { 9, 3, 5, 7 };
+
+/*
+	TIMA goes up once every 2^EdgeShift() counts of the system counter.
+*/
+int Timer::EdgeShift() const
+{
+	return tacBits[tac & 0x03] + 1;
+}
+
+/*
+	The line TIMA counts the falling edges of.
+*/
+bool Timer::Signal() const
+{
+	return (tac & TAC_ENABLE) && NTHBIT(Counter(now), tacBits[tac & 0x03]);
+}
+
+/*
+	The cycle TIMA overflows at if nothing is written before, EVENT_NEVER
+	while it's stopped or already waiting for the reload.
+*/
+u64 Timer::OverflowTime() const
+{
+	if (!(tac & TAC_ENABLE) || reloadAt != EVENT_NEVER)
+		return EVENT_NEVER;
+
+	int shift = EdgeShift();
+	u64 edge = (Counter(now) >> shift) + (0x100 - tima);
+
+	return divEpoch + ((edge << shift) >> 2);
+}
+
+/*
+	One TIMA increment at the current cycle, from a write that made a
+	falling edge.
+*/
+void Timer::Increment()
+{
+	if (tima == 0xFF) {
+		tima = 0;
+		reloadAt = now + 1;
+	} else {
+		tima++;
+	}
+}
+
+/*
+	Run the timer up to cycle `to` and return the interrupts it raised since
+	the last call, as IF bits.
+*/
+int Timer::Sync(u64 to)
+{
+	for (;;) {
+		if (reloadAt <= to) {
+			tima = tma;
+			interrupts |= INT_TIMER;
+			now = lastReload = reloadAt;
+			reloadAt = EVENT_NEVER;
+		}
+
+		u64 overflow = OverflowTime();
+
+		if (overflow > to)
+			break;
+		now = overflow;
+		tima = 0;
+		reloadAt = overflow + 1;
+	}
+	// No overflow before `to`, so these can't carry out of TIMA.
+	if ((tac & TAC_ENABLE) && reloadAt == EVENT_NEVER) {
+		int shift = EdgeShift();
+
+		tima += (u8)((Counter(to) >> shift) - (Counter(now) >> shift));
+	}
+	now = to;
+
+	int raised = interrupts;
+
+	interrupts = 0;
+	return raised;
+}
+
+/*
+	The next cycle Sync has something to do at: an overflow or a reload.
+*/
+u64 Timer::NextEvent() const
+{
+	return (reloadAt != EVENT_NEVER) ? reloadAt : OverflowTime();
+}
+
+/*
+	Register access happens at the cycle of the last Sync.
+*/
+u8 Timer::ReadRegister(u16 addr) const
+{
+	switch (addr) {
+	case 0xFF04: return (u8)(Counter(now) >> 8);
+	case 0xFF05: return tima;
+	case 0xFF06: return tma;
+	case 0xFF07: return tac | 0xF8;
+	default: return 0xff;
+	}
+}
+
+void Timer::WriteRegister(u16 addr, u8 val)
+{
+	bool signal = Signal();
+
+	switch (addr) {
+	case 0xFF04:
+		divEpoch = now;
+		if (signal)
+			Increment();
+		break;
+	case 0xFF05:
+		if (now == lastReload)
+			break;
+		tima = val;
+		reloadAt = EVENT_NEVER;
+		break;
+	case 0xFF06:
+		tma = val;
+		if (now == lastReload)
+			tima = val;
+		break;
+	case 0xFF07:
+		tac = val & 0x07;
+		if (signal && !Signal())
+			Increment();
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+	Cycles are kept relative to the last Sync, so a state loads at any
+	point of the scheduler's clock.
+*/
+void Timer::SaveState(StateWriter& state) const
+{
+	u16 counter = (u16)Counter(now);
+	bool reloadPending = reloadAt != EVENT_NEVER;
+	bool reloading = now == lastReload;
+
+	state.BeginSection(STATE_TAG_TIMER);
+	state.Put(counter);
+	state.Put(tima);
+	state.Put(tma);
+	state.Put(tac);
+	state.Put(reloadPending);
+	state.Put(reloading);
+	state.EndSection();
+}
+
+/*
+	Load the timer as of cycle `at`.
+*/
+void Timer::LoadState(StateReader& state, u64 at)
+{
+	u16 counter = 0;
+	bool reloadPending = false, reloading = false;
+
+	state.BeginSection(STATE_TAG_TIMER);
+	state.Get(counter);
+	state.Get(tima);
+	state.Get(tma);
+	state.Get(tac);
+	state.Get(reloadPending);
+	state.Get(reloading);
+	state.EndSection();
+	now = at;
+	divEpoch = at - (counter >> 2);
+	reloadAt = reloadPending ? at + 1 : EVENT_NEVER;
+	lastReload = reloading ? at : EVENT_NEVER;
+	interrupts = 0;
+}
+
+/*
+	Power-on state, as of cycle `at`.
+*/
+void Timer::Reset(u64 at)
+{
+	now = divEpoch = at;
+	reloadAt = lastReload = EVENT_NEVER;
+	tima = tma = tac = 0;
+	interrupts = 0;
+}
+
+Timer::Timer()
+{
+	Reset(0);
+}
+
+Timer::~Timer()
+{
+
+}
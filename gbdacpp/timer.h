@@ -1,10 +1,52 @@
 #pragma once
 
 #include "common.h"
+#include "savestate.h"
 
+#define TAC_ENABLE					(1U << 2)
+
+/*
+	DIV and TIMA, worked out from the scheduler's clock when they're looked
+	at instead of counted every cycle.
+
+	Both run off one 16-bit system counter that goes up by 4 every M-cycle;
+	DIV is its top byte, and TIMA goes up on every falling edge of the
+	counter bit TAC selects (ANDed with TAC's enable bit). So the counter
+	is just the cycles since DIV was last reset, and the TIMA increments
+	between two cycles are the multiples of the bit's period in between.
+	The only event is the next overflow, and the reload one M-cycle after.
+
+	Writes that drop the selected signal from 1 to 0 are a falling edge
+	too: resetting DIV while the bit is set, and changing TAC so the
+	signal goes low. After an overflow TIMA reads 0 for an M-cycle, and a
+	TIMA write then cancels the reload and its interrupt. In the M-cycle
+	of the reload TIMA writes are lost, and TMA writes go through to TIMA
+	as well.
+*/
 class Timer {
+private:
+	u64 now;				// the cycle the timer has been run up to
+	u64 divEpoch;			// the cycle the system counter was last 0 at
+	u64 reloadAt;			// when an overflowed TIMA gets TMA, EVENT_NEVER when it didn't overflow
+	u64 lastReload;
+	u8 tima;
+	u8 tma;
+	u8 tac;
+	int interrupts;
 
+	inline u64 Counter(u64 at) const { return (at - divEpoch) << 2; }
+	int EdgeShift() const;
+	bool Signal() const;
+	u64 OverflowTime() const;
+	void Increment();
 public:
+	int Sync(u64);
+	u64 NextEvent() const;
+	u8 ReadRegister(u16) const;
+	void WriteRegister(u16, u8);
+	void SaveState(StateWriter&) const;
+	void LoadState(StateReader&, u64);
+	void Reset(u64);
 	Timer();
 	~Timer();
-};
\ No newline at end of file
+};
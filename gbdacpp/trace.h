@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.h"
+
+#define TRACE_MAGIC					"GBTRACE1"
+
+/*
+	One executed instruction in a binary CPU trace: the registers before it
+	runs and the 4 bytes at PC. Records are a fixed 16 bytes, stored in host
+	(little-endian) order straight after an 8-byte TRACE_MAGIC header, so a
+	trace file can be memory-mapped and indexed like an array.
+*/
+typedef struct TraceRecord {
+	u16 pc;
+	u16 sp;
+	u16 af;			// A in the high byte, F in the low byte
+	u16 bc;
+	u16 de;
+	u16 hl;
+	u8 romData[4];
+} TraceRecord;
+
+static_assert(sizeof(TraceRecord) == 16, "trace records must stay 16 bytes");
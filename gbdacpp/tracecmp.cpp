@@ -0,0 +1,224 @@
+#include "tracecmp.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+static int HexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+	Match the literal text `label`, then `digits` hex digits.
+*/
+static bool ParseField(const char*& p, const char* end, const char* label, int digits, u16& value)
+{
+	size_t len = std::strlen(label);
+
+	if ((size_t)(end - p) < len + digits || std::memcmp(p, label, len) != 0)
+		return false;
+	p += len;
+	value = 0;
+	for (int i = 0; i < digits; i++) {
+		int digit = HexDigit(*p++);
+
+		if (digit < 0)
+			return false;
+		value = (value << 4) | digit;
+	}
+	return true;
+}
+
+static bool ParseLine(const char* p, const char* end, TraceRecord& record)
+{
+	u16 a, f, b, c, d, e, h, l, bank, rom[4];
+
+	if (!ParseField(p, end, "A: ", 2, a) || !ParseField(p, end, " F: ", 2, f) ||
+		!ParseField(p, end, " B: ", 2, b) || !ParseField(p, end, " C: ", 2, c) ||
+		!ParseField(p, end, " D: ", 2, d) || !ParseField(p, end, " E: ", 2, e) ||
+		!ParseField(p, end, " H: ", 2, h) || !ParseField(p, end, " L: ", 2, l) ||
+		!ParseField(p, end, " SP: ", 4, record.sp) || !ParseField(p, end, " PC: ", 2, bank) ||
+		!ParseField(p, end, ":", 4, record.pc) || !ParseField(p, end, " (", 2, rom[0]) ||
+		!ParseField(p, end, " ", 2, rom[1]) || !ParseField(p, end, " ", 2, rom[2]) ||
+		!ParseField(p, end, " ", 2, rom[3]))
+		return false;
+	record.af = U16(f, a);
+	record.bc = U16(c, b);
+	record.de = U16(e, d);
+	record.hl = U16(l, h);
+	for (int i = 0; i < 4; i++)
+		record.romData[i] = (u8)rom[i];
+	return true;
+}
+
+static int ParseTextLog(const MappedFile& log, const char* path, std::vector<TraceRecord>& records)
+{
+	const char* p = reinterpret_cast<const char*>(log.GetData());
+	const char* end = p + log.GetSize();
+	u64 line = 0;
+
+	// A line is a bit over 80 characters.
+	records.reserve(log.GetSize() / 80);
+	while (p < end) {
+		const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		const char* next = (eol != nullptr) ? eol + 1 : end;
+
+		if (eol == nullptr)
+			eol = end;
+		line++;
+		if (eol > p && eol[-1] == '\r')
+			eol--;
+		if (eol > p) {
+			TraceRecord record;
+
+			if (!ParseLine(p, eol, record)) {
+				spdlog::error("{}:{}: not a Gameboy-logs line.", path, line);
+				return STT_FAILED;
+			}
+			records.push_back(record);
+		}
+		p = next;
+	}
+	return STT_SUCCESS;
+}
+
+static bool IsBinaryTrace(const MappedFile& file)
+{
+	return file.GetSize() >= 8 && std::memcmp(file.GetData(), TRACE_MAGIC, 8) == 0 &&
+		(file.GetSize() - 8) % sizeof(TraceRecord) == 0;
+}
+
+int TraceComparator::MapTrace(const char* path)
+{
+	if (reference.Open(path) == STT_FAILED || !IsBinaryTrace(reference)) {
+		reference.Close();
+		return STT_FAILED;
+	}
+	records = reinterpret_cast<const TraceRecord*>(reference.GetData() + 8);
+	count = (reference.GetSize() - 8) / sizeof(TraceRecord);
+	return STT_SUCCESS;
+}
+
+/*
+	Load the reference at `path`: a binary trace is mapped as is, a text log
+	goes through its cache, which is rebuilt whenever the log is newer.
+*/
+int TraceComparator::Open(const char* path)
+{
+	std::string cachePath = std::string(path) + ".bin";
+	std::error_code ec;
+
+	referencePath = path;
+	position = 0;
+	mismatched = false;
+	parsed.clear();
+	if (MapTrace(path) == STT_SUCCESS)
+		return STT_SUCCESS;
+
+	auto logTime = std::filesystem::last_write_time(path, ec);
+
+	if (ec) {
+		spdlog::error("Can't open the reference log {}.", path);
+		return STT_FAILED;
+	}
+
+	auto cacheTime = std::filesystem::last_write_time(cachePath, ec);
+
+	if (!ec && cacheTime >= logTime && MapTrace(cachePath.c_str()) == STT_SUCCESS)
+		return STT_SUCCESS;
+
+	MappedFile log;
+
+	if (log.Open(path) == STT_FAILED) {
+		spdlog::error("Can't open the reference log {}.", path);
+		return STT_FAILED;
+	}
+	if (ParseTextLog(log, path, parsed) == STT_FAILED)
+		return STT_FAILED;
+	log.Close();
+
+	std::FILE* cache = std::fopen(cachePath.c_str(), "wb");
+	bool cached = cache != nullptr && std::fwrite(TRACE_MAGIC, 1, 8, cache) == 8 &&
+		std::fwrite(parsed.data(), sizeof(TraceRecord), parsed.size(), cache) == parsed.size();
+
+	if (cache != nullptr)
+		cached = (std::fclose(cache) == 0) && cached;
+	if (cached && MapTrace(cachePath.c_str()) == STT_SUCCESS) {
+		parsed.clear();
+		parsed.shrink_to_fit();
+		return STT_SUCCESS;
+	}
+	spdlog::warn("Can't write the trace cache {}, comparing from memory.", cachePath);
+	records = parsed.data();
+	count = parsed.size();
+	return STT_SUCCESS;
+}
+
+/*
+	Instructions of context printed before a mismatch.
+*/
+void TraceComparator::SetContext(int instructions)
+{
+	context = std::max(instructions, 0);
+}
+
+void TraceComparator::PrintReport() const
+{
+	if (!mismatched) {
+		fmt::print("Matched {} of {} instructions in {}.\n", position, count, referencePath);
+		return;
+	}
+
+	const TraceRecord& expected = records[position];
+
+	fmt::print("Diverged from {} at instruction {}:\n", referencePath, position);
+	for (u64 i = position - std::min<u64>(position, context); i < position; i++)
+		fmt::print("  {:>10}  {}\n", i, FormatTraceRecord(records[i]));
+	fmt::print("  expected    {}\n", FormatTraceRecord(expected));
+	fmt::print("  got         {}\n", FormatTraceRecord(actual));
+
+	const struct {
+		const char* name;
+		int expected, actual;
+		int digits;
+	} fields[] = {
+		{ "A", MSB(expected.af), MSB(actual.af), 2 }, { "F", LSB(expected.af), LSB(actual.af), 2 },
+		{ "B", MSB(expected.bc), MSB(actual.bc), 2 }, { "C", LSB(expected.bc), LSB(actual.bc), 2 },
+		{ "D", MSB(expected.de), MSB(actual.de), 2 }, { "E", LSB(expected.de), LSB(actual.de), 2 },
+		{ "H", MSB(expected.hl), MSB(actual.hl), 2 }, { "L", LSB(expected.hl), LSB(actual.hl), 2 },
+		{ "SP", expected.sp, actual.sp, 4 }, { "PC", expected.pc, actual.pc, 4 },
+		{ "(PC)", expected.romData[0], actual.romData[0], 2 }, { "(PC+1)", expected.romData[1], actual.romData[1], 2 },
+		{ "(PC+2)", expected.romData[2], actual.romData[2], 2 }, { "(PC+3)", expected.romData[3], actual.romData[3], 2 },
+	};
+
+	for (const auto& field : fields) {
+		if (field.expected != field.actual)
+			fmt::print("  {:<6} expected {:0{}X}, got {:0{}X}\n", field.name, field.expected, field.digits,
+				field.actual, field.digits);
+	}
+	if (LSB(expected.af) != LSB(actual.af)) {
+		u8 diff = LSB(expected.af) ^ LSB(actual.af);
+
+		fmt::print("  flags  differ in{}{}{}{}\n", (diff & FLAG_Z) ? " Z" : "", (diff & FLAG_N) ? " N" : "",
+			(diff & FLAG_H) ? " H" : "", (diff & FLAG_C) ? " C" : "");
+	}
+}
+
+TraceComparator::TraceComparator()
+{
+
+}
+
+TraceComparator::~TraceComparator()
+{
+
+}
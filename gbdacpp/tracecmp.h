@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include "logger.h"
+#include "mappedfile.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define TRACE_CONTEXT_DEFAULT		16
+
+typedef enum {
+	TRACE_MATCH,
+	TRACE_MISMATCH,
+	TRACE_END,			// the reference has no more records
+} TraceCheck;
+
+/*
+	Checks the CPU against a reference trace while it runs, one instruction
+	at a time. The reference is either a binary trace of our own or a
+	Gameboy-logs text log; a text log is parsed once into a binary trace
+	cached next to it (<log>.bin) and memory-mapped from then on.
+
+	Everything before a mismatch matched, so the context printed with it
+	comes straight out of the reference.
+*/
+class TraceComparator {
+private:
+	MappedFile reference;
+	std::vector<TraceRecord> parsed;		// only if the cache can't be written
+	std::string referencePath;
+	const TraceRecord* records = nullptr;
+	u64 count = 0;
+	u64 position = 0;
+	int context = TRACE_CONTEXT_DEFAULT;
+	TraceRecord actual = {};
+	bool mismatched = false;
+
+	int MapTrace(const char*);
+public:
+	int Open(const char*);
+	inline TraceCheck Check(const TraceRecord& record)
+	{
+		if (position == count)
+			return TRACE_END;
+		if (std::memcmp(&records[position], &record, sizeof(TraceRecord)) != 0) {
+			actual = record;
+			mismatched = true;
+			return TRACE_MISMATCH;
+		}
+		position++;
+		return TRACE_MATCH;
+	}
+	void SetContext(int);
+	void PrintReport() const;
+	TraceComparator();
+	~TraceComparator();
+};